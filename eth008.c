@@ -4,11 +4,13 @@
  * allows viewing of the IO states, and toggling outputs.
  *
  * compile with:
- *		gcc eth008.c -o eth008
+ *		gcc -pthread eth008.c -o eth008
  *
  *	by James Hendrson, 2024.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -16,7 +18,26 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 #define GET_INFO				0x10
 #define GET_UNLOCK				0x7A
@@ -26,6 +47,159 @@
 #define SET_OUTPUT_ACTIVE		0x20
 #define SET_OUTPUT_INACTIVE		0x21
 
+#define CMD_MAX_REQUEST			32		// Longest command frame.
+#define CMD_MAX_RESPONSE		8		// Longest response frame.
+#define MAX_PASSWORD			(CMD_MAX_REQUEST - 1) // Longest password that fits in a command.
+#define UNLOCK_NO_PASSWORD		255		// GET_UNLOCK answer of a module without a TCP password.
+#define STATE_MAX_AGE_MS		500		// How long known output states may be used without a read-back.
+
+/*
+ * The output states of a module as last read or acknowledged on this session.
+ */
+struct output_cache {
+	uint8_t outputs;
+	uint64_t updated;		// nowNs() when the states were last known, 0 if never.
+	int max_age_ms;			// How old the states may be and still be used.
+};
+
+/*
+ * Syscall and byte counts of the I/O layer.
+ */
+struct io_stats {
+	uint64_t operations;	// High level operations the counts were spent on.
+	uint64_t connects;
+	uint64_t polls;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t frames;		// Command frames written.
+	uint64_t eagain;		// Calls that found the socket not ready.
+	uint64_t timeouts;
+};
+
+/*
+ * The high level operations of the command line, each with its own counts.
+ */
+#define OP_CONNECT				0
+#define OP_UNLOCK				1
+#define OP_INFO					2
+#define OP_TOGGLE				3
+#define OP_OUTPUTS				4
+#define OP_LOGOUT				5
+#define CLI_OPS					6
+
+const char *cli_op_names[CLI_OPS] = { "connect", "unlock", "info", "toggle", "outputs", "logout" };
+struct io_stats cli_stats[CLI_OPS];
+int cli_op;				// The operation the blocking I/O calls are counted against.
+int show_stats;			// Non zero if --stats was given.
+int adaptive_depth;		// Non zero if --adaptive was given.
+int hedge_reads;		// Non zero if --hedge was given.
+int send_buffer;		// SO_SNDBUF for module connections from --sndbuf, 0 for the kernel default.
+
+
+/*
+ * Starts counting blocking I/O calls against a high level operation.
+ *
+ * int op - The OP_ index of the operation.
+ */
+void cliOperation(int op) {
+
+	cli_op = op;
+	cli_stats[op].operations++;
+
+}
+
+/*
+ * How each opcode is framed on the wire and what a good response looks like.
+ *
+ * A response is accepted when (response[0] & ok_mask) == ok_value, so the
+ * check is the same two instructions for every command.
+ */
+struct command_desc {
+	const char *name;
+	uint8_t request_len;	// Bytes sent including the opcode, 0 if the payload sets the length.
+	uint8_t response_len;	// Bytes the module answers with, 0 if the opcode is not supported.
+	uint8_t ok_mask;
+	uint8_t ok_value;
+};
+
+/*
+ * The command table, indexed by opcode. Supporting another opcode is a matter
+ * of adding its row.
+ */
+const struct command_desc command_table[256] = {
+	[GET_INFO]				= { "info",		1, 3, 0x00, 0x00 },	// Module id, hardware and firmware version.
+	[GET_UNLOCK]			= { "unlock",	1, 1, 0x00, 0x00 },	// Seconds until the module locks, 0 if locked.
+	[SEND_PASSWORD]			= { "password",	0, 1, 0xFF, 0x01 },	// 1 if the password was accepted.
+	[LOGOUT]				= { "logout",	1, 1, 0x00, 0x00 },
+	[GET_DIGITAL_OUTPUTS]	= { "get",		1, 1, 0x00, 0x00 },	// One bit per output.
+	[SET_OUTPUT_ACTIVE]		= { "on",		3, 1, 0xFF, 0x00 },	// Output and pulse time, 0 on success.
+	[SET_OUTPUT_INACTIVE]	= { "off",		3, 1, 0xFF, 0x00 },
+};
+
+
+/*
+ * Finds the opcode with the given name in the command table.
+ *
+ * returns -1 if there is no such command, otherwise the opcode.
+ */
+int commandByName(const char * name) {
+
+	for (int op = 0; op < 256; op++) {
+		if (command_table[op].response_len != 0 && strcmp(command_table[op].name, name) == 0) {
+			return op;
+		}
+	}
+	return -1;
+
+}
+
+
+/*
+ * Encodes a command frame.
+ *
+ * uint8_t * frame		- Where to put the frame, at least CMD_MAX_REQUEST bytes.
+ * uint8_t op			- The opcode.
+ * const uint8_t * args	- The bytes following the opcode, missing ones are sent as 0.
+ * int len				- The number of bytes in args.
+ *
+ * returns -1 if the opcode is not supported, otherwise the frame length.
+ */
+int encodeCommand(uint8_t * frame, uint8_t op, const uint8_t * args, int len) {
+
+	const struct command_desc *d = &command_table[op];
+	if (d->response_len == 0) {
+		return -1;
+	}
+
+	int frame_len = d->request_len ? d->request_len : len + 1;
+	if (frame_len > CMD_MAX_REQUEST) {
+		return -1;
+	}
+
+	memset(frame, 0, frame_len);
+	frame[0] = op;
+	if (len > 0) {
+		memcpy(frame + 1, args, len < frame_len - 1 ? len : frame_len - 1);
+	}
+	return frame_len;
+
+}
+
+
+/*
+ * Checks a response against the command table.
+ *
+ * returns non zero if the module accepted the command.
+ */
+int responseValid(uint8_t op, const uint8_t * response) {
+
+	return (response[0] & command_table[op].ok_mask) == command_table[op].ok_value;
+
+}
+
+
 /*
  * Print help text to the screen.
  */
@@ -36,8 +210,133 @@ void printHelp(void) {
   printf("    -P <pass> The password used for unlocking the module if tcp password is enabled\n");
   printf("    -m        Display the module information.\n");
   printf("    -o        Display the digital output states.\n");
-  printf("    -t <io>   Toggle digital output <io> (1 - 8).\n");
+  printf("    -t <io>   Toggle digital output <io> (1 - 8), may be given more than once.\n");
+  printf("    --max-age <ms> Toggle from output states known for at most ms instead of reading them back (defaults to 500, 0 always reads).\n");
+  printf("    --stats   Print the syscalls and bytes spent on each operation.\n");
+  printf("    --rto-min <ms> Shortest time to wait for a module, which is otherwise set from its RTT (defaults to 5).\n");
+  printf("    --rto-max <ms> Longest time to wait for a module (defaults to 5000).\n");
+  printf("    --sndbuf <bytes> Shrink the kernel send buffer of module connections to stress partial writes.\n");
   printf("    -h        This help text.\n");
+  printf("  engine options:\n");
+  printf("    --bench           Benchmark the engine against the targets ip[:port[-last_port]] given.\n");
+  printf("    --modules <n>     Number of modules to spread over the targets (defaults to one per target).\n");
+  printf("    --threads <n>     Number of worker threads, each pinned to a core (defaults to 1).\n");
+  printf("    --depth <n>       Commands in flight per module (defaults to 1).\n");
+  printf("    --adaptive        Adapt each module's commands in flight to its RTT, up to --depth.\n");
+  printf("    --hedge           Repeat a read on a second connection once it takes longer than the module's p95.\n");
+  printf("    --duration <s>    Seconds per benchmark pass (defaults to 5).\n");
+  printf("    --submitters <n>  Submit benchmark commands from n threads outside the engine.\n");
+  printf("    --toggle          Benchmark toggling outputs instead of reading them.\n");
+  printf("    --load            Generate load against the targets, --modules sets the connections.\n");
+  printf("    --rate <n>        Send n commands per second open-loop instead of --depth per connection closed-loop.\n");
+  printf("    --mix <spec>      Load mix of command names and set, e.g. get:70,set:20,info:5,unlock:5.\n");
+  printf("                      A name may take a priority class, e.g. get/bulk:95,set/urgent:5.\n");
+  printf("    --seed <n>        Seed for the load mix and the proxy faults.\n");
+  printf("    --scene <file>    Apply the scene named by the non option argument from a scene file.\n");
+  printf("    --sync-at <time>  With --scene, switch every module at once at +<ms> from now or at absolute seconds.\n");
+  printf("    --clock <clock>   The clock --sync-at is on, realtime (default) or monotonic.\n");
+  printf("    --batch <file>    Run the jobs in a CSV file of address,port,password,operation,output,pulse rows.\n");
+  printf("    --parallel <n>    Modules a batch job works on at once (defaults to 64).\n");
+  printf("    --results <file>  Where to write batch results (defaults to the job file with .results appended).\n");
+  printf("    --discover        Sweep the address ranges given (a.b.c.d, a.b.c.d/bits or a.b.c.d-e.f.g.h) for modules on -p.\n");
+  printf("    --parallel <n>    With --discover, connections open at once (defaults to 1024).\n");
+  printf("    --rate <n>        With --discover, connections started per second (defaults to unlimited).\n");
+  printf("    --inventory <file> The inventory of known modules (defaults to eth008.inventory).\n");
+  printf("    --refresh         Probe again the inventory entries older than --ttl.\n");
+  printf("    --ttl <s>         Seconds an inventory entry is trusted for (defaults to 3600).\n");
+  printf("    --http <port>     Serve an HTTP/1.1 gateway onto the targets, with --bench measure it with --parallel clients.\n");
+  printf("    --mqtt <ip[:port]> Bridge the targets to an MQTT broker (port defaults to 1883).\n");
+  printf("    --topic <prefix>  First level of the bridge topics (defaults to eth008).\n");
+  printf("    --interval <ms>   Time between bridge or Modbus polls of every module (defaults to 1000).\n");
+  printf("    --modbus <port>   Serve the relays of the targets as Modbus TCP coils, coil n is relay n %% 8 + 1 of target n / 8.\n");
+  printf("    --wal <file>      Log every change of desired relay states to file before making it.\n");
+  printf("    --reconcile       Bring every module in the --wal log to its logged states.\n");
+  printf("    --bench           With --wal and no targets, measure durable appends to the log from --threads threads.\n");
+  printf("    --proxy <port>    Forward connections on port to the target, injecting --faults.\n");
+  printf("    --faults <spec>   Proxy faults, e.g. latency=5,jitter=5,split,delay=200:0.05,reset:0.01,blackhole:0.001.\n");
+  printf("    --simulate        Simulate ETH008 modules on the port given by -p.\n");
+  printf("    --sim-count <n>   Number of consecutive ports to simulate modules on (defaults to 1).\n");
+}
+
+
+/*
+ * Returns the CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+}
+
+
+/*
+ * Returns the time on the given clock in nanoseconds.
+ */
+uint64_t clockNs(clockid_t clock) {
+
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+}
+
+
+/*
+ * How long to wait for a module, estimated from its RTT as TCP does its
+ * retransmission timeout (RFC 6298). The timeout is the smoothed RTT plus
+ * four times its mean deviation, clamped to --rto-min and --rto-max, and
+ * doubles with each timeout in a row.
+ */
+#define RTO_MIN_MS				5		// Default lower bound on timeouts.
+#define RTO_MAX_MS				5000	// Default upper bound on timeouts.
+#define RTO_INITIAL_MS			500		// Timeout before any RTT has been measured.
+#define CLI_RTO_SLOTS			1024	// Estimates kept for blocking connections, by descriptor.
+
+struct rto {
+	uint64_t srtt;							// Smoothed RTT in nanoseconds, 0 until measured.
+	uint64_t rttvar;						// Mean deviation of the RTT.
+	int backoff;							// Timeouts in a row.
+	uint64_t sent;							// When the awaited command was written, 0 if not timed.
+};
+
+int rto_min_ms = RTO_MIN_MS;
+int rto_max_ms = RTO_MAX_MS;
+struct rto cli_rto[CLI_RTO_SLOTS];			// Estimates of the connections of the blocking calls.
+
+
+/*
+ * Folds an RTT measurement into an estimate.
+ */
+void rtoSample(struct rto * r, uint64_t rtt) {
+
+	if (r->srtt == 0) {
+		r->srtt = rtt > 0 ? rtt : 1;
+		r->rttvar = rtt / 2;
+	} else {
+		uint64_t err = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+		r->rttvar = (3 * r->rttvar + err) / 4;
+		r->srtt = (7 * r->srtt + rtt) / 8;
+		if (r->srtt == 0) r->srtt = 1;
+	}
+	r->backoff = 0;
+
+}
+
+
+/*
+ * Returns the timeout an estimate gives in nanoseconds.
+ */
+uint64_t rtoTimeout(struct rto * r) {
+
+	uint64_t low = (uint64_t) rto_min_ms * 1000000ull, high = (uint64_t) rto_max_ms * 1000000ull;
+	uint64_t t = r->srtt ? r->srtt + 4 * r->rttvar : (uint64_t) RTO_INITIAL_MS * 1000000ull;
+
+	if (t < low) t = low;
+	t <<= r->backoff < 16 ? r->backoff : 16;
+	return t > high ? high : t;
+
 }
 
 
@@ -65,18 +364,66 @@ int openSocket(char * ip, int port) {
     serv_addr.sin_addr.s_addr = inet_addr(ip);     // Set IP address to connect to
     serv_addr.sin_port = htons(port);              // Set port to connect to
 
+	if (send_buffer > 0) {
+		setsockopt(module_socket, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+	}
+
+    cli_stats[cli_op].connects++;
     if (connect(module_socket, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
 		// Error
 		perror("openSocket - ");
+		close(module_socket);
 		return -1;
     }
+
+	// Reads and writes wait in poll() with a deadline, never in the kernel.
+	fcntl(module_socket, F_SETFL, fcntl(module_socket, F_GETFL) | O_NONBLOCK);
 	
+	// A new connection starts without an estimate.
+	memset(&cli_rto[module_socket % CLI_RTO_SLOTS], 0, sizeof(struct rto));
+
 	// Return the socket handle
 	return module_socket;
 
 }
 
 
+/*
+ * Waits until a socket is ready or a deadline passes, carrying on through
+ * signals.
+ *
+ * int socket			- The file descriptor to wait on.
+ * short events			- POLLIN or POLLOUT.
+ * uint64_t deadline	- When to give up, on the nowNs() clock.
+ *
+ * returns -1 on an error, 0 on a timeout, otherwise 1.
+ */
+int waitSocket(int socket, short events, uint64_t deadline) {
+
+	struct pollfd fds[1];
+	fds[0].fd = socket;
+	fds[0].events = events;
+
+	for (;;) {
+
+		uint64_t now = nowNs();
+		if (now >= deadline) {
+			return 0;
+		}
+
+		int ev = poll(fds, 1, (int) ((deadline - now + 999999) / 1000000));
+		cli_stats[cli_op].polls++;
+
+		if (ev < 0 && errno == EINTR) {
+			continue;
+		}
+		return ev < 0 ? -1 : ev > 0;
+
+	}
+
+}
+
+
 /*
  * Tries to read a number of bytes from the given file descriptor
  * into the given buffer.
@@ -89,93 +436,157 @@ int openSocket(char * ip, int port) {
  */
 int readData(int socket, uint8_t *buffer, int num) {
 
-	struct pollfd fds[1];
-	fds[0].fd = socket;
-	fds[0].events = POLLIN;
+	// Wait for the whole answer for as long as the RTT of the module suggests
+	struct rto *rto = &cli_rto[socket % CLI_RTO_SLOTS];
+	uint64_t timeout = rtoTimeout(rto);
+	uint64_t deadline = nowNs() + timeout;
+	int count = 0;
 
-	// Check to see if data is ready to read on the socket
-	int ev = poll(fds, 1, 500);
+	while (count < num) {
 
-	if (ev == -1) {
-		// Error
-		perror("readData - ");
-		return -1;
-	} else if (ev == 0) {
-		// Timeout
-		perror("readData - ");
-		return -1;
-	} else if (fds[0].revents & POLLIN) {
-	
-		// Socket ready for reading
-		int count = 0;
+		int ev = waitSocket(socket, POLLIN, deadline);
+		if (ev < 0) {
+			// Error
+			perror("readData - ");
+			return -1;
+		} else if (ev == 0) {
+			// Timeout
+			cli_stats[cli_op].timeouts++;
+			rto->backoff++;
+			rto->sent = 0;
+			printf("readData - timed out after %.1f ms\n", timeout / 1e6);
+			return -1;
+		}
 
-		while (count < num) {
+		// The first answer after a write times the module.
+		if (rto->sent) {
+			rtoSample(rto, nowNs() - rto->sent);
+			rto->sent = 0;
+		}
 
-			int rd = read(socket, buffer + count, num - count);
-			
-			if (rd == 0) {
-				// End of file
-				return count;
-			} else if (rd == -1) {
-				// Error
-				perror("readData - ");
-				return -1;
-			}
-			
-			count += rd;
+		int rd = read(socket, buffer + count, num - count);
+		cli_stats[cli_op].reads++;
 
+		if (rd == 0) {
+			// End of file
+			return count;
+		} else if (rd == -1) {
+			if (errno == EAGAIN) {
+				cli_stats[cli_op].eagain++;
+				continue;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			// Error
+			perror("readData - ");
+			return -1;
 		}
 
-		return count;
+		count += rd;
+		cli_stats[cli_op].bytes_read += rd;
 
 	}
 
-	return -1;
+	return count;
 
 }
 
 
 /*
- * Tries to write an ammount of data to a module.
+ * Tries to write an ammount of data to a module. Whatever does not fit in
+ * the send buffer goes out as it drains, until the module's timeout.
  *
  * int socket		- The file descriptor to write to.
  * uint8_t * data	- A buffer containing the data to write.
  * int num			- The number of bytes to write.
+ *
+ * returns -1 on an error, otherwise the number of bytes written.
  */
 int writeData(int socket, uint8_t * data, int num) {
-	
 
-	struct pollfd fds[1];
-	fds[0].fd = socket;
-	fds[0].events = POLLOUT;
+	struct rto *rto = &cli_rto[socket % CLI_RTO_SLOTS];
+	uint64_t timeout = rtoTimeout(rto);
+	uint64_t deadline = nowNs() + timeout;
+	int count = 0;
 
-	int ev = poll(fds, 1, 500);
-	
-	if (ev == -1) {
-		// Error
-		perror("writeData - ");
-		return -1;
-	} else if (ev == 0) {
-		// Timeout
-		perror("writeData - ");
-		return -1;
-	} else if (fds[0].revents & POLLOUT) {
+	while (count < num) {
+
+		int ev = waitSocket(socket, POLLOUT, deadline);
+		if (ev < 0) {
+			// Error
+			perror("writeData - ");
+			return -1;
+		} else if (ev == 0) {
+			// Timeout
+			cli_stats[cli_op].timeouts++;
+			rto->backoff++;
+			printf("writeData - timed out after %.1f ms\n", timeout / 1e6);
+			return -1;
+		}
 
-		// Can write to socket now
-		int written = write(socket, data, num); // Try and write data to the socket
+		// A short write leaves the rest for the next time the socket is writable.
+		int written = write(socket, data + count, num - count);
+		cli_stats[cli_op].writes++;
 
 		if (written < 0) {
+			if (errno == EAGAIN) {
+				cli_stats[cli_op].eagain++;
+				continue;
+			} else if (errno == EINTR) {
+				continue;
+			}
 			perror("writeData: ");
 			return -1;
-		} else if (written != num) {
-			printf("%u bytes written out of %u requested\n", written, num);
-			return -1;
 		}
 
-		return written;
+		count += written;
+		cli_stats[cli_op].bytes_written += written;
+
 	}
 
-	return -1;
+	cli_stats[cli_op].frames++;
+
+	// Time the oldest write still waiting for an answer.
+	if (rto->sent == 0) {
+		rto->sent = nowNs();
+	}
+
+	return count;
+
+}
+
+
+/*
+ * Sends one command to a module and reads its response, framed from the
+ * command table.
+ *
+ * int socket			- The socket descriptor.
+ * uint8_t op			- The opcode.
+ * const uint8_t * args	- The bytes following the opcode.
+ * int len				- The number of bytes in args.
+ * uint8_t * response	- Where to put the response.
+ *
+ * returns -1 on an error, 1 if the module rejected the command, otherwise 0.
+ */
+int transact(int socket, uint8_t op, const uint8_t * args, int len, uint8_t * response) {
+
+	uint8_t frame[CMD_MAX_REQUEST];
+	int frame_len = encodeCommand(frame, op, args, len);
+
+	if (frame_len < 0) {
+		printf("transact - unsupported command 0x%02X\n", op);
+		return -1;
+	}
+
+	if (writeData(socket, frame, frame_len) < 0) {
+		return -1;
+	}
+
+	if (readData(socket, response, command_table[op].response_len) < 0) {
+		return -1;
+	}
+
+	return responseValid(op, response) ? 0 : 1;
 
 }
 
@@ -183,23 +594,22 @@ int writeData(int socket, uint8_t * data, int num) {
 /**
  * Prints the module data to standard output.
  *
- * int socket		- The file descriptor of the module socket.
+ * int socket		- The file descriptor of the module socket, or -1 to print info as it is.
+ * uint8_t * info	- Set to the module ID, hardware and firmware version read.
  *
  */
-void printModuleInfo(int socket) {
+void printModuleInfo(int socket, uint8_t * info) {
 	
-	uint8_t buffer[10] = {0};
-	buffer[0] = GET_INFO;	// command to get back the module info 
-
-	if (writeData(socket, buffer, 1) < 0) {
-		exit(EXIT_FAILURE);
-	}
+	uint8_t buffer[CMD_MAX_RESPONSE] = {0};
 
-	if (readData(socket, buffer, 3) < 0) {
-		exit(EXIT_FAILURE);
+	if (socket >= 0) {
+		if (transact(socket, GET_INFO, NULL, 0, buffer) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		memcpy(info, buffer, 3);
 	}
 
-	printf("Module ID: %d\nHardware version: %d\nFirmware version: %d\n", buffer[0], buffer[1], buffer[2]); 
+	printf("Module ID: %d\nHardware version: %d\nFirmware version: %d\n", info[0], info[1], info[2]); 
 
 }
 
@@ -213,13 +623,9 @@ void printModuleInfo(int socket) {
  */
 uint8_t getUnlockTime(int socket) {
 
-	uint8_t buffer[1] = { GET_UNLOCK }; // The command to get the unlock time
-
-	if (writeData(socket, buffer, 1) < 0) {
-		exit(EXIT_FAILURE);
-	}
+	uint8_t buffer[CMD_MAX_RESPONSE];
 
-	if (readData(socket, buffer, 1) < 0) {
+	if (transact(socket, GET_UNLOCK, NULL, 0, buffer) < 0) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -236,25 +642,14 @@ uint8_t getUnlockTime(int socket) {
  */
 void sendPassword(int socket, char * password) {
 
-	uint8_t buffer[100] = { 0 };
-	
-	// Put the password in the buffer to write out starting at index 1 so that the
-	// send password command can be placed in the buffer before it.
-	int len = strlen(password);
-	for (int pi = 0; pi < len; pi++) {
-		buffer[pi+1] = password[pi];
-	}
-	buffer[0] = SEND_PASSWORD; // Put the send password command in front of the password
-
-	if (writeData(socket, buffer, strlen(password) + 1) < 0) {
-		exit(EXIT_FAILURE);
-	}
+	uint8_t buffer[CMD_MAX_RESPONSE];
+	int result = transact(socket, SEND_PASSWORD, (uint8_t *) password, strlen(password), buffer);
 
-	if (readData(socket, buffer, 1) < 0) {
+	if (result < 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (buffer[0] != 1) {
+	if (result > 0) {
 		printf("Password error.");
 		exit(EXIT_FAILURE);
 	}
@@ -269,16 +664,47 @@ void sendPassword(int socket, char * password) {
  */
 void sendLogout(int socket) {
 
-	uint8_t buffer[1] = { LOGOUT }; // The command to log out
+	uint8_t buffer[CMD_MAX_RESPONSE];
 
-	if (writeData(socket, buffer, 1) < 0) {
+	if (transact(socket, LOGOUT, NULL, 0, buffer) < 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (readData(socket, buffer, 1) < 0) {
-		exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Unlocks a module with the password if it needs one.
+ *
+ * int socket		- The socket descriptor.
+ * char * password	- The password, or NULL if none was given.
+ *
+ * returns -1 if the module could not be unlocked, otherwise the unlock time
+ * first reported, UNLOCK_NO_PASSWORD if the module has no password.
+ */
+int unlockModule(int socket, char * password) {
+
+	// check unlock time to see if we need to send a password.
+	uint8_t unlock_time = getUnlockTime(socket);
+	if (unlock_time != 0) {
+		return unlock_time;
+	}
+
+	// We need to send a password before we can control this module
+	if (password == NULL) {
+		printf("A password is needed.\n");
+		return -1;
 	}
 
+	sendPassword(socket, password); // send the password
+
+	if (getUnlockTime(socket) == 0) { // Check to see if the password has unlocked the module
+		printf("Unable to unlock module,\n");
+		return -1;
+	}
+
+	return 0;
+
 }
 
 
@@ -290,13 +716,7 @@ void sendLogout(int socket) {
  */
 void getDigitalOutputStates(int socket, uint8_t * buffer) {
 
-	buffer[0] = GET_DIGITAL_OUTPUTS; // Command to get the output states back from the module
-
-	if (writeData(socket, buffer, 1) < 0) {
-		exit(EXIT_FAILURE);
-	}
-
-	if (readData(socket, buffer, 1) < 0) {
+	if (transact(socket, GET_DIGITAL_OUTPUTS, NULL, 0, buffer) < 0) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -327,14 +747,24 @@ void printOutputStates(int socket) {
 /*
  * Tries to toggle a digital output.
  *
- * int socket		- The socket descriptor.
- * uint8_t output	- the output to toggle.
+ * int socket					- The socket descriptor.
+ * uint8_t output				- the output to toggle.
+ * struct output_cache * cache	- Output states known on this session, or NULL.
  */
-void toggleDigitalOutput(int socket, uint8_t output) {
+void toggleDigitalOutput(int socket, uint8_t output, struct output_cache * cache) {
 
-	uint8_t buffer[3] = { 0 };
+	uint8_t buffer[CMD_MAX_RESPONSE] = { 0 };
 
-	getDigitalOutputStates(socket, buffer);
+	// Use the known states if they are fresh enough, otherwise read them back.
+	if (cache != NULL && cache->updated != 0 && nowNs() - cache->updated <= (uint64_t) cache->max_age_ms * 1000000ull) {
+		buffer[0] = cache->outputs;
+	} else {
+		getDigitalOutputStates(socket, buffer);
+		if (cache != NULL) {
+			cache->outputs = buffer[0];
+			cache->updated = nowNs();
+		}
+	}
 	
 	// Check the state of the bit representing the optput to toggle,
 	// and get the command to switch it to the opposite state.
@@ -345,58 +775,8182 @@ void toggleDigitalOutput(int socket, uint8_t output) {
 		return;	// Not a valid input number so do nothing.
 	}
 
-	buffer[0] = command; // The command tosend either the output active, or inactive.
-	buffer[1] = output;	// The output to switch.
-	buffer[2] = 0x00; // A pulse time, 0 in this case to make the change permanent.
+	// The output to switch, and a pulse time of 0 to make the change permanent.
+	uint8_t args[2] = { output, 0x00 };
+	int result = transact(socket, command, args, sizeof(args), buffer);
 
-	if (writeData(socket, buffer, 3) < 0) {
+	if (result < 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (readData(socket, buffer, 1) < 0) {
-		exit(EXIT_FAILURE);
+	// An acknowledged write tells us the new state, anything else leaves it unknown.
+	if (cache != NULL) {
+		if (result == 0) {
+			cache->outputs ^= 0x01 << (output - 1);
+			cache->updated = nowNs();
+		} else {
+			cache->updated = 0;
+		}
 	}
 
 }
 
 
-int main(int argc, char ** argv) {
+/*
+ * Engine limits and defaults.
+ */
+#define MAX_SHARDS				64
+#define RECONNECT_MS			1000
+#define EPOLL_BATCH				256
+#define INBOX_SIZE				16384	// Commands each shard inbox can hold, a power of two.
+#define FLUSH_BATCH				64		// Most frames gathered into one writev() call.
+#define RX_BUFFER				256		// Receive ring per module, a power of two.
+#define RTT_MIN_WINDOW_MS		10000	// How long the lowest RTT seen stays the baseline.
+#define RTT_SLACK_US			100		// RTT inflation taken as noise on top of doubling.
+#define HEDGE_SAMPLES			40		// Read latencies kept per module.
+#define HEDGE_RANK				(HEDGE_SAMPLES / 20 + 1)	// The p95 is the HEDGE_RANK longest of them.
 
-	int info = 0; // Used to indicate if we should print the module information.
-	int outputs = 0; // Used to indicate if we should show the digital output states.
-	uint8_t toggle = 0; // Used to indicate if we want to toggle a digital output.
-	int port = 17494; // The port that the module is on.
-	char *password = NULL; // The password used to unlock the module
+/*
+ * Completion status of a command.
+ */
+#define STATUS_OK				0
+#define STATUS_ERROR			-1
+#define STATUS_TIMEOUT			-2
+#define STATUS_LOCKED			-3
+#define STATUS_REJECTED			-4		// The module answered but refused the command.
 
-	int opt;
+/*
+ * Connection states of a module.
+ */
+#define MOD_IDLE				0
+#define MOD_CONNECTING			1
+#define MOD_UNLOCKING			2
+#define MOD_READY				3
+#define MOD_BACKOFF				4
 
-	while ((opt = getopt(argc, argv, "omiaP:p:t:h")) != -1) {
+/*
+ * Scheduling classes of a command, lowest first. A module's queue is kept
+ * in priority order, and bulk commands always leave a slot of its pipeline
+ * free, so anything more urgent is at most one response from the wire.
+ */
+#define PRIORITY_BULK			0		// Polling and batch jobs.
+#define PRIORITY_NORMAL			1
+#define PRIORITY_URGENT			2
+#define PRIORITY_CLASSES		3
 
-		switch (opt) {
+char *priority_names[PRIORITY_CLASSES] = { "bulk", "normal", "urgent" };
 
-			case 'h':
-				printHelp();
-				break;
+struct shard;
+struct ring;
 
-			/*
-			 * The m option displays the module information
-			 */
-			case 'm':
-				info = 1;
-				break;
-			
-			/*
-			 * The p option allows us to set the port. it defaulte to 17494.
-			 */
-			case 'p':
-				port = atoi(optarg);
+/*
+ * A bump allocator carved out of one block allocated up front, so that
+ * everything the engine needs exists before the first command is sent.
+ */
+struct arena {
+	char *base;
+	size_t size;
+	size_t used;
+};
+
+/*
+ * A fixed set of commands handed out and returned by a single thread.
+ */
+struct command_pool {
+	struct command *cmds;
+	struct command *free;
+	int size;
+	int available;
+};
+
+/*
+ * A single request to a module and, once complete, its response.
+ *
+ * When complete the command is pushed onto its reply ring if it has one,
+ * otherwise the done callback is run on the thread of the shard that owns
+ * the module the command was sent to.
+ */
+struct command {
+	struct command *next;
+	int module;								// Index of the target module in the engine.
+	uint8_t request[CMD_MAX_REQUEST];
+	int request_len;
+	uint8_t response[CMD_MAX_RESPONSE];
+	int response_len;
+	int status;								// One of the STATUS_ values once complete.
+	uint64_t submitted;						// CLOCK_MONOTONIC times in nanoseconds.
+	uint64_t sent;
+	uint64_t completed;
+	void (*done)(struct command *cmd);
+	void *user;
+	struct ring *reply;						// Completion ring of the submitting thread, or NULL.
+	uint8_t toggle;							// Output to toggle once the states are known, 0 if none.
+	uint8_t logged;							// The SET a toggle turns into is logged before it is sent.
+	uint8_t close;							// End the session once this command is answered.
+	uint8_t priority;						// One of the PRIORITY_ classes.
+};
+
+/*
+ * A bounded lock-free multi-producer, single-consumer queue of commands.
+ *
+ * Any thread may push, only the owner pops. The owner sleeps on the eventfd,
+ * which producers only write to when the owner has armed it before sleeping,
+ * so a busy consumer costs producers no syscalls.
+ */
+struct ring_cell {
+	uint64_t sequence;
+	struct command *cmd;
+};
+
+struct ring {
+	struct ring_cell *cells;
+	uint64_t mask;
+	int fd;									// eventfd used to wake the owner.
+	int armed;								// Set by the owner when it is about to sleep.
+	int owned;								// The cells were allocated by ringInit.
+	uint64_t head __attribute__((aligned(64)));	// Next slot to push, shared by producers.
+	uint64_t tail __attribute__((aligned(64)));	// Next slot to pop, owner only.
+};
+
+/*
+ * Where a module lives and how to unlock it.
+ */
+struct module_config {
+	struct sockaddr_in addr;
+	char *password;
+	int open;								// Known from the inventory not to need a password.
+};
+
+/*
+ * The connection to one module. Only ever touched by the owning shard thread.
+ */
+struct module {
+	int index;
+	struct module_config config;
+	struct shard *shard;
+	int fd;
+	int state;
+	int unlock_step;						// Progress through the unlock handshake.
+	struct command handshake;				// Internal command used while unlocking.
+	struct command *queue_head;				// Commands waiting to be sent.
+	struct command *queue_tail;
+	struct command *inflight_head;			// Commands sent and waiting for a response.
+	struct command *inflight_tail;
+	int inflight;
+	int out_sent;							// Bytes of the queue head already written.
+	int writing;							// Waiting for the socket to drain.
+	int readback;							// A toggle is reading the states, nothing may pass it.
+	int log_toggles;						// Toggles whose SET the engine is to log, see walSubmit().
+	uint8_t rx[RX_BUFFER];					// Receive ring, responses not yet matched to commands.
+	uint32_t rx_head;						// Free running read and write positions in rx.
+	uint32_t rx_tail;
+	struct io_stats io;						// Only written by the shard thread.
+	uint8_t outputs;						// Output states once everything sent has been applied.
+	uint64_t outputs_known;					// When the states were last confirmed, 0 if unknown.
+	uint64_t deadline;						// Timer expiry, 0 when no timer is set.
+	int timer_index;						// Position in the shard timer heap or -1.
+	int dirty;								// On the shard dirty list.
+	struct module *dirty_next;
+	double window;							// Commands allowed in flight when the depth adapts.
+	uint64_t rtt_min;						// Baseline RTT, the lowest seen lately.
+	uint64_t rtt_min_at;
+	uint64_t window_hold;					// No further decrease before this.
+	uint64_t rtt_backoffs;					// Window decreases on inflated RTT.
+	uint64_t timeout_backoffs;				// Window resets on timeouts.
+	struct rto rto;							// How long to wait for the module.
+	struct module *twin;					// Other connection to the same module, each hedges the reads of the other.
+	struct command *hedged;					// The read a hedge is racing, NULL if none.
+	struct command hedge;					// The duplicate of that read sent on the twin.
+	struct command hedge_stub;				// Takes the place of a read the hedge answered first.
+	int hedge_busy;							// hedge is on the twin.
+	int stub_busy;							// hedge_stub is in flight.
+	int diverted;							// Reads moved to the twin while the stub is in flight.
+	uint32_t read_us[HEDGE_SAMPLES];		// Latest read latencies in microseconds.
+	uint64_t reads;
+	uint64_t hedges;
+	uint64_t hedge_wins;					// Hedges answered before the read they raced.
+	uint64_t diversions;
+};
+
+/*
+ * One worker thread with its own event loop, timers and modules.
+ */
+struct shard {
+	int id;
+	int cpu;								// Core the thread is pinned to, or -1.
+	pthread_t thread;
+	struct engine *engine;
+	int epoll_fd;
+	struct ring inbox;						// Commands handed over by other threads.
+	struct module **timers;					// Min-heap of modules ordered by deadline.
+	int timer_count;
+	struct module *dirty;					// Modules with queued commands to flush.
+	int stop;
+	uint64_t completed;						// Only written by the shard thread.
+	uint64_t failed;
+	uint64_t polls;							// epoll_wait() calls.
+} __attribute__((aligned(64)));
+
+/*
+ * A set of shards with the modules spread across them.
+ */
+struct engine {
+	struct arena arena;						// Holds the shards, modules, timers and inboxes.
+	struct shard *shards;
+	int shard_count;
+	struct module *modules;
+	int module_count;
+	int depth;								// Maximum commands in flight per module.
+	int adaptive;							// Adapt each module's depth to its RTT, up to depth.
+	int hedge;								// Each module has a twin to hedge reads on.
+	int max_age_ms;							// How long confirmed output states may be trusted.
+	int (*log_set)(struct engine *e, struct command *cmd); // Logs a SET just before it is sent, see walSubmit().
+};
+
+static __thread struct shard *current_shard; // The shard running on this thread, if any.
+
+
+#ifdef ALLOC_COUNTER
+
+/*
+ * Test hook: when built with -DALLOC_COUNTER every heap allocation made by the
+ * process, including those inside libc, is counted so that modes can check
+ * that nothing is allocated once they have warmed up.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+#endif
+
+
+/*
+ * Returns the number of heap allocations made so far, or -1 if the program
+ * was built without the ALLOC_COUNTER hook.
+ */
+long long allocationCount(void) {
+
+#ifdef ALLOC_COUNTER
+	return (long long) __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+#else
+	return -1;
+#endif
+
+}
+
+
+/*
+ * Rounds a size up to a whole number of cache lines.
+ */
+size_t cacheLines(size_t size) {
+
+	return (size + 63) & ~(size_t) 63;
+
+}
+
+
+/*
+ * Allocates the single block an arena hands out.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int arenaInit(struct arena * a, size_t size) {
+
+	a->size = cacheLines(size);
+	a->used = 0;
+	if (posix_memalign((void **) &a->base, 64, a->size) != 0) {
+		perror("arenaInit - ");
+		return -1;
+	}
+	memset(a->base, 0, a->size);
+	return 0;
+
+}
+
+
+/*
+ * Takes a zeroed, cache line aligned piece of an arena. Running out is a
+ * sizing bug, not a runtime condition, so it is fatal.
+ */
+void * arenaAlloc(struct arena * a, size_t size) {
+
+	size = cacheLines(size);
+	if (a->used + size > a->size) {
+		printf("arenaAlloc - arena of %zu bytes exhausted\n", a->size);
+		exit(EXIT_FAILURE);
+	}
+
+	void *p = a->base + a->used;
+	a->used += size;
+	return p;
+
+}
+
+
+/*
+ * Sets up a pool of count commands.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int commandPoolInit(struct command_pool * pool, int count) {
+
+	pool->cmds = calloc(count, sizeof(*pool->cmds));
+	if (pool->cmds == NULL) {
+		perror("commandPoolInit - ");
+		return -1;
+	}
+
+	pool->size = pool->available = count;
+	pool->free = NULL;
+	for (int i = count - 1; i >= 0; i--) {
+		pool->cmds[i].next = pool->free;
+		pool->free = &pool->cmds[i];
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Takes a command from a pool.
+ *
+ * returns NULL when every command is in use.
+ */
+struct command * commandAlloc(struct command_pool * pool) {
+
+	struct command *cmd = pool->free;
+	if (cmd) {
+		pool->free = cmd->next;
+		pool->available--;
+		memset(cmd, 0, sizeof(*cmd));
+	}
+	return cmd;
+
+}
+
+
+/*
+ * Returns a command to its pool.
+ */
+void commandRelease(struct command_pool * pool, struct command * cmd) {
+
+	cmd->next = pool->free;
+	pool->free = cmd;
+	pool->available++;
+
+}
+
+
+/*
+ * Frees the commands of a pool.
+ */
+void commandPoolFree(struct command_pool * pool) {
+
+	free(pool->cmds);
+	pool->cmds = pool->free = NULL;
+
+}
+
+
+/*
+ * Returns the bytes a ring of the given capacity needs for its cells.
+ */
+size_t ringSize(int size) {
+
+	uint64_t cap = 1;
+	while (cap < (uint64_t) size) cap <<= 1;
+	return cap * sizeof(struct ring_cell);
+
+}
+
+
+/*
+ * Sets up a ring able to hold size commands.
+ *
+ * struct ring * r	- The ring.
+ * int size			- The capacity, rounded up to a power of two.
+ * struct arena * a	- The arena to take the cells from, or NULL to allocate them.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int ringInit(struct ring * r, int size, struct arena * a) {
+
+	uint64_t cap = 1;
+	while (cap < (uint64_t) size) cap <<= 1;
+
+	memset(r, 0, sizeof(*r));
+	r->cells = a ? arenaAlloc(a, ringSize(size)) : calloc(cap, sizeof(*r->cells));
+	r->mask = cap - 1;
+	r->owned = a == NULL;
+	r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (r->cells == NULL || r->fd < 0) {
+		perror("ringInit - ");
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < cap; i++) {
+		r->cells[i].sequence = i;
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Releases the memory and eventfd of a ring.
+ */
+void ringFree(struct ring * r) {
+
+	close(r->fd);
+	if (r->owned) {
+		free(r->cells);
+	}
+
+}
+
+
+/*
+ * Wakes the owner of a ring if it has said it is going to sleep.
+ */
+void ringWake(struct ring * r) {
+
+	if (__atomic_exchange_n(&r->armed, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(r->fd, &one, sizeof(one)) < 0) {
+			perror("ringWake - ");
+		}
+	}
+
+}
+
+
+/*
+ * Pushes a command onto a ring from any thread.
+ *
+ * returns -1 if the ring is full, otherwise 0.
+ */
+int ringPush(struct ring * r, struct command * cmd) {
+
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+
+		struct ring_cell *cell = &r->cells[pos & r->mask];
+		uint64_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) seq - (int64_t) pos;
+
+		if (diff == 0) {
+			// The slot is free, try to claim it.
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				cell->cmd = cmd;
+				__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+				ringWake(r);
+				return 0;
+			}
+		} else if (diff < 0) {
+			return -1; // Full
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+
+	}
+
+}
+
+
+/*
+ * Pops a command off a ring. Only called by the owner.
+ *
+ * returns NULL when the ring is empty.
+ */
+struct command * ringPop(struct ring * r) {
+
+	struct ring_cell *cell = &r->cells[r->tail & r->mask];
+
+	if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != r->tail + 1) {
+		return NULL;
+	}
+
+	struct command *cmd = cell->cmd;
+	__atomic_store_n(&cell->sequence, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+	r->tail++;
+	return cmd;
+
+}
+
+
+/*
+ * Tells producers the owner is about to sleep on the ring eventfd.
+ *
+ * returns non zero if the ring already has commands and the owner should not sleep.
+ */
+int ringArm(struct ring * r) {
+
+	__atomic_store_n(&r->armed, 1, __ATOMIC_SEQ_CST);
+	struct ring_cell *cell = &r->cells[r->tail & r->mask];
+	return __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) == r->tail + 1;
+
+}
+
+
+/*
+ * Clears the eventfd of a ring after the owner has woken up.
+ */
+void ringAck(struct ring * r) {
+
+	uint64_t value;
+	if (read(r->fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		perror("ringAck - ");
+	}
+
+}
+
+
+/*
+ * Waits for the next completed command on a reply ring.
+ *
+ * struct ring * r	- The reply ring.
+ * int timeout		- The longest to wait in milliseconds, -1 for ever.
+ *
+ * returns NULL on timeout, otherwise the completed command.
+ */
+struct command * ringWait(struct ring * r, int timeout) {
+
+	for (;;) {
+
+		struct command *cmd = ringPop(r);
+		if (cmd) {
+			return cmd;
+		}
+
+		if (ringArm(r)) {
+			continue;
+		}
+
+		struct pollfd fds[1];
+		fds[0].fd = r->fd;
+		fds[0].events = POLLIN;
+
+		int ev = poll(fds, 1, timeout);
+		if (ev == 0) {
+			return NULL;
+		} else if (ev < 0 && errno != EINTR) {
+			perror("ringWait - ");
+			return NULL;
+		}
+		ringAck(r);
+
+	}
+
+}
+
+
+/*
+ * Fills in a command for the given module from the command table.
+ *
+ * struct command * cmd	- The command to fill in.
+ * int module			- The index of the target module.
+ * uint8_t op			- The opcode to send.
+ * const uint8_t * args	- The bytes following the opcode.
+ * int len				- The number of bytes in args.
+ *
+ * returns -1 if the opcode is not supported, otherwise 0.
+ */
+int commandEncode(struct command * cmd, int module, uint8_t op, const uint8_t * args, int len) {
+
+	cmd->next = NULL;
+	cmd->module = module;
+	cmd->status = STATUS_OK;
+	cmd->toggle = 0;
+	cmd->logged = 0;
+	cmd->close = 0;
+	cmd->priority = PRIORITY_NORMAL;
+	cmd->request_len = encodeCommand(cmd->request, op, args, len);
+	cmd->response_len = command_table[op].response_len;
+
+	return cmd->request_len < 0 ? -1 : 0;
+
+}
+
+
+/*
+ * Looks up a priority class by name.
+ *
+ * returns -1 if there is no such class, otherwise the class.
+ */
+int priorityByName(const char * name) {
+
+	for (int p = 0; p < PRIORITY_CLASSES; p++) {
+		if (strcmp(priority_names[p], name) == 0) {
+			return p;
+		}
+	}
+	return -1;
+
+}
+
+
+/*
+ * Fills in a command for the given module and opcode.
+ *
+ * struct command * cmd	- The command to fill in.
+ * int module			- The index of the target module.
+ * uint8_t op			- The opcode to send.
+ * uint8_t output		- The output for SET_OUTPUT_ commands (1 - 8).
+ * uint8_t pulse		- The pulse time for SET_OUTPUT_ commands, 0 for permanent.
+ *
+ * returns -1 if the opcode is not supported, otherwise 0.
+ */
+int commandPrepare(struct command * cmd, int module, uint8_t op, uint8_t output, uint8_t pulse) {
+
+	uint8_t args[2] = { output, pulse };
+	return commandEncode(cmd, module, op, args, sizeof(args));
+
+}
+
+
+/*
+ * Fills in a command that toggles an output. The shard decides which SET
+ * command to send when it reaches the wire, using the known output states
+ * if they are fresh and reading them back first if not.
+ */
+void commandPrepareToggle(struct command * cmd, int module, uint8_t output) {
+
+	commandPrepare(cmd, module, GET_DIGITAL_OUTPUTS, 0, 0);
+	cmd->toggle = output;
+
+}
+
+
+/*
+ * Swaps two entries of the shard timer heap.
+ */
+void timerSwap(struct shard * s, int a, int b) {
+
+	struct module *t = s->timers[a];
+	s->timers[a] = s->timers[b];
+	s->timers[b] = t;
+	s->timers[a]->timer_index = a;
+	s->timers[b]->timer_index = b;
+
+}
+
+
+/*
+ * Restores the heap order around the given heap position.
+ */
+void timerFix(struct shard * s, int i) {
+
+	// Sift up
+	while (i > 0 && s->timers[(i - 1) / 2]->deadline > s->timers[i]->deadline) {
+		timerSwap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	// Sift down
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, m = i;
+		if (l < s->timer_count && s->timers[l]->deadline < s->timers[m]->deadline) m = l;
+		if (r < s->timer_count && s->timers[r]->deadline < s->timers[m]->deadline) m = r;
+		if (m == i) break;
+		timerSwap(s, i, m);
+		i = m;
+	}
+
+}
+
+
+/*
+ * Sets, moves or clears (deadline 0) the timer of a module.
+ */
+void timerSet(struct module * mod, uint64_t deadline) {
+
+	struct shard *s = mod->shard;
+	int i = mod->timer_index;
+
+	mod->deadline = deadline;
+
+	if (deadline == 0) {
+		if (i < 0) return;
+		s->timer_count--;
+		if (i != s->timer_count) {
+			timerSwap(s, i, s->timer_count);
+			timerFix(s, i);
+		}
+		mod->timer_index = -1;
+	} else if (i < 0) {
+		mod->timer_index = s->timer_count;
+		s->timers[s->timer_count++] = mod;
+		timerFix(s, mod->timer_index);
+	} else {
+		timerFix(s, i);
+	}
+
+}
+
+
+/*
+ * Marks a module as having commands to send at the end of the loop iteration.
+ */
+void moduleMarkDirty(struct module * mod) {
+
+	if (!mod->dirty) {
+		mod->dirty = 1;
+		mod->dirty_next = mod->shard->dirty;
+		mod->shard->dirty = mod;
+	}
+
+}
+
+
+/*
+ * Runs the completion callback of a command.
+ */
+void commandComplete(struct command * cmd, int status) {
+
+	cmd->status = status;
+	cmd->completed = nowNs();
+
+	if (status == STATUS_OK) {
+		current_shard->completed++;
+	} else {
+		current_shard->failed++;
+	}
+	current_shard->engine->modules[cmd->module].io.operations++;
+
+	// A toggle that failed before learning its SET has nothing left to log.
+	if (cmd->toggle && cmd->logged) {
+		__atomic_fetch_sub(&current_shard->engine->modules[cmd->module].log_toggles, 1, __ATOMIC_RELEASE);
+	}
+
+	if (cmd->reply) {
+		// The submitter sizes its ring for everything it has outstanding.
+		while (ringPush(cmd->reply, cmd) < 0) {
+			sched_yield();
+		}
+	} else if (cmd->done) {
+		cmd->done(cmd);
+	}
+
+}
+
+
+/*
+ * Returns non zero for a command that only reads, the kind that may be hedged.
+ */
+int commandIsRead(struct command * cmd) {
+
+	return cmd->toggle == 0 && cmd->close == 0
+			&& (cmd->request[0] == GET_DIGITAL_OUTPUTS || cmd->request[0] == GET_INFO);
+
+}
+
+
+/*
+ * Returns the p95 of the latest read latencies of a module in nanoseconds,
+ * 0 until HEDGE_SAMPLES reads have been timed.
+ */
+uint64_t moduleReadP95(struct module * mod) {
+
+	if (mod->reads < HEDGE_SAMPLES) {
+		return 0;
+	}
+
+	// The HEDGE_RANK longest, longest first.
+	uint32_t top[HEDGE_RANK] = { 0 };
+	for (int i = 0; i < HEDGE_SAMPLES; i++) {
+		uint32_t us = mod->read_us[i];
+		int j = HEDGE_RANK;
+		while (j > 0 && us > top[j - 1]) {
+			if (j < HEDGE_RANK) {
+				top[j] = top[j - 1];
+			}
+			j--;
+		}
+		if (j < HEDGE_RANK) {
+			top[j] = us;
+		}
+	}
+	return (uint64_t) top[HEDGE_RANK - 1] * 1000;
+
+}
+
+
+/*
+ * Returns non zero if a read of a module may be hedged now. Only the
+ * command at the head of the pipeline is, only when it is a plain read,
+ * and only when no write is in flight with it that the duplicate could
+ * overtake.
+ */
+int moduleHedgeable(struct module * mod) {
+
+	struct command *cmd = mod->inflight_head;
+	if (mod->twin == NULL || cmd == NULL || mod->hedged || mod->hedge_busy || mod->stub_busy
+			|| cmd == &mod->handshake || mod->state != MOD_READY || !commandIsRead(cmd)) {
+		return 0;
+	}
+
+	for (struct command *c = cmd->next; c; c = c->next) {
+		if (c->request[0] == SET_OUTPUT_ACTIVE || c->request[0] == SET_OUTPUT_INACTIVE) {
+			return 0;
+		}
+	}
+	return 1;
+
+}
+
+
+/*
+ * Sets the timer of a module for the command at the head of its pipeline:
+ * its timeout, or sooner when its read is to be hedged.
+ */
+void moduleArmTimer(struct module * mod) {
+
+	struct command *cmd = mod->inflight_head;
+	if (cmd == NULL) {
+		timerSet(mod, 0);
+		return;
+	}
+
+	uint64_t deadline = cmd->sent + rtoTimeout(&mod->rto);
+	uint64_t p95 = moduleReadP95(mod);
+	if (p95 && cmd->sent + p95 < deadline && moduleHedgeable(mod)) {
+		deadline = cmd->sent + p95;
+	}
+	timerSet(mod, deadline);
+
+}
+
+
+/*
+ * Takes the answer to a hedge. If the read it raced is still waiting, the
+ * read completes with this answer and a stub takes its place at the head of
+ * the pipeline to absorb the late answer on the slow connection.
+ *
+ * struct module * mod	- The module the hedge was made for.
+ * int status			- The status of the hedge.
+ */
+void moduleHedgeAnswered(struct module * mod, int status) {
+
+	struct command *cmd = mod->hedged;
+	mod->hedge_busy = 0;
+	mod->hedged = NULL;
+	if (cmd == NULL || status != STATUS_OK || mod->stub_busy || mod->inflight_head != cmd) {
+		return;
+	}
+
+	struct command *stub = &mod->hedge_stub;
+	memcpy(stub->request, cmd->request, cmd->request_len);
+	stub->request_len = cmd->request_len;
+	stub->response_len = cmd->response_len;
+	stub->module = mod->index;
+	stub->sent = cmd->sent;
+	stub->toggle = 0;
+	stub->close = 0;
+	stub->priority = cmd->priority;
+	stub->next = cmd->next;
+	mod->inflight_head = stub;
+	if (mod->inflight_tail == cmd) {
+		mod->inflight_tail = stub;
+	}
+	mod->stub_busy = 1;
+	mod->hedge_wins++;
+	moduleMarkDirty(mod); // Reads queued behind it can go to the twin.
+
+	cmd->next = NULL;
+	memcpy(cmd->response, mod->hedge.response, cmd->response_len);
+	commandComplete(cmd, responseValid(cmd->request[0], cmd->response) ? STATUS_OK : STATUS_REJECTED);
+
+}
+
+
+/*
+ * Finishes a command a module no longer holds. The handshake and hedging
+ * commands are internal and only need their module told.
+ */
+void moduleRetire(struct module * mod, struct command * cmd, int status) {
+
+	if (cmd == &mod->handshake) {
+		return;
+	}
+	if (cmd == &mod->hedge_stub) {
+		mod->stub_busy = 0;
+		return;
+	}
+	if (mod->twin && cmd == &mod->twin->hedge) {
+		moduleHedgeAnswered(mod->twin, status);
+		return;
+	}
+	if (cmd->module != mod->index && --mod->twin->diverted == 0) {
+		moduleMarkDirty(mod->twin); // Writes held behind the diverted reads may go.
+	}
+	if (cmd == mod->hedged) {
+		mod->hedged = NULL;
+	}
+	commandComplete(cmd, status);
+
+}
+
+
+/*
+ * Closes the connection to a module and fails every command it holds.
+ * The module backs off before reconnecting if more commands arrive.
+ *
+ * struct module * mod	- The module.
+ * int status			- The status to fail the commands with.
+ */
+void moduleFail(struct module * mod, int status) {
+
+	if (mod->fd >= 0) {
+		close(mod->fd);
+		mod->fd = -1;
+	}
+
+	// Detach the lists first as callbacks may queue new commands.
+	struct command *inflight = mod->inflight_head;
+	struct command *queued = mod->queue_head;
+	mod->inflight_head = mod->inflight_tail = NULL;
+	mod->queue_head = mod->queue_tail = NULL;
+	mod->inflight = 0;
+	mod->out_sent = 0;
+	mod->writing = 0;
+	mod->readback = 0;
+	mod->rx_head = mod->rx_tail = 0;
+	mod->outputs_known = 0;
+	mod->state = MOD_BACKOFF;
+	timerSet(mod, nowNs() + (uint64_t) RECONNECT_MS * 1000000ull);
+
+	struct command *lists[2] = { inflight, queued };
+	for (int l = 0; l < 2; l++) {
+		while (lists[l]) {
+			struct command *cmd = lists[l];
+			lists[l] = cmd->next;
+			cmd->next = NULL;
+			moduleRetire(mod, cmd, status);
+		}
+	}
+
+}
+
+
+/*
+ * Starts a non blocking connection to a module.
+ */
+void moduleConnect(struct module * mod) {
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd < 0) {
+		perror("moduleConnect - ");
+		moduleFail(mod, STATUS_ERROR);
+		return;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (send_buffer > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+	}
+
+	mod->io.connects++;
+	if (connect(fd, (struct sockaddr *) &mod->config.addr, sizeof(mod->config.addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		moduleFail(mod, STATUS_ERROR);
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = mod;
+	epoll_ctl(mod->shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+	mod->fd = fd;
+	mod->state = MOD_CONNECTING;
+	timerSet(mod, nowNs() + rtoTimeout(&mod->rto));
+
+}
+
+
+/*
+ * Ends the session with a module once a closing command has been answered.
+ * Anything pipelined behind it is failed, and a new session is started if
+ * more commands were queued since.
+ */
+void moduleClose(struct module * mod) {
+
+	close(mod->fd);
+	mod->fd = -1;
+	mod->out_sent = 0; // The new session sends the head again from the start.
+	mod->writing = 0;
+	mod->readback = 0;
+	mod->rx_head = mod->rx_tail = 0;
+	mod->outputs_known = 0;
+	mod->state = MOD_IDLE;
+	timerSet(mod, 0);
+
+	struct command *inflight = mod->inflight_head;
+	mod->inflight_head = mod->inflight_tail = NULL;
+	mod->inflight = 0;
+	while (inflight) {
+		struct command *cmd = inflight;
+		inflight = cmd->next;
+		cmd->next = NULL;
+		moduleRetire(mod, cmd, STATUS_ERROR);
+	}
+
+	if (mod->queue_head && mod->state == MOD_IDLE) {
+		moduleConnect(mod);
+	}
+
+}
+
+
+/*
+ * Queues a command on a module ahead of everything not yet written.
+ */
+void moduleQueueFront(struct module * mod, struct command * cmd) {
+
+	struct command **link = mod->out_sent > 0 ? &mod->queue_head->next : &mod->queue_head;
+	cmd->next = *link;
+	*link = cmd;
+	if (cmd->next == NULL) {
+		mod->queue_tail = cmd;
+	}
+
+}
+
+
+/*
+ * Puts the internal handshake command at the front of the queue.
+ */
+void moduleHandshake(struct module * mod, uint8_t op) {
+
+	struct command *cmd = &mod->handshake;
+
+	if (op == SEND_PASSWORD) {
+		int len = strlen(mod->config.password);
+		if (len > MAX_PASSWORD) {
+			len = MAX_PASSWORD;
+		}
+		commandEncode(cmd, mod->index, op, (uint8_t *) mod->config.password, len);
+	} else {
+		commandEncode(cmd, mod->index, op, NULL, 0);
+	}
+	cmd->priority = PRIORITY_URGENT; // Nothing may be queued ahead of it.
+
+	moduleQueueFront(mod, cmd);
+	moduleMarkDirty(mod);
+
+}
+
+
+/*
+ * Steps the unlock handshake along as each of its responses arrives.
+ */
+void moduleHandshakeDone(struct command * cmd) {
+
+	struct module *mod = cmd->user;
+
+	switch (mod->unlock_step++) {
+		case 0: // First GET_UNLOCK, 0 means the module is locked.
+			if (cmd->response[0] != 0) {
+				break;
+			}
+			if (mod->config.password == NULL) {
+				moduleFail(mod, STATUS_LOCKED);
+				return;
+			}
+			moduleHandshake(mod, SEND_PASSWORD);
+			return;
+		case 1: // SEND_PASSWORD
+			if (cmd->status != STATUS_OK) {
+				moduleFail(mod, STATUS_LOCKED);
+				return;
+			}
+			moduleHandshake(mod, GET_UNLOCK);
+			return;
+		default: // Second GET_UNLOCK to check the password unlocked the module.
+			if (cmd->response[0] == 0) {
+				moduleFail(mod, STATUS_LOCKED);
+				return;
+			}
+			break;
+	}
+
+	mod->state = MOD_READY;
+	moduleMarkDirty(mod);
+
+}
+
+
+/*
+ * Applies the effect of a SET command about to be sent to the predicted
+ * output states of a module.
+ */
+void moduleApplySet(struct module * mod, struct command * cmd) {
+
+	uint8_t bit = 0x01 << (cmd->request[1] - 1);
+
+	if (cmd->request[2] != 0) {
+		mod->outputs_known = 0; // A pulse ends on its own, so the state is no longer known.
+	} else if (cmd->request[0] == SET_OUTPUT_ACTIVE) {
+		mod->outputs |= bit;
+	} else {
+		mod->outputs &= ~bit;
+	}
+
+}
+
+
+/*
+ * Turns a toggle into the SET command that flips its output from the given states.
+ */
+void moduleResolveToggle(struct command * cmd, uint8_t outputs) {
+
+	uint8_t output = cmd->toggle;
+	uint8_t op = (outputs & (0x01 << (output - 1))) != 0 ? SET_OUTPUT_INACTIVE : SET_OUTPUT_ACTIVE;
+	struct command *next = cmd->next;
+	uint8_t priority = cmd->priority;
+
+	commandPrepare(cmd, cmd->module, op, output, 0);
+	cmd->next = next; // The toggle may be resolved in the middle of the queue.
+	cmd->priority = priority;
+
+}
+
+
+/*
+ * Adjusts how many commands a module may have in flight from the RTT of a
+ * response, AIMD style. The baseline is the lowest RTT seen over the last
+ * RTT_MIN_WINDOW_MS. A response taking more than twice that means commands
+ * are queueing inside the module, so the window is halved, at most once per
+ * RTT. Otherwise, if the window was full, it grows by one command per
+ * window's worth of responses, up to the engine depth.
+ *
+ * struct module * mod	- The module.
+ * uint64_t rtt			- Nanoseconds from sending the command to its response.
+ * uint64_t now			- The time of the response.
+ */
+void moduleAdapt(struct module * mod, uint64_t rtt, uint64_t now) {
+
+	struct engine *e = mod->shard->engine;
+
+	if (mod->rtt_min == 0 || rtt <= mod->rtt_min || now - mod->rtt_min_at > RTT_MIN_WINDOW_MS * 1000000ull) {
+		mod->rtt_min = rtt;
+		mod->rtt_min_at = now;
+	}
+
+	if (rtt > 2 * mod->rtt_min + RTT_SLACK_US * 1000ull) {
+		if (now >= mod->window_hold) {
+			mod->window = mod->window / 2 < 1 ? 1 : mod->window / 2;
+			mod->window_hold = now + rtt;
+			mod->rtt_backoffs++;
+		}
+	} else if (mod->inflight + 1 >= (int) mod->window) {
+		mod->window += 1 / mod->window;
+		if (mod->window > e->depth) {
+			mod->window = e->depth;
+		}
+	}
+
+}
+
+
+/*
+ * Returns how many commands a module may have in flight.
+ */
+int moduleDepth(struct module * mod) {
+
+	struct engine *e = mod->shard->engine;
+	return e->adaptive ? (int) mod->window : e->depth;
+
+}
+
+
+/*
+ * Updates the known output states of a module from a completed command.
+ */
+void moduleObserve(struct module * mod, struct command * cmd) {
+
+	switch (cmd->request[0]) {
+
+		case GET_DIGITAL_OUTPUTS:
+			// Later commands already in flight still apply on top of what was read.
+			mod->outputs = cmd->response[0];
+			mod->outputs_known = nowNs();
+			for (struct command *c = mod->inflight_head; c; c = c->next) {
+				if (c->request[0] == SET_OUTPUT_ACTIVE || c->request[0] == SET_OUTPUT_INACTIVE) {
+					moduleApplySet(mod, c);
+				}
+			}
+			break;
+
+		case SET_OUTPUT_ACTIVE:
+		case SET_OUTPUT_INACTIVE:
+			if (!responseValid(cmd->request[0], cmd->response)) {
+				mod->outputs_known = 0;
+			} else if (mod->outputs_known != 0 && cmd->request[2] == 0) {
+				mod->outputs_known = nowNs();
+			}
+			break;
+
+	}
+
+}
+
+
+/*
+ * Queues a command on a module behind every queued command of the same or
+ * a higher priority.
+ */
+void moduleQueue(struct module * mod, struct command * cmd) {
+
+	if (mod->queue_tail == NULL || mod->queue_tail->priority >= cmd->priority) {
+		cmd->next = NULL;
+		if (mod->queue_tail) {
+			mod->queue_tail->next = cmd;
+		} else {
+			mod->queue_head = cmd;
+		}
+		mod->queue_tail = cmd;
+		return;
+	}
+
+	// The tail is of a lower priority, so this stops before the end unless
+	// the tail is a partly written head, which stays where it is whatever
+	// its priority.
+	struct command **link = mod->out_sent > 0 ? &mod->queue_head->next : &mod->queue_head;
+	while (*link && (*link)->priority >= cmd->priority) {
+		link = &(*link)->next;
+	}
+	cmd->next = *link;
+	*link = cmd;
+	if (cmd->next == NULL) {
+		mod->queue_tail = cmd;
+	}
+
+}
+
+
+/*
+ * Moves the reads at the front of a module's queue to its twin while the
+ * connection has nothing in flight but a read the hedge has already
+ * answered, as whatever held that read up holds up everything behind it.
+ * Reads that were moved here from the twin stay, so that they cannot end
+ * up behind a write queued after them.
+ */
+void moduleDivert(struct module * mod) {
+
+	while (mod->stub_busy && mod->inflight == 1 && mod->out_sent == 0 && mod->queue_head && mod->queue_head->module == mod->index
+			&& mod->queue_head != &mod->handshake && mod->queue_head != &mod->twin->hedge
+			&& commandIsRead(mod->queue_head)) {
+
+		struct command *cmd = mod->queue_head;
+		mod->queue_head = cmd->next;
+		if (mod->queue_head == NULL) {
+			mod->queue_tail = NULL;
+		}
+
+		struct module *twin = mod->twin;
+		moduleQueue(twin, cmd);
+		if (twin->state == MOD_IDLE) {
+			moduleConnect(twin);
+		}
+		moduleMarkDirty(twin);
+		mod->diverted++;
+		mod->diversions++;
+
+	}
+
+}
+
+
+/*
+ * Asks for a writable event on a module's socket while the kernel has no
+ * room for what is queued, and drops it again once it has.
+ */
+void moduleWatchWrite(struct module * mod, int on) {
+
+	if (mod->writing == on) {
+		return;
+	}
+	mod->writing = on;
+
+	struct epoll_event ev;
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = mod;
+	epoll_ctl(mod->shard->epoll_fd, EPOLL_CTL_MOD, mod->fd, &ev);
+
+}
+
+
+/*
+ * Logs the SETs at the front of a module's queue that walSubmit() left to
+ * the engine, up to the first toggle that does not know its SET yet, so the
+ * log has them in the order they are sent. One that cannot be logged fails
+ * without being sent. The commit holds up the shard while it syncs.
+ */
+void moduleLogSets(struct module * mod) {
+
+	struct engine *e = mod->shard->engine;
+	struct command *prev = NULL;
+	struct command *cmd = mod->queue_head;
+
+	// A flush sends no more than FLUSH_BATCH commands.
+	for (int i = 0; cmd && i < FLUSH_BATCH; i++) {
+
+		struct command *next = cmd->next;
+		if (cmd->toggle && cmd->logged) {
+			return;
+		}
+		if (cmd->logged) {
+			cmd->logged = 0;
+			if (e->log_set(e, cmd) < 0) {
+				if (prev) {
+					prev->next = next;
+				} else {
+					mod->queue_head = next;
+				}
+				if (mod->queue_tail == cmd) {
+					mod->queue_tail = prev;
+				}
+				cmd->next = NULL;
+				commandComplete(cmd, STATUS_ERROR);
+				if (mod->fd < 0) {
+					return; // A callback failed the module.
+				}
+				cmd = next;
+				continue;
+			}
+		}
+
+		prev = cmd;
+		cmd = next;
+
+	}
+
+}
+
+
+/*
+ * Writes as many queued commands as the pipeline depth allows, gathered
+ * into a single writev() call. A command the kernel only took part of stays
+ * at the head of the queue and the rest goes once the socket drains.
+ */
+void moduleFlush(struct module * mod) {
+
+	if (mod->state != MOD_READY && mod->state != MOD_UNLOCKING) {
+		return;
+	}
+
+	if (mod->stub_busy) {
+		moduleDivert(mod);
+	}
+
+	if (mod->shard->engine->log_set && !mod->readback) {
+		moduleLogSets(mod);
+		if (mod->fd < 0) {
+			return;
+		}
+	}
+
+	struct shard *s = mod->shard;
+	struct iovec iov[FLUSH_BATCH];
+	uint64_t now = nowNs();
+	size_t total = 0;
+	int n = 0;
+	int bulk = -1; // Bulk commands in flight, counted when first needed.
+
+	int depth = moduleDepth(mod);
+	for (struct command *cmd = mod->queue_head; cmd && n < FLUSH_BATCH
+			&& (mod->inflight + n < depth || mod->out_sent > 0); cmd = cmd->next) {
+
+		// The rest of a partly written command goes first, whatever else has changed.
+		if (n == 0 && mod->out_sent > 0) {
+			iov[0].iov_base = cmd->request + mod->out_sent;
+			iov[0].iov_len = cmd->request_len - mod->out_sent;
+			total += iov[0].iov_len;
+			n++;
+			continue;
+		}
+
+		// Nothing may overtake a toggle until it knows which SET it is, so
+		// that later commands and toggles of the same output see its effect.
+		if (mod->readback) {
+			break;
+		}
+
+		// Nothing but the handshake may go out until the module is unlocked.
+		if (mod->state == MOD_UNLOCKING && (cmd != &mod->handshake || mod->inflight > 0)) {
+			break;
+		}
+
+		// Nor may a write overtake reads moved to the twin.
+		if (mod->diverted > 0 && cmd != &mod->handshake && !commandIsRead(cmd)) {
+			break;
+		}
+
+		// Bulk commands leave the last slot to anything more urgent. The
+		// queue is in priority order, so only bulk commands remain.
+		if (cmd->priority == PRIORITY_BULK) {
+			if (bulk < 0) {
+				bulk = 0;
+				for (struct command *c = mod->inflight_head; c; c = c->next) {
+					bulk += c->priority == PRIORITY_BULK;
+				}
+			}
+			if (bulk >= (depth > 1 ? depth - 1 : 1)) {
+				break;
+			}
+			bulk++;
+		}
+
+		// A toggle goes straight out as a SET when the states are fresh,
+		// otherwise as a read-back that is turned into the SET on completion.
+		// One that has to be logged is always read back, the log being
+		// written on completion.
+		if (cmd->toggle && !cmd->logged && mod->outputs_known != 0
+				&& now - mod->outputs_known <= (uint64_t) s->engine->max_age_ms * 1000000ull) {
+			moduleResolveToggle(cmd, mod->outputs);
+		}
+
+		if (cmd->request[0] == SET_OUTPUT_ACTIVE || cmd->request[0] == SET_OUTPUT_INACTIVE) {
+			moduleApplySet(mod, cmd);
+		} else if (cmd->toggle) {
+			mod->readback = 1;
+		}
+
+		iov[n].iov_base = cmd->request;
+		iov[n].iov_len = cmd->request_len;
+		total += cmd->request_len;
+		n++;
+
+	}
+
+	if (n == 0) {
+		moduleWatchWrite(mod, 0);
+		return;
+	}
+
+	ssize_t written = writev(mod->fd, iov, n);
+	mod->io.writes++;
+	if (written < 0) {
+		if (errno == EAGAIN) {
+			mod->io.eagain++;
+		} else if (errno != EINTR) {
+			moduleFail(mod, STATUS_ERROR);
+			return;
+		}
+		moduleWatchWrite(mod, 1);
+		return;
+	}
+	mod->io.bytes_written += written;
+
+	// Every command the kernel took all of is now on the wire.
+	int gathered = n;
+	size_t done = mod->out_sent + written;
+	int started = mod->inflight_head == NULL;
+	while (n-- > 0 && done >= (size_t) mod->queue_head->request_len) {
+
+		struct command *cmd = mod->queue_head;
+		done -= cmd->request_len;
+		mod->io.frames++;
+		mod->queue_head = cmd->next;
+		if (mod->queue_head == NULL) {
+			mod->queue_tail = NULL;
+		}
+
+		cmd->next = NULL;
+		cmd->sent = now;
+		if (mod->inflight_tail) {
+			mod->inflight_tail->next = cmd;
+		} else {
+			mod->inflight_head = cmd;
+		}
+		mod->inflight_tail = cmd;
+		mod->inflight++;
+
+	}
+
+	mod->out_sent = (int) done;
+	moduleWatchWrite(mod, (size_t) written < total);
+
+	if (started && mod->inflight_head) {
+		moduleArmTimer(mod);
+	}
+
+	// The depth may allow more than one batch, which goes out until the
+	// kernel stops taking it all.
+	if (gathered == FLUSH_BATCH && (size_t) written == total) {
+		moduleMarkDirty(mod);
+	}
+
+}
+
+
+/*
+ * Matches the complete responses in the receive ring of a module to the
+ * commands in flight, in the order they were sent.
+ */
+void moduleParse(struct module * mod) {
+
+	while (mod->inflight_head) {
+
+		struct command *cmd = mod->inflight_head;
+		if (mod->rx_tail - mod->rx_head < (uint32_t) cmd->response_len) {
+			return;
+		}
+
+		for (int i = 0; i < cmd->response_len; i++) {
+			cmd->response[i] = mod->rx[mod->rx_head++ & (RX_BUFFER - 1)];
+		}
+
+		mod->inflight_head = cmd->next;
+		if (mod->inflight_head == NULL) {
+			mod->inflight_tail = NULL;
+		}
+		mod->inflight--;
+		cmd->next = NULL;
+		if (cmd == mod->hedged) {
+			mod->hedged = NULL; // The read beat its hedge.
+		}
+
+		moduleMarkDirty(mod);
+		moduleObserve(mod, cmd);
+		uint64_t now = nowNs();
+		rtoSample(&mod->rto, now - cmd->sent);
+		if (mod->shard->engine->adaptive) {
+			moduleAdapt(mod, now - cmd->sent, now);
+		}
+
+		// Time reads for the hedging threshold.
+		if (cmd != &mod->handshake && cmd != &mod->hedge_stub && commandIsRead(cmd)) {
+			mod->read_us[mod->reads++ % HEDGE_SAMPLES] = (uint32_t) ((now - cmd->sent) / 1000);
+		}
+
+		// The head command is complete, start the timer for the next one.
+		moduleArmTimer(mod);
+
+		// A toggle that had to read the states back goes out again as its SET.
+		if (cmd->toggle && cmd->request[0] == GET_DIGITAL_OUTPUTS) {
+			mod->readback = 0;
+			int logged = cmd->logged;
+			if (logged) {
+				__atomic_fetch_sub(&mod->log_toggles, 1, __ATOMIC_RELEASE);
+			}
+			moduleResolveToggle(cmd, mod->outputs);
+
+			// Nothing may reach a module before it is in the log, so the
+			// commit holds up the shard while it syncs.
+			if (logged && mod->shard->engine->log_set(mod->shard->engine, cmd) < 0) {
+				commandComplete(cmd, STATUS_ERROR);
+				if (mod->fd < 0) {
+					return;
+				}
+				continue;
+			}
+
+			moduleApplySet(mod, cmd);
+			moduleQueueFront(mod, cmd);
+			continue;
+		}
+
+		int status = responseValid(cmd->request[0], cmd->response) ? STATUS_OK : STATUS_REJECTED;
+		if (cmd == &mod->hedge_stub || (mod->twin && cmd == &mod->twin->hedge)) {
+			moduleRetire(mod, cmd, status);
+			continue;
+		}
+		if (cmd->module != mod->index && cmd != &mod->handshake && --mod->twin->diverted == 0) {
+			moduleMarkDirty(mod->twin);
+		}
+
+		int close_session = cmd->close;
+		commandComplete(cmd, status);
+
+		if (mod->fd < 0) {
+			return; // A callback failed the module.
+		}
+		if (close_session) {
+			moduleClose(mod);
+			return;
+		}
+
+	}
+
+}
+
+
+/*
+ * Reads whatever the kernel has for a module into its receive ring, then
+ * hands every complete response to the command waiting for it.
+ */
+void moduleRead(struct module * mod) {
+
+	for (;;) {
+
+		// The free part of the ring may wrap around the end of the buffer.
+		uint32_t space = RX_BUFFER - (mod->rx_tail - mod->rx_head);
+		uint32_t start = mod->rx_tail & (RX_BUFFER - 1);
+		uint32_t first = space < RX_BUFFER - start ? space : RX_BUFFER - start;
+		struct iovec iov[2];
+		iov[0].iov_base = mod->rx + start;
+		iov[0].iov_len = first;
+		iov[1].iov_base = mod->rx;
+		iov[1].iov_len = space - first;
+
+		ssize_t rd = readv(mod->fd, iov, iov[1].iov_len ? 2 : 1);
+		mod->io.reads++;
+
+		if (rd == 0) {
+			moduleFail(mod, STATUS_ERROR); // End of file
+			return;
+		} else if (rd < 0) {
+			if (errno == EAGAIN) {
+				mod->io.eagain++;
+			} else if (errno != EINTR) {
+				moduleFail(mod, STATUS_ERROR);
+			}
+			return;
+		}
+
+		mod->rx_tail += rd;
+		mod->io.bytes_read += rd;
+		moduleParse(mod);
+		if (mod->fd < 0) {
+			return;
+		}
+
+		// Bytes nobody asked for mean the stream is out of step with the commands.
+		if (mod->inflight_head == NULL && mod->rx_tail != mod->rx_head) {
+			moduleFail(mod, STATUS_ERROR);
+			return;
+		}
+
+		if ((uint32_t) rd < space) {
+			return; // The kernel had nothing more.
+		}
+
+	}
+
+}
+
+
+/*
+ * Handles an epoll event for a module.
+ */
+void moduleEvent(struct module * mod, uint32_t events) {
+
+	if (mod->state == MOD_CONNECTING) {
+
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(mod->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+		if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+			moduleFail(mod, STATUS_ERROR);
+			return;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = mod;
+		epoll_ctl(mod->shard->epoll_fd, EPOLL_CTL_MOD, mod->fd, &ev);
+
+		timerSet(mod, 0);
+
+		// A module known to have no password needs no handshake.
+		if (mod->config.open) {
+			mod->state = MOD_READY;
+			moduleMarkDirty(mod);
+			return;
+		}
+
+		mod->state = MOD_UNLOCKING;
+		mod->unlock_step = 0;
+		moduleHandshake(mod, GET_UNLOCK);
+		return;
+
+	}
+
+	if (events & EPOLLIN) {
+		moduleRead(mod);
+	} else if (events & (EPOLLERR | EPOLLHUP)) {
+		moduleFail(mod, STATUS_ERROR);
+	}
+
+	// The socket has room again for what the last flush could not write.
+	if ((events & EPOLLOUT) && mod->fd >= 0 && mod->writing) {
+		moduleFlush(mod);
+	}
+
+}
+
+
+/*
+ * Queues a command on a module owned by the current shard.
+ */
+void moduleEnqueue(struct module * mod, struct command * cmd) {
+
+	moduleQueue(mod, cmd);
+
+	if (mod->state == MOD_IDLE) {
+		moduleConnect(mod);
+	}
+	moduleMarkDirty(mod);
+
+}
+
+
+/*
+ * Moves every command handed over by other threads onto its module.
+ */
+void shardDrainInbox(struct shard * s) {
+
+	struct command *cmd;
+	while ((cmd = ringPop(&s->inbox)) != NULL) {
+		moduleEnqueue(&s->engine->modules[cmd->module], cmd);
+	}
+
+}
+
+
+/*
+ * Sends a duplicate of the read at the head of a module's pipeline on its
+ * twin connection, to race the original.
+ */
+void moduleHedge(struct module * mod) {
+
+	struct command *cmd = mod->inflight_head;
+	struct command *h = &mod->hedge;
+
+	memcpy(h->request, cmd->request, cmd->request_len);
+	h->request_len = cmd->request_len;
+	h->response_len = cmd->response_len;
+	h->module = mod->twin->index;
+	h->toggle = 0;
+	h->close = 0;
+	h->priority = cmd->priority;
+	h->reply = NULL;
+	h->done = NULL;
+
+	mod->hedged = cmd;
+	mod->hedge_busy = 1;
+	mod->hedges++;
+	moduleEnqueue(mod->twin, h);
+
+}
+
+
+/*
+ * Fires every timer that has expired.
+ */
+void shardExpireTimers(struct shard * s) {
+
+	uint64_t now = nowNs();
+
+	while (s->timer_count > 0 && s->timers[0]->deadline <= now) {
+
+		struct module *mod = s->timers[0];
+		timerSet(mod, 0);
+
+		if (mod->state == MOD_BACKOFF) {
+			mod->state = MOD_IDLE;
+			if (mod->queue_head) {
+				moduleConnect(mod);
+			}
+		} else {
+
+			// The answer may be waiting behind events this pass has not reached yet.
+			if (mod->inflight_head && mod->state != MOD_CONNECTING) {
+				moduleRead(mod);
+				if (mod->fd < 0 || mod->deadline != 0 || mod->inflight_head == NULL) {
+					continue;
+				}
+			}
+
+			// A read past the module's p95 but not its timeout gets a duplicate on the twin.
+			struct command *head = mod->inflight_head;
+			if (head && now < head->sent + rtoTimeout(&mod->rto)) {
+				if (moduleHedgeable(mod)) {
+					moduleHedge(mod);
+				}
+				moduleArmTimer(mod);
+				continue;
+			}
+
+			// A timeout is the firmware falling behind, start again from one command at a time.
+			mod->io.timeouts++;
+			mod->rto.backoff++;
+			if (mod->window > 1) {
+				mod->window = 1;
+				mod->timeout_backoffs++;
+			}
+			moduleFail(mod, STATUS_TIMEOUT);
+		}
+
+	}
+
+}
+
+
+/*
+ * The event loop of a shard thread.
+ */
+void * shardRun(void * arg) {
+
+	struct shard *s = arg;
+	struct epoll_event events[EPOLL_BATCH];
+
+	current_shard = s;
+
+	if (s->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(s->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+
+		// Sleep until the next timer at the latest, unless commands are waiting.
+		int timeout = -1;
+		if (ringArm(&s->inbox)) {
+			timeout = 0;
+		} else if (s->timer_count > 0) {
+			uint64_t now = nowNs();
+			uint64_t next = s->timers[0]->deadline;
+			timeout = next <= now ? 0 : (int) ((next - now + 999999) / 1000000);
+		}
+
+		int n = epoll_wait(s->epoll_fd, events, EPOLL_BATCH, timeout);
+		s->polls++;
+		if (n < 0 && errno != EINTR) {
+			perror("shardRun - ");
+			break;
+		}
+
+		__atomic_store_n(&s->inbox.armed, 0, __ATOMIC_RELAXED);
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == s) {
+				ringAck(&s->inbox);
+			} else {
+				moduleEvent(events[i].data.ptr, events[i].events);
+			}
+		}
+
+		shardDrainInbox(s);
+
+		shardExpireTimers(s);
+
+		// Send everything queued during this iteration.
+		while (s->dirty) {
+			struct module *mod = s->dirty;
+			s->dirty = mod->dirty_next;
+			mod->dirty = 0;
+			moduleFlush(mod);
+		}
+
+	}
+
+	current_shard = NULL;
+	return NULL;
+
+}
+
+
+/*
+ * Creates an engine with the modules spread across a number of shards.
+ *
+ * struct module_config * configs	- The modules to talk to.
+ * int count						- The number of modules.
+ * int shards						- The number of worker threads.
+ * int pin							- Non zero to pin each worker to its own core.
+ *
+ * returns NULL on failure, otherwise the engine.
+ */
+struct engine * engineCreate(struct module_config * configs, int count, int shards, int pin) {
+
+	if (shards < 1) shards = 1;
+	if (shards > MAX_SHARDS) shards = MAX_SHARDS;
+
+	// Everything per shard and per module comes out of one arena sized here.
+	// Hedging gives every module a twin on the same shard.
+	int total = hedge_reads ? 2 * count : count;
+	int per_shard = total / shards + 1;
+	struct arena arena;
+	if (arenaInit(&arena, cacheLines(sizeof(struct engine))
+			+ cacheLines(shards * sizeof(struct shard))
+			+ cacheLines(total * sizeof(struct module))
+			+ shards * (cacheLines(per_shard * sizeof(struct module *)) + cacheLines(ringSize(INBOX_SIZE)))) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	struct engine *e = arenaAlloc(&arena, sizeof(*e));
+	e->shard_count = shards;
+	e->module_count = count;
+	e->depth = 1;
+	e->adaptive = adaptive_depth;
+	e->hedge = hedge_reads;
+	e->max_age_ms = STATE_MAX_AGE_MS;
+	e->log_set = NULL;
+	e->shards = arenaAlloc(&arena, shards * sizeof(*e->shards));
+	e->modules = arenaAlloc(&arena, total * sizeof(*e->modules));
+
+	// Pin the workers to the cores this process is allowed to run on.
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE], ncpu = 0;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	for (int c = 0; c < CPU_SETSIZE; c++) {
+		if (CPU_ISSET(c, &allowed)) cpus[ncpu++] = c;
+	}
+
+	for (int i = 0; i < shards; i++) {
+
+		struct shard *s = &e->shards[i];
+		s->id = i;
+		s->engine = e;
+		s->cpu = pin && ncpu > 0 ? cpus[i % ncpu] : -1;
+		s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		s->timers = arenaAlloc(&arena, per_shard * sizeof(*s->timers));
+
+		if (s->epoll_fd < 0 || ringInit(&s->inbox, INBOX_SIZE, &arena) < 0) {
+			perror("engineCreate - ");
+			exit(EXIT_FAILURE);
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->inbox.fd, &ev);
+
+	}
+
+	for (int m = 0; m < total; m++) {
+		struct module *mod = &e->modules[m];
+		mod->index = m;
+		mod->config = configs[m % count];
+		mod->shard = &e->shards[m % count % shards];
+		mod->fd = -1;
+		mod->timer_index = -1;
+		mod->handshake.done = moduleHandshakeDone;
+		mod->handshake.user = mod;
+		mod->window = 1;
+		if (m >= count) {
+			mod->twin = &e->modules[m - count];
+			mod->twin->twin = mod;
+		}
+	}
+
+	e->arena = arena;
+	return e;
+
+}
+
+
+/*
+ * Starts the shard threads.
+ */
+void engineStart(struct engine * e) {
+
+	for (int i = 0; i < e->shard_count; i++) {
+		if (pthread_create(&e->shards[i].thread, NULL, shardRun, &e->shards[i]) != 0) {
+			perror("engineStart - ");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+}
+
+
+/*
+ * Submits a command to the shard owning its module. Safe to call from any
+ * thread; commands from other threads are handed over through the lock-free
+ * shard inbox. Set cmd->reply to have the completed command pushed onto a
+ * ring owned by the caller instead of running cmd->done on the shard.
+ *
+ * returns -1 if the shard inbox is full, otherwise 0.
+ */
+int engineSubmit(struct engine * e, struct command * cmd) {
+
+	struct shard *s = &e->shards[cmd->module % e->shard_count];
+
+	cmd->submitted = nowNs();
+	cmd->next = NULL;
+
+	if (current_shard == s) {
+		moduleEnqueue(&e->modules[cmd->module], cmd);
+		return 0;
+	}
+
+	return ringPush(&s->inbox, cmd);
+
+}
+
+
+/*
+ * Counters summed over every shard of an engine.
+ */
+struct engine_totals {
+	uint64_t completed;
+	uint64_t failed;
+	struct io_stats io;						// Module I/O plus the shards' epoll_wait() calls.
+};
+
+
+/*
+ * Adds one set of I/O counts to another. The source may belong to a running
+ * shard, so each counter is read atomically but the set is not a single snapshot.
+ */
+void ioStatsAdd(struct io_stats * total, struct io_stats * add) {
+
+	total->operations += __atomic_load_n(&add->operations, __ATOMIC_RELAXED);
+	total->connects += __atomic_load_n(&add->connects, __ATOMIC_RELAXED);
+	total->polls += __atomic_load_n(&add->polls, __ATOMIC_RELAXED);
+	total->reads += __atomic_load_n(&add->reads, __ATOMIC_RELAXED);
+	total->writes += __atomic_load_n(&add->writes, __ATOMIC_RELAXED);
+	total->bytes_read += __atomic_load_n(&add->bytes_read, __ATOMIC_RELAXED);
+	total->bytes_written += __atomic_load_n(&add->bytes_written, __ATOMIC_RELAXED);
+	total->frames += __atomic_load_n(&add->frames, __ATOMIC_RELAXED);
+	total->eagain += __atomic_load_n(&add->eagain, __ATOMIC_RELAXED);
+	total->timeouts += __atomic_load_n(&add->timeouts, __ATOMIC_RELAXED);
+
+}
+
+
+/*
+ * Sums the counters of the shards and their modules.
+ */
+void engineTotals(struct engine * e, struct engine_totals * t) {
+
+	memset(t, 0, sizeof(*t));
+	for (int i = 0; i < e->shard_count; i++) {
+		struct shard *s = &e->shards[i];
+		t->completed += __atomic_load_n(&s->completed, __ATOMIC_RELAXED);
+		t->failed += __atomic_load_n(&s->failed, __ATOMIC_RELAXED);
+		t->io.polls += __atomic_load_n(&s->polls, __ATOMIC_RELAXED);
+	}
+	// Hedge twins do I/O of their own.
+	int modules = e->hedge ? 2 * e->module_count : e->module_count;
+	for (int m = 0; m < modules; m++) {
+		ioStatsAdd(&t->io, &e->modules[m].io);
+	}
+
+}
+
+
+/*
+ * Prints the heading for rows printed by printIoStats().
+ */
+void printIoStatsHeader(const char * label) {
+
+	printf("%-24s %8s %8s %8s %8s %8s %10s %10s %8s %8s %9s\n", label, "ops", "connects", "polls", "reads",
+			"writes", "bytes in", "bytes out", "eagain", "timeouts", "calls/op");
+
+}
+
+
+/*
+ * Prints one row of I/O counts, with the syscalls spent per operation.
+ */
+void printIoStats(const char * label, struct io_stats * io) {
+
+	uint64_t calls = io->connects + io->polls + io->reads + io->writes;
+
+	printf("%-24s %8llu %8llu %8llu %8llu %8llu %10llu %10llu %8llu %8llu %9.2f\n", label,
+			(unsigned long long) io->operations, (unsigned long long) io->connects, (unsigned long long) io->polls,
+			(unsigned long long) io->reads, (unsigned long long) io->writes, (unsigned long long) io->bytes_read,
+			(unsigned long long) io->bytes_written, (unsigned long long) io->eagain, (unsigned long long) io->timeouts,
+			io->operations ? (double) calls / io->operations : 0);
+
+}
+
+
+/*
+ * Prints the I/O counts of an engine, per module when there are few enough
+ * to read, and in total. Operations are completed commands.
+ */
+void printEngineStats(struct engine * e) {
+
+	struct engine_totals t;
+	engineTotals(e, &t);
+
+	printIoStatsHeader("module");
+	if (e->module_count <= 64) {
+		for (int m = 0; m < e->module_count; m++) {
+			struct module *mod = &e->modules[m];
+			char label[32];
+			snprintf(label, sizeof(label), "%s:%d", inet_ntoa(mod->config.addr.sin_addr), ntohs(mod->config.addr.sin_port));
+			struct io_stats io;
+			memset(&io, 0, sizeof(io));
+			ioStatsAdd(&io, &mod->io);
+			if (mod->twin) {
+				ioStatsAdd(&io, &mod->twin->io);
+			}
+			printIoStats(label, &io);
+		}
+	}
+	printIoStats("total", &t.io);
+
+	double srtt = 0, low = 0, high = 0;
+	int measured = 0;
+	for (int m = 0; m < e->module_count; m++) {
+		struct module *mod = &e->modules[m];
+		double rto = rtoTimeout(&mod->rto) / 1e6;
+		if (m == 0 || rto < low) low = rto;
+		if (rto > high) high = rto;
+		if (mod->rto.srtt) {
+			srtt += mod->rto.srtt / 1e3;
+			measured++;
+		}
+	}
+	printf("RTT estimates: mean srtt %.1f us over %d modules, timeouts %.1f - %.1f ms\n",
+			measured ? srtt / measured : 0, measured, low, high);
+
+	if (e->hedge) {
+		uint64_t reads = 0, hedges = 0, wins = 0, diversions = 0;
+		for (int m = 0; m < 2 * e->module_count; m++) {
+			reads += e->modules[m].reads;
+			diversions += e->modules[m].diversions;
+			hedges += e->modules[m].hedges;
+			wins += e->modules[m].hedge_wins;
+		}
+		printf("Hedged reads: %llu of %llu (%.2f%%), %llu answered first by the hedge, %llu more moved to the twin\n",
+				(unsigned long long) hedges, (unsigned long long) reads, reads ? 100.0 * hedges / reads : 0,
+				(unsigned long long) wins, (unsigned long long) diversions);
+	}
+
+	if (e->adaptive) {
+		double smallest = e->depth, largest = 0, sum = 0;
+		uint64_t rtt_backoffs = 0, timeout_backoffs = 0;
+		for (int m = 0; m < e->module_count; m++) {
+			struct module *mod = &e->modules[m];
+			if (mod->window < smallest) smallest = mod->window;
+			if (mod->window > largest) largest = mod->window;
+			sum += mod->window;
+			rtt_backoffs += mod->rtt_backoffs;
+			timeout_backoffs += mod->timeout_backoffs;
+		}
+		printf("Adaptive depth: window min %.1f mean %.1f max %.1f of %d, %llu RTT backoffs, %llu timeout resets\n",
+				smallest, sum / e->module_count, largest, e->depth, (unsigned long long) rtt_backoffs,
+				(unsigned long long) timeout_backoffs);
+	}
+
+}
+
+
+/*
+ * Prints the I/O counts of the command line operations that were used.
+ */
+void printCliStats(void) {
+
+	struct io_stats total;
+	memset(&total, 0, sizeof(total));
+
+	printIoStatsHeader("operation");
+	for (int op = 0; op < CLI_OPS; op++) {
+		if (cli_stats[op].operations > 0) {
+			printIoStats(cli_op_names[op], &cli_stats[op]);
+			ioStatsAdd(&total, &cli_stats[op]);
+		}
+	}
+	printIoStats("total", &total);
+
+}
+
+
+/*
+ * Stops and joins the shard threads.
+ */
+void engineStop(struct engine * e) {
+
+	for (int i = 0; i < e->shard_count; i++) {
+		uint64_t one = 1;
+		__atomic_store_n(&e->shards[i].stop, 1, __ATOMIC_RELEASE);
+		if (write(e->shards[i].inbox.fd, &one, sizeof(one)) < 0) {
+			perror("engineStop - ");
+		}
+	}
+
+	for (int i = 0; i < e->shard_count; i++) {
+		pthread_join(e->shards[i].thread, NULL);
+	}
+
+}
+
+
+/*
+ * Frees an engine that has been stopped.
+ */
+void engineDestroy(struct engine * e) {
+
+	for (int m = 0; m < (e->hedge ? 2 : 1) * e->module_count; m++) {
+		if (e->modules[m].fd >= 0) {
+			close(e->modules[m].fd);
+		}
+	}
+
+	for (int i = 0; i < e->shard_count; i++) {
+		close(e->shards[i].epoll_fd);
+		ringFree(&e->shards[i].inbox);
+	}
+
+	free(e->arena.base); // The engine itself lives in the arena.
+
+}
+
+
+/*
+ * Parses a target of the form ip[:port[-last_port]] and appends a module
+ * config for every port it covers.
+ *
+ * char * spec						- The target text.
+ * int port							- The port to use if the target has none.
+ * char * password					- The password for the modules.
+ * struct module_config ** list		- The list to append to, grown as needed.
+ * int * count						- The number of entries in the list.
+ *
+ * returns -1 if the target is not valid, otherwise 0.
+ */
+int parseTarget(char * spec, int port, char * password, struct module_config ** list, int * count) {
+
+	char ip[64];
+	int last = -1;
+
+	strncpy(ip, spec, sizeof(ip) - 1);
+	ip[sizeof(ip) - 1] = '\0';
+
+	char *colon = strchr(ip, ':');
+	if (colon) {
+		*colon = '\0';
+		if (sscanf(colon + 1, "%d-%d", &port, &last) < 1) {
+			return -1;
+		}
+	}
+	if (last < port) {
+		last = port;
+	}
+
+	struct in_addr addr;
+	if (inet_pton(AF_INET, ip, &addr) != 1) {
+		return -1;
+	}
+
+	*list = realloc(*list, (*count + last - port + 1) * sizeof(**list));
+	for (int p = port; p <= last; p++) {
+		struct module_config *c = &(*list)[(*count)++];
+		memset(c, 0, sizeof(*c));
+		c->addr.sin_family = AF_INET;
+		c->addr.sin_addr = addr;
+		c->addr.sin_port = htons(p);
+		c->password = password;
+	}
+
+	return 0;
+
+}
+
+
+#define INVENTORY_TTL_S			3600	// Seconds an inventory entry is trusted for.
+
+/*
+ * What is known about one module, as kept in the inventory file.
+ */
+struct inventory_entry {
+	uint32_t addr;							// Network byte order.
+	uint16_t port;
+	char mac[18];							// From the ARP cache, "-" if not known.
+	uint8_t info[3];						// Module ID, hardware and firmware version.
+	int password;							// 1 if a password is needed, 0 if not, -1 if not known.
+	time_t seen;							// When the module last answered.
+};
+
+/*
+ * The modules of an inventory file.
+ */
+struct inventory {
+	struct inventory_entry *entries;
+	int count;
+	int ttl;								// Seconds an entry is trusted for.
+};
+
+struct inventory inventory;					// The inventory the command line works from.
+
+
+/*
+ * Finds the inventory entry for a module.
+ *
+ * uint32_t addr	- The address in network byte order.
+ * uint16_t port	- The port.
+ *
+ * returns NULL if the module is not in the inventory.
+ */
+struct inventory_entry * inventoryFind(struct inventory * inv, uint32_t addr, uint16_t port) {
+
+	for (int i = 0; i < inv->count; i++) {
+		if (inv->entries[i].addr == addr && inv->entries[i].port == port) {
+			return &inv->entries[i];
+		}
+	}
+	return NULL;
+
+}
+
+
+/*
+ * Finds the inventory entry for a module if it was seen within the TTL.
+ *
+ * returns NULL if the module is not in the inventory or the entry is stale.
+ */
+struct inventory_entry * inventoryFresh(struct inventory * inv, uint32_t addr, uint16_t port) {
+
+	struct inventory_entry *entry = inventoryFind(inv, addr, port);
+	if (entry == NULL || time(NULL) - entry->seen > inv->ttl) {
+		return NULL;
+	}
+	return entry;
+
+}
+
+
+/*
+ * Records what was just learnt about a module. A module that turns up with
+ * the MAC address of another entry has moved, and takes that entry over.
+ *
+ * struct inventory_entry * update	- What was learnt, a password of -1 keeps what was known.
+ *
+ * returns the entry in the inventory.
+ */
+struct inventory_entry * inventoryUpdate(struct inventory * inv, struct inventory_entry * update) {
+
+	struct inventory_entry *entry = inventoryFind(inv, update->addr, update->port);
+
+	if (entry == NULL && strcmp(update->mac, "-") != 0) {
+		for (int i = 0; i < inv->count; i++) {
+			if (inv->entries[i].port == update->port && strcmp(inv->entries[i].mac, update->mac) == 0) {
+				entry = &inv->entries[i];
+				break;
+			}
+		}
+	}
+
+	if (entry == NULL) {
+		inv->entries = realloc(inv->entries, (inv->count + 1) * sizeof(*inv->entries));
+		entry = &inv->entries[inv->count++];
+		*entry = *update;
+		return entry;
+	}
+
+	int password = update->password < 0 ? entry->password : update->password;
+	*entry = *update;
+	entry->password = password;
+	return entry;
+
+}
+
+
+/*
+ * Looks up the MAC address of a neighbour in the kernel ARP cache.
+ *
+ * uint32_t addr	- The address in network byte order.
+ * char * mac		- Set to the MAC address, or "-" if it is not cached.
+ */
+void arpLookup(uint32_t addr, char * mac) {
+
+	strcpy(mac, "-");
+
+	FILE *f = fopen("/proc/net/arp", "r");
+	if (f == NULL) {
+		return;
+	}
+
+	struct in_addr a = { addr };
+	char ip[INET_ADDRSTRLEN], line[256], entry_ip[64], entry_mac[64];
+	inet_ntop(AF_INET, &a, ip, sizeof(ip));
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %*s %*s %63s", entry_ip, entry_mac) == 2 && strcmp(entry_ip, ip) == 0
+				&& strcmp(entry_mac, "00:00:00:00:00:00") != 0 && strlen(entry_mac) == 17) {
+			strcpy(mac, entry_mac);
+			break;
+		}
+	}
+
+	fclose(f);
+
+}
+
+
+/*
+ * Loads an inventory file. Each line reads
+ *
+ *		<address> <port> <mac> <id> <hardware> <firmware> <password> <seen>
+ *
+ * where password is yes, no or unknown and seen is in seconds since the epoch.
+ * Files written by discovery before the inventory kept more than
+ * <address> <port> <id> <hardware> <firmware> are read too, as never seen.
+ * A missing file is an empty inventory.
+ *
+ * returns -1 if the file exists but cannot be read, otherwise the number of entries.
+ */
+int inventoryLoad(char * path, struct inventory * inv) {
+
+	inv->entries = NULL;
+	inv->count = 0;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		perror("inventoryLoad - ");
+		return -1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+
+		struct inventory_entry e;
+		char ip[64], mac[64], password[16];
+		int port, id, hardware, firmware;
+		long long seen;
+
+		if (line[0] == '#') {
+			continue;
+		}
+
+		int n = sscanf(line, "%63s %d %63s %d %d %d %15s %lld", ip, &port, mac, &id, &hardware, &firmware, password, &seen);
+		if (n != 8) {
+			n = sscanf(line, "%63s %d %d %d %d", ip, &port, &id, &hardware, &firmware);
+			if (n != 5) {
+				continue;
+			}
+			strcpy(mac, "-");
+			strcpy(password, "unknown");
+			seen = 0;
+		}
+
+		struct in_addr a;
+		if (inet_pton(AF_INET, ip, &a) != 1 || strlen(mac) > 17) {
+			continue;
+		}
+
+		memset(&e, 0, sizeof(e));
+		e.addr = a.s_addr;
+		e.port = port;
+		strcpy(e.mac, mac);
+		e.info[0] = id;
+		e.info[1] = hardware;
+		e.info[2] = firmware;
+		e.password = strcmp(password, "yes") == 0 ? 1 : strcmp(password, "no") == 0 ? 0 : -1;
+		e.seen = (time_t) seen;
+		inventoryUpdate(inv, &e);
+
+	}
+
+	fclose(f);
+	return inv->count;
+
+}
+
+
+/*
+ * Orders inventory entries by address and port.
+ */
+int inventoryCompare(const void * a, const void * b) {
+
+	const struct inventory_entry *x = a, *y = b;
+	uint32_t xa = ntohl(x->addr), ya = ntohl(y->addr);
+	if (xa != ya) {
+		return xa < ya ? -1 : 1;
+	}
+	return (x->port > y->port) - (x->port < y->port);
+
+}
+
+
+/*
+ * Writes an inventory file, sorted by address. The file is replaced in one
+ * step so readers never see half of it.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int inventorySave(char * path, struct inventory * inv) {
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror("inventorySave - ");
+		return -1;
+	}
+
+	qsort(inv->entries, inv->count, sizeof(*inv->entries), inventoryCompare);
+
+	fprintf(f, "# address port mac id hardware firmware password seen\n");
+	for (int i = 0; i < inv->count; i++) {
+		struct inventory_entry *e = &inv->entries[i];
+		struct in_addr a = { e->addr };
+		fprintf(f, "%s %d %s %d %d %d %s %lld\n", inet_ntoa(a), e->port, e->mac, e->info[0], e->info[1], e->info[2],
+				e->password < 0 ? "unknown" : e->password ? "yes" : "no", (long long) e->seen);
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) < 0) {
+		perror("inventorySave - ");
+		return -1;
+	}
+	return 0;
+
+}
+
+
+/*
+ * Marks the engine modules the inventory knows to have no password, so
+ * their sessions skip the unlock handshake.
+ */
+void inventoryApply(struct inventory * inv, struct module_config * configs, int count) {
+
+	for (int m = 0; m < count; m++) {
+		struct inventory_entry *e = inventoryFresh(inv, configs[m].addr.sin_addr.s_addr, ntohs(configs[m].addr.sin_port));
+		configs[m].open = e != NULL && e->password == 0;
+	}
+
+}
+
+
+/*
+ * Simulator limits.
+ */
+#define SIM_MAX_MODULES			65536
+#define SIM_BUFFER				256
+
+/*
+ * The relay state of one simulated module, shared by every connection to it.
+ */
+struct sim_module {
+	uint32_t addr;
+	uint16_t port;
+	uint8_t outputs;
+	uint64_t pulse_end[8];					// When a pulsed output turns off again, 0 if not pulsed.
+};
+
+/*
+ * A listening socket or a client connection of the simulator.
+ */
+struct sim_conn {
+	int listener;							// Non zero for listening sockets.
+	int fd;
+	struct sim_module *module;
+	int unlocked;
+	uint8_t in[SIM_BUFFER];
+	int in_len;
+	uint8_t out[SIM_BUFFER * 3];			// Responses the socket has not taken yet.
+	int out_len;
+	int out_sent;
+	int writing;							// Waiting for the socket to drain, not for requests.
+};
+
+struct simulator {
+	int port;
+	int count;
+	char *password;
+	pthread_mutex_t lock;					// Protects the module table.
+	struct sim_module **table;				// Open addressed, keyed by address and port.
+};
+
+
+/*
+ * Finds or adds the simulated module for a local address and port.
+ */
+struct sim_module * simModule(struct simulator * sim, uint32_t addr, uint16_t port) {
+
+	uint32_t h = (addr * 2654435761u) ^ (port * 40503u);
+
+	pthread_mutex_lock(&sim->lock);
+
+	struct sim_module *m = NULL;
+	for (uint32_t i = 0; i < SIM_MAX_MODULES; i++) {
+		struct sim_module **slot = &sim->table[(h + i) % SIM_MAX_MODULES];
+		if (*slot == NULL) {
+			*slot = calloc(1, sizeof(**slot));
+			(*slot)->addr = addr;
+			(*slot)->port = port;
+		}
+		if ((*slot)->addr == addr && (*slot)->port == port) {
+			m = *slot;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&sim->lock);
+	return m;
+
+}
+
+
+/*
+ * Returns the output states of a simulated module, ending any expired pulses.
+ */
+uint8_t simOutputs(struct sim_module * m) {
+
+	uint64_t now = nowNs();
+
+	for (int r = 0; r < 8; r++) {
+		uint64_t end = __atomic_load_n(&m->pulse_end[r], __ATOMIC_RELAXED);
+		if (end != 0 && now >= end) {
+			__atomic_fetch_and(&m->outputs, (uint8_t) ~(1u << r), __ATOMIC_RELAXED);
+			__atomic_store_n(&m->pulse_end[r], 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	return __atomic_load_n(&m->outputs, __ATOMIC_RELAXED);
+
+}
+
+
+/*
+ * Processes every complete command in a client buffer.
+ *
+ * returns the number of response bytes placed in out.
+ */
+int simProcess(struct simulator * sim, struct sim_conn * c, uint8_t * out) {
+
+	int pos = 0, len = 0;
+	int locked = sim->password != NULL && !c->unlocked;
+
+	while (pos < c->in_len) {
+
+		uint8_t *cmd = c->in + pos;
+		int avail = c->in_len - pos;
+		int used = command_table[cmd[0]].request_len ? command_table[cmd[0]].request_len : 1;
+
+		// The password has no terminator. Without one set it is the rest of the
+		// packet, otherwise it is as long as the one set so that commands sent
+		// straight after it stay in the buffer. One already wrong before its
+		// end is taken as it is rather than waited on.
+		if (cmd[0] == SEND_PASSWORD) {
+			used = sim->password ? 1 + (int) strlen(sim->password) : avail;
+			if (avail < used && memcmp(cmd + 1, sim->password, avail - 1) != 0) {
+				used = avail;
+			}
+		}
+
+		if (avail < used) {
+			break;
+		}
+
+		switch (cmd[0]) {
+			case GET_INFO:
+				out[len++] = 19;	// ETH008 module id
+				out[len++] = 3;		// Hardware version
+				out[len++] = 4;		// Firmware version
+				break;
+			case GET_UNLOCK:
+				out[len++] = sim->password == NULL ? UNLOCK_NO_PASSWORD : (c->unlocked ? 30 : 0);
+				break;
+			case SEND_PASSWORD:
+				if (sim->password == NULL) {
+					out[len++] = 1;
+					break;
+				}
+				c->unlocked = used - 1 == (int) strlen(sim->password) && memcmp(cmd + 1, sim->password, used - 1) == 0;
+				locked = !c->unlocked;
+				out[len++] = c->unlocked ? 1 : 2;
+				break;
+			case LOGOUT:
+				c->unlocked = 0;
+				locked = sim->password != NULL;
+				out[len++] = 0;
+				break;
+			case GET_DIGITAL_OUTPUTS:
+				out[len++] = simOutputs(c->module);
+				break;
+			case SET_OUTPUT_ACTIVE:
+			case SET_OUTPUT_INACTIVE:
+				if (locked || cmd[1] < 1 || cmd[1] > 8) {
+					out[len++] = 1;
+					break;
+				}
+				uint8_t bit = 1u << (cmd[1] - 1);
+				if (cmd[0] == SET_OUTPUT_ACTIVE) {
+					__atomic_fetch_or(&c->module->outputs, bit, __ATOMIC_RELAXED);
+					__atomic_store_n(&c->module->pulse_end[cmd[1] - 1],
+							cmd[2] ? nowNs() + cmd[2] * 100000000ull : 0, __ATOMIC_RELAXED);
+				} else {
+					__atomic_fetch_and(&c->module->outputs, (uint8_t) ~bit, __ATOMIC_RELAXED);
+				}
+				out[len++] = 0;
+				break;
+			default:
+				break;	// Unknown commands are ignored
+		}
+
+		pos += used;
+
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+	return len;
+
+}
+
+
+/*
+ * Closes a simulator client connection.
+ */
+void simClose(struct sim_conn * c) {
+
+	close(c->fd);
+	free(c);
+
+}
+
+
+/*
+ * Writes what a simulated module has not sent yet. While anything is left
+ * the connection waits for the socket to drain instead of reading more.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int simFlush(struct sim_conn * c, int ep) {
+
+	while (c->out_sent < c->out_len) {
+		ssize_t written = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN) {
+				return -1;
+			}
+			break;
+		}
+		c->out_sent += written;
+	}
+
+	if (c->out_sent == c->out_len) {
+		c->out_len = c->out_sent = 0;
+	}
+
+	if (c->writing != (c->out_len > 0)) {
+		c->writing = c->out_len > 0;
+		struct epoll_event ev;
+		ev.events = c->writing ? EPOLLOUT : EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+
+	return 0;
+
+}
+
+
+struct sim_thread {
+	pthread_t thread;
+	struct simulator *sim;
+};
+
+
+/*
+ * The event loop of one simulator thread. Every thread has its own listening
+ * sockets on the same ports and the kernel spreads connections across them.
+ */
+void * simRun(void * arg) {
+
+	struct simulator *sim = ((struct sim_thread *) arg)->sim;
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+
+	for (int p = 0; p < sim->count; p++) {
+
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(sim->port + p);
+
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+			perror("simRun - ");
+			exit(EXIT_FAILURE);
+		}
+
+		struct sim_conn *l = calloc(1, sizeof(*l));
+		l->listener = 1;
+		l->fd = fd;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = l;
+		epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+
+	}
+
+	struct epoll_event events[EPOLL_BATCH];
+
+	for (;;) {
+
+		int n = epoll_wait(ep, events, EPOLL_BATCH, -1);
+
+		for (int i = 0; i < n; i++) {
+
+			struct sim_conn *c = events[i].data.ptr;
+
+			if (c->listener) {
+
+				int fd;
+				while ((fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+
+					// The module is identified by the address and port that was connected to.
+					struct sockaddr_in local;
+					socklen_t len = sizeof(local);
+					getsockname(fd, (struct sockaddr *) &local, &len);
+
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					if (send_buffer > 0) {
+						setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+					}
+
+					struct sim_conn *client = calloc(1, sizeof(*client));
+					client->fd = fd;
+					client->module = simModule(sim, local.sin_addr.s_addr, local.sin_port);
+
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = client;
+					epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+
+				}
+				continue;
+
+			}
+
+			// The socket has drained enough to take the rest of the responses.
+			if (c->out_len > 0) {
+				if (simFlush(c, ep) < 0) {
+					simClose(c);
+				}
+				continue;
+			}
+
+			int rd = read(c->fd, c->in + c->in_len, SIM_BUFFER - c->in_len);
+			if (rd <= 0) {
+				if (rd == 0 || (errno != EAGAIN && errno != EINTR)) {
+					simClose(c);
+				}
+				continue;
+			}
+			c->in_len += rd;
+
+			c->out_len = simProcess(sim, c, c->out);
+			if (simFlush(c, ep) < 0) {
+				simClose(c);
+			}
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+
+/*
+ * Runs a simulated ETH008 on each of count ports starting at port. Every
+ * local address the host answers on is treated as a separate module.
+ *
+ * int port			- The first port to listen on.
+ * int count		- The number of ports.
+ * int threads		- The number of simulator threads.
+ * char * password	- The password modules require, or NULL for none.
+ */
+void runSimulator(int port, int count, int threads, char * password) {
+
+	struct simulator sim;
+	sim.port = port;
+	sim.count = count < 1 ? 1 : count;
+	sim.password = password;
+	sim.table = calloc(SIM_MAX_MODULES, sizeof(*sim.table));
+	pthread_mutex_init(&sim.lock, NULL);
+
+	if (threads < 1) threads = 1;
+	struct sim_thread *t = calloc(threads, sizeof(*t));
+
+	printf("Simulating ETH008 on ports %d - %d with %d thread(s)\n", port, port + sim.count - 1, threads);
+	fflush(stdout);
+
+	for (int i = 0; i < threads; i++) {
+		t[i].sim = &sim;
+		pthread_create(&t[i].thread, NULL, simRun, &t[i]);
+	}
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+	}
+
+}
+
+
+/*
+ * What a benchmark run does.
+ */
+struct bench_options {
+	int threads;							// The most worker threads to scale up to.
+	int depth;								// Commands in flight per module.
+	int submitters;							// Threads submitting through reply rings, 0 for none.
+	int seconds;							// Length of each pass.
+	int toggle;								// Toggle outputs rather than read them.
+	int max_age_ms;							// How long the engine may trust known output states.
+};
+
+/*
+ * Settings shared by the benchmark callbacks and submitter threads.
+ */
+struct benchmark {
+	struct engine *engine;
+	int running;
+	struct command_pool pool;
+	struct command *cmds;
+	int cmd_count;
+	int submitters;							// Threads submitting through reply rings, 0 for none.
+	int toggle;
+};
+
+/*
+ * A thread outside the engine submitting its share of the benchmark commands.
+ */
+struct bench_submitter {
+	pthread_t thread;
+	struct benchmark *bench;
+	int id;
+	struct ring reply;
+};
+
+
+/*
+ * Turns a completed benchmark command back into its request.
+ */
+void benchRearm(struct benchmark * b, struct command * cmd) {
+
+	if (b->toggle) {
+		commandPrepareToggle(cmd, cmd->module, cmd->module % 8 + 1);
+	} else {
+		commandPrepare(cmd, cmd->module, GET_DIGITAL_OUTPUTS, 0, 0);
+	}
+
+}
+
+
+/*
+ * Submits a command, waiting for room if the shard inbox is full.
+ */
+void benchSubmit(struct engine * e, struct command * cmd) {
+
+	while (engineSubmit(e, cmd) < 0) {
+		sched_yield();
+	}
+
+}
+
+
+/*
+ * Completion callback for benchmark commands, sends the command straight
+ * back out so each module keeps a constant number of commands in flight.
+ */
+void benchDone(struct command * cmd) {
+
+	struct benchmark *b = cmd->user;
+
+	if (__atomic_load_n(&b->running, __ATOMIC_RELAXED)) {
+		benchRearm(b, cmd);
+		engineSubmit(b->engine, cmd);
+	}
+
+}
+
+
+/*
+ * Submitter thread, keeps every one of its commands in flight by resubmitting
+ * them as they arrive on its reply ring.
+ */
+void * benchSubmitterRun(void * arg) {
+
+	struct bench_submitter *sub = arg;
+	struct benchmark *b = sub->bench;
+	int outstanding = 0;
+
+	for (int i = sub->id; i < b->cmd_count; i += b->submitters) {
+		b->cmds[i].reply = &sub->reply;
+		benchSubmit(b->engine, &b->cmds[i]);
+		outstanding++;
+	}
+
+	// Every command must come back before the ring can be freed.
+	while (outstanding > 0) {
+		struct command *cmd = ringWait(&sub->reply, 100);
+		if (cmd == NULL) {
+			continue;
+		}
+		if (__atomic_load_n(&b->running, __ATOMIC_RELAXED)) {
+			benchRearm(b, cmd);
+			benchSubmit(b->engine, cmd);
+		} else {
+			outstanding--;
+		}
+	}
+
+	return NULL;
+
+}
+
+
+/*
+ * What one benchmark pass measured.
+ */
+struct bench_result {
+	double rate;							// Completed commands per second.
+	uint64_t failures;
+	double frames_per_write;
+	double reads_per_response;
+};
+
+
+/*
+ * Runs one benchmark pass.
+ */
+void benchPass(struct module_config * configs, int count, int threads, struct bench_options * opts, struct bench_result * result) {
+
+	int submitters = opts->submitters;
+	struct benchmark b;
+	b.engine = engineCreate(configs, count, threads, 1);
+	b.engine->depth = opts->depth;
+	b.engine->max_age_ms = opts->max_age_ms;
+	b.running = 1;
+	b.cmd_count = count * opts->depth;
+	b.submitters = submitters;
+	b.toggle = opts->toggle;
+	if (commandPoolInit(&b.pool, b.cmd_count) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	b.cmds = b.pool.cmds;
+	engineStart(b.engine);
+
+	for (int i = 0; i < b.cmd_count; i++) {
+		struct command *cmd = commandAlloc(&b.pool);
+		cmd->module = i % count;
+		benchRearm(&b, cmd);
+		cmd->done = benchDone;
+		cmd->user = &b;
+	}
+
+	struct bench_submitter *subs = calloc(submitters, sizeof(*subs));
+	if (submitters > 0) {
+		for (int i = 0; i < submitters; i++) {
+			subs[i].bench = &b;
+			subs[i].id = i;
+			if (ringInit(&subs[i].reply, b.cmd_count / submitters + 1, NULL) < 0) {
+				exit(EXIT_FAILURE);
+			}
+			pthread_create(&subs[i].thread, NULL, benchSubmitterRun, &subs[i]);
+		}
+	} else {
+		for (int i = 0; i < b.cmd_count; i++) {
+			benchSubmit(b.engine, &b.cmds[i]);
+		}
+	}
+
+	// Give the connections a moment to come up before measuring.
+	usleep(500000);
+
+	struct engine_totals before, after;
+	engineTotals(b.engine, &before);
+	uint64_t start = nowNs();
+	long long warm = allocationCount();
+
+	sleep(opts->seconds);
+
+	long long steady = allocationCount() - warm;
+	engineTotals(b.engine, &after);
+	uint64_t elapsed = nowNs() - start;
+
+	__atomic_store_n(&b.running, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < submitters; i++) {
+		pthread_join(subs[i].thread, NULL);
+		ringFree(&subs[i].reply);
+	}
+	engineStop(b.engine);
+	if (show_stats) {
+		printEngineStats(b.engine);
+	}
+	engineDestroy(b.engine);
+	free(subs);
+	commandPoolFree(&b.pool);
+
+	// With the allocation hook built in, the measured period must not touch the heap.
+	if (warm >= 0 && steady != 0) {
+		printf("benchPass - %lld heap allocations after warm-up\n", steady);
+		exit(EXIT_FAILURE);
+	}
+
+	result->rate = (after.completed - before.completed) * 1e9 / elapsed;
+	result->failures = after.failed - before.failed;
+	result->frames_per_write = after.io.writes > before.io.writes
+			? (double) (after.io.frames - before.io.frames) / (after.io.writes - before.io.writes) : 0;
+	result->reads_per_response = after.completed > before.completed
+			? (double) (after.io.reads - before.io.reads) / (after.completed - before.completed) : 0;
+
+}
+
+
+/*
+ * Benchmarks the engine with 1, 2, 4 ... up to the given number of threads
+ * and reports how throughput scales.
+ */
+void runBenchmark(struct module_config * configs, int count, struct bench_options * opts) {
+
+	double base = 0;
+	int threads = opts->threads;
+
+	printf("%d modules, pipeline depth %d, %d s per pass", count, opts->depth, opts->seconds);
+	if (opts->submitters > 0) {
+		printf(", %d submitter thread(s)", opts->submitters);
+	}
+	if (opts->toggle) {
+		printf(", toggling with states trusted for %d ms", opts->max_age_ms);
+	}
+	printf("\nthreads  commands/s  per thread  speedup  failures  frames/write  reads/response\n");
+
+	for (int t = 1; ; t *= 2) {
+
+		if (t > threads) t = threads;
+
+		struct bench_result r;
+		benchPass(configs, count, t, opts, &r);
+		if (base == 0) base = r.rate;
+
+		printf("%7d  %10.0f  %10.0f  %7.2f  %8llu  %12.2f  %14.3f\n", t, r.rate, r.rate / t, base > 0 ? r.rate / base : 0,
+				(unsigned long long) r.failures, r.frames_per_write, r.reads_per_response);
+		fflush(stdout);
+
+		if (t == threads) break;
+
+	}
+
+}
+
+
+/*
+ * Parses an output mask written in decimal, 0x hex or 0b binary.
+ *
+ * returns -1 if the text is not a mask, otherwise the mask.
+ */
+int parseMask(char * text) {
+
+	char *end;
+	long value;
+
+	if (text[0] == '0' && (text[1] == 'b' || text[1] == 'B')) {
+		value = strtol(text + 2, &end, 2);
+	} else {
+		value = strtol(text, &end, 0);
+	}
+
+	if (*end != '\0' || value < 0 || value > 0xFF) {
+		return -1;
+	}
+	return (int) value;
+
+}
+
+
+/*
+ * Reads a whole file into a NUL terminated buffer that the caller frees.
+ *
+ * returns NULL on failure.
+ */
+char * readFile(char * path) {
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("readFile - ");
+		return NULL;
+	}
+
+	size_t len = 0, cap = 4096;
+	char *text = malloc(cap);
+	size_t rd;
+	while ((rd = fread(text + len, 1, cap - len - 1, f)) > 0) {
+		len += rd;
+		if (cap - len - 1 == 0) {
+			cap *= 2;
+			text = realloc(text, cap);
+		}
+	}
+	text[len] = '\0';
+
+	fclose(f);
+	return text;
+
+}
+
+
+/*
+ * Write-ahead log of desired output states. Every accepted change is appended
+ * as a fixed size record to a memory mapped file before the command making it
+ * is sent, so after a crash replaying the log gives what each module should
+ * show. Appending only copies into the mapping. Making records durable is a
+ * separate step and is shared: the first thread to commit syncs everything
+ * appended so far while the others wait on it (group commit).
+ */
+#define WAL_GROW				(1 << 20)	// Bytes the file is extended by at a time.
+#define WAL_MAX					(64 << 20)	// Largest the file may grow before it is compacted.
+#define WAL_STATES_MIN			64			// Starting size of the state table, a power of two.
+
+/*
+ * One change as stored in the log, 32 bytes.
+ */
+struct wal_record {
+	uint64_t seq;							// Consecutive from the first record, 0 marks unused space.
+	uint64_t time;							// CLOCK_REALTIME nanoseconds of the change.
+	uint32_t addr;							// The module, in network byte order.
+	uint16_t port;
+	uint8_t mask;							// The outputs the change covers.
+	uint8_t outputs;						// The states wanted for them.
+	uint32_t reserved;
+	uint32_t crc;							// CRC-32 of the bytes before it.
+};
+
+/*
+ * The latest desired states of one module, as the log has them.
+ */
+struct wal_state {
+	uint32_t addr;
+	uint16_t port;
+	uint8_t mask;							// Outputs with a desired state, 0 for an unused slot.
+	uint8_t outputs;
+};
+
+struct wal {
+	char *path;
+	int fd;
+	uint8_t *map;							// WAL_MAX bytes reserved, the first size of them in the file.
+	size_t size;
+	size_t tail;							// Where the next record goes.
+	size_t synced;							// Bytes known to be on disk.
+	uint64_t seq;							// Last sequence number appended.
+	uint64_t durable;						// Last sequence number known to be on disk.
+	int syncing;							// A commit is being made.
+	int grown;								// The file was extended since the last commit.
+	struct wal_state *states;				// Open addressed by module.
+	int state_cap;
+	int state_count;
+	uint64_t replayed;						// Records found when the log was opened.
+	size_t discarded;						// Bytes after the last good record when opened.
+	uint64_t syncs;
+	uint64_t compactions;
+	pthread_mutex_t lock;
+	pthread_cond_t committed;
+};
+
+struct wal *wal;							// The log changes are recorded in, NULL without --wal.
+
+
+/*
+ * Returns the CRC-32 (IEEE 802.3) of a block of bytes.
+ */
+uint32_t walCrc(const void * data, size_t len) {
+
+	static uint32_t table[256];
+
+	// Built on first use, walOpen() makes that happen before any other thread can get here.
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) {
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	const uint8_t *p = data;
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < len; i++) {
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFu;
+
+}
+
+
+/*
+ * Returns the state table slot of a module, an unused one if it has none.
+ */
+struct wal_state * walStateSlot(struct wal_state * states, int cap, uint32_t addr, uint16_t port) {
+
+	uint32_t i = (addr * 2654435761u) ^ port;
+	for (;; i++) {
+		struct wal_state *s = &states[i & (cap - 1)];
+		if (s->mask == 0 || (s->addr == addr && s->port == port)) {
+			return s;
+		}
+	}
+
+}
+
+
+/*
+ * Folds a change into the latest state of its module.
+ */
+void walStateApply(struct wal * w, uint32_t addr, uint16_t port, uint8_t mask, uint8_t outputs) {
+
+	// Keep the table at most half full.
+	if ((w->state_count + 1) * 2 > w->state_cap) {
+		int cap = w->state_cap ? w->state_cap * 2 : WAL_STATES_MIN;
+		struct wal_state *states = calloc(cap, sizeof(*states));
+		for (int i = 0; i < w->state_cap; i++) {
+			if (w->states[i].mask) {
+				*walStateSlot(states, cap, w->states[i].addr, w->states[i].port) = w->states[i];
+			}
+		}
+		free(w->states);
+		w->states = states;
+		w->state_cap = cap;
+	}
+
+	struct wal_state *s = walStateSlot(w->states, w->state_cap, addr, port);
+	if (s->mask == 0) {
+		s->addr = addr;
+		s->port = port;
+		w->state_count++;
+	}
+	s->outputs = (s->outputs & ~mask) | (outputs & mask);
+	s->mask |= mask;
+
+}
+
+
+/*
+ * Writes one record at the tail, extending the file when it is full. The
+ * caller holds the lock.
+ *
+ * returns -1 if the log has reached WAL_MAX or cannot grow, otherwise 0.
+ */
+int walWrite(struct wal * w, struct wal_record * rec) {
+
+	if (w->tail + sizeof(*rec) > w->size) {
+		if (w->size + WAL_GROW > WAL_MAX) {
+			return -1;
+		}
+		// Space is allocated up front so a full disk fails here and not as a fault on the mapping.
+		int err = posix_fallocate(w->fd, w->size, WAL_GROW);
+		if (err != 0) {
+			errno = err;
+			perror("walWrite - ");
+			return -1;
+		}
+		w->size += WAL_GROW;
+		w->grown = 1;
+	}
+
+	rec->crc = walCrc(rec, offsetof(struct wal_record, crc));
+	memcpy(w->map + w->tail, rec, sizeof(*rec));
+	w->tail += sizeof(*rec);
+	return 0;
+
+}
+
+
+/*
+ * Maps a log file, replacing any current mapping.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int walMap(struct wal * w, int fd) {
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("walMap - ");
+		return -1;
+	}
+	if (st.st_size > WAL_MAX) {
+		printf("%s is larger than a log may be\n", w->path);
+		return -1;
+	}
+
+	void *map = mmap(NULL, WAL_MAX, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("walMap - ");
+		return -1;
+	}
+
+	if (w->map) {
+		munmap(w->map, WAL_MAX);
+		close(w->fd);
+	}
+	w->map = map;
+	w->fd = fd;
+	w->size = st.st_size;
+	return 0;
+
+}
+
+
+/*
+ * Makes the rename of a file into a directory durable.
+ */
+void walSyncDirectory(char * path) {
+
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", path);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fsync(fd) < 0) {
+		perror("walSyncDirectory - ");
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+}
+
+
+/*
+ * Rewrites the log as one record per module holding its latest states. The
+ * new log is written and synced beside the old one and renamed over it, so a
+ * crash part way leaves one or the other whole. Sequence numbers carry on
+ * from the old log and everything in the new one is durable. The caller holds
+ * the lock and no commit is in progress.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int walCompact(struct wal * w) {
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.compact", w->path);
+
+	size_t len = (size_t) w->state_count * sizeof(struct wal_record);
+	size_t size = (len / WAL_GROW + 1) * WAL_GROW;
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || size > WAL_MAX || posix_fallocate(fd, 0, size) != 0) {
+		perror("walCompact - ");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	uint8_t *out = malloc(len ? len : 1);
+	uint64_t seq = w->seq - w->state_count;
+	size_t off = 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (int i = 0; i < w->state_cap; i++) {
+		struct wal_state *s = &w->states[i];
+		if (s->mask == 0) continue;
+		struct wal_record rec;
+		memset(&rec, 0, sizeof(rec));
+		rec.seq = ++seq;
+		rec.time = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		rec.addr = s->addr;
+		rec.port = s->port;
+		rec.mask = s->mask;
+		rec.outputs = s->outputs;
+		rec.crc = walCrc(&rec, offsetof(struct wal_record, crc));
+		memcpy(out + off, &rec, sizeof(rec));
+		off += sizeof(rec);
+	}
+
+	ssize_t written = pwrite(fd, out, len, 0);
+	free(out);
+	if (written != (ssize_t) len || fdatasync(fd) < 0 || rename(tmp, w->path) < 0) {
+		perror("walCompact - ");
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	walSyncDirectory(w->path);
+
+	if (walMap(w, fd) < 0) {
+		exit(EXIT_FAILURE); // The old mapping no longer names the log.
+	}
+	w->tail = len;
+	w->synced = len;
+	w->durable = w->seq;
+	w->grown = 0;
+	w->compactions++;
+	pthread_cond_broadcast(&w->committed);
+	return 0;
+
+}
+
+
+/*
+ * Opens a log, creating it if need be, and replays it. Replay stops at the
+ * first record that is unused, fails its checksum or breaks the sequence,
+ * that being where the last run stopped or was torn off by a crash, and
+ * anything after it is cleared so it cannot be mistaken for a later record.
+ * A log much longer than the states it holds is compacted straight away.
+ *
+ * returns NULL on failure.
+ */
+struct wal * walOpen(char * path) {
+
+	struct wal *w = calloc(1, sizeof(*w));
+	w->path = path;
+	w->fd = -1;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->committed, NULL);
+	walCrc(NULL, 0);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("walOpen - ");
+		free(w);
+		return NULL;
+	}
+	if (walMap(w, fd) < 0) {
+		close(fd);
+		free(w);
+		return NULL;
+	}
+
+	size_t off;
+	for (off = 0; off + sizeof(struct wal_record) <= w->size; off += sizeof(struct wal_record)) {
+		struct wal_record rec;
+		memcpy(&rec, w->map + off, sizeof(rec));
+		if (rec.seq == 0 || rec.crc != walCrc(&rec, offsetof(struct wal_record, crc))
+				|| (off > 0 && rec.seq != w->seq + 1)) {
+			break;
+		}
+		w->seq = rec.seq;
+		walStateApply(w, rec.addr, rec.port, rec.mask, rec.outputs);
+		w->replayed++;
+	}
+
+	w->tail = off;
+	for (size_t i = off; i < w->size; i++) {
+		if (w->map[i] != 0) {
+			w->discarded = w->size - off;
+			memset(w->map + off, 0, w->size - off);
+			msync(w->map, w->size, MS_SYNC);
+			break;
+		}
+	}
+	w->synced = w->tail;
+	w->durable = w->seq;
+
+	if (w->replayed > 1024 && w->replayed > 4 * (uint64_t) w->state_count && walCompact(w) < 0) {
+		return NULL;
+	}
+	return w;
+
+}
+
+
+/*
+ * Appends a change to the log. It is not durable until walCommit() has been
+ * called with the returned sequence number.
+ *
+ * uint32_t addr		- The module, in network byte order.
+ * uint16_t port		- Its port, in network byte order.
+ * uint8_t mask			- The outputs the change covers.
+ * uint8_t outputs		- The states wanted for them.
+ *
+ * returns 0 if the change could not be logged, otherwise its sequence number.
+ */
+uint64_t walAppend(struct wal * w, uint32_t addr, uint16_t port, uint8_t mask, uint8_t outputs) {
+
+	struct wal_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.time = clockNs(CLOCK_REALTIME);
+	rec.addr = addr;
+	rec.port = port;
+	rec.mask = mask;
+	rec.outputs = outputs;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (;;) {
+
+		rec.seq = w->seq + 1;
+		if (walWrite(w, &rec) == 0) {
+			break;
+		}
+
+		// Out of room, fold the log down to the latest states once no commit is using the mapping.
+		if (w->size + WAL_GROW > WAL_MAX && w->syncing) {
+			pthread_cond_wait(&w->committed, &w->lock);
+			continue;
+		}
+		if (w->size + WAL_GROW <= WAL_MAX || walCompact(w) < 0 || walWrite(w, &rec) < 0) {
+			pthread_mutex_unlock(&w->lock);
+			printf("Unable to log a change to %s\n", w->path);
+			return 0;
+		}
+		break;
+
+	}
+	w->seq = rec.seq;
+	walStateApply(w, addr, port, mask, outputs);
+
+	pthread_mutex_unlock(&w->lock);
+	return rec.seq;
+
+}
+
+
+/*
+ * Waits until the log is durable up to a sequence number. If no commit is in
+ * progress the caller makes one covering everything appended so far, else it
+ * waits for the one in progress and goes again if that did not cover it.
+ *
+ * returns -1 if the log could not be synced, otherwise 0.
+ */
+int walCommit(struct wal * w, uint64_t seq) {
+
+	static size_t page;
+	if (page == 0) {
+		page = sysconf(_SC_PAGESIZE);
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	while (w->durable < seq) {
+
+		if (w->syncing) {
+			pthread_cond_wait(&w->committed, &w->lock);
+			continue;
+		}
+
+		w->syncing = 1;
+		uint64_t target = w->seq;
+		size_t from = w->synced & ~(page - 1), to = w->tail;
+		int grown = w->grown;
+		w->grown = 0;
+		pthread_mutex_unlock(&w->lock);
+
+		// A larger file also needs its size on disk.
+		int rc = msync(w->map + from, to - from, MS_SYNC);
+		if (rc == 0 && grown) {
+			rc = fdatasync(w->fd);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->syncing = 0;
+		pthread_cond_broadcast(&w->committed);
+		if (rc < 0) {
+			w->grown |= grown;
+			pthread_mutex_unlock(&w->lock);
+			perror("walCommit - ");
+			return -1;
+		}
+		if (target > w->durable) {
+			w->durable = target;
+			w->synced = to;
+		}
+		w->syncs++;
+
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+
+}
+
+
+/*
+ * Commands held back until the changes they make are durable.
+ */
+struct wal_batch {
+	struct command *head;
+	struct command *tail;
+	uint64_t seq;							// Last record the held commands wait on.
+};
+
+
+/*
+ * Hands a command that was never sent back to its submitter as failed, as
+ * the engine would have.
+ */
+void walFail(struct command * cmd) {
+
+	cmd->status = STATUS_ERROR;
+	cmd->submitted = cmd->completed = nowNs();
+	while (ringPush(cmd->reply, cmd) < 0) {
+		sched_yield();
+	}
+
+}
+
+
+/*
+ * Appends the change a SET command makes to the log.
+ *
+ * returns 0 if it could not be logged, otherwise its sequence number.
+ */
+uint64_t walAppendSet(struct engine * e, struct command * cmd) {
+
+	struct sockaddr_in *addr = &e->modules[cmd->module].config.addr;
+	uint8_t bit = 0x01 << (cmd->request[1] - 1);
+	return walAppend(wal, addr->sin_addr.s_addr, addr->sin_port, bit, cmd->request[0] == SET_OUTPUT_ACTIVE ? bit : 0);
+
+}
+
+
+/*
+ * Logs a SET walSubmit() left to the engine and waits for it to be on disk.
+ * Runs on the shard thread.
+ *
+ * returns -1 if it could not be logged, otherwise 0.
+ */
+int walLogSet(struct engine * e, struct command * cmd) {
+
+	uint64_t seq = walAppendSet(e, cmd);
+	return seq == 0 || walCommit(wal, seq) < 0 ? -1 : 0;
+
+}
+
+
+/*
+ * Submits a command to an engine. With a log open a SET that is not a pulse
+ * is logged first, and it and anything after it are held in the batch until
+ * walRelease() so one commit covers all the changes made in between. A SET
+ * that cannot be logged fails without being sent. A toggle is only resolved
+ * on its module, so the engine logs the SET it turns into, and any SET for
+ * that module submitted before it has, in the order they are sent.
+ */
+void walSubmit(struct wal_batch * b, struct engine * e, struct command * cmd) {
+
+	if (wal == NULL) {
+		while (engineSubmit(e, cmd) < 0) {
+			sched_yield();
+		}
+		return;
+	}
+
+	struct module *mod = &e->modules[cmd->module];
+	uint8_t op = cmd->request[0];
+	int set = (op == SET_OUTPUT_ACTIVE || op == SET_OUTPUT_INACTIVE) && cmd->request[2] == 0;
+	if (cmd->toggle || (set && __atomic_load_n(&mod->log_toggles, __ATOMIC_ACQUIRE) > 0)) {
+		if (cmd->toggle) {
+			__atomic_fetch_add(&mod->log_toggles, 1, __ATOMIC_RELEASE);
+		}
+		cmd->logged = 1;
+		e->log_set = walLogSet; // Seen by the shard once the command is.
+	} else if (set) {
+		uint64_t seq = walAppendSet(e, cmd);
+		if (seq == 0) {
+			walFail(cmd);
+			return;
+		}
+		if (seq > b->seq) {
+			b->seq = seq;
+		}
+	}
+
+	cmd->next = NULL;
+	if (b->tail) {
+		b->tail->next = cmd;
+	} else {
+		b->head = cmd;
+	}
+	b->tail = cmd;
+
+}
+
+
+/*
+ * Commits the log for the commands held in a batch and sends them on. If the
+ * commit fails none of them are sent, they fail instead, as nothing may reach
+ * a module before it is on disk.
+ */
+void walRelease(struct wal_batch * b, struct engine * e) {
+
+	if (b->head == NULL) {
+		return;
+	}
+
+	int durable = b->seq == 0 || walCommit(wal, b->seq) == 0;
+
+	struct command *cmd = b->head;
+	while (cmd) {
+		struct command *next = cmd->next;
+		cmd->next = NULL;
+		if (!durable) {
+			if (cmd->toggle) {
+				__atomic_fetch_sub(&e->modules[cmd->module].log_toggles, 1, __ATOMIC_RELEASE);
+			}
+			walFail(cmd);
+		} else {
+			while (engineSubmit(e, cmd) < 0) {
+				sched_yield();
+			}
+		}
+		cmd = next;
+	}
+
+	b->head = b->tail = NULL;
+	b->seq = 0;
+
+}
+
+
+/*
+ * One module taking part in a scene.
+ */
+struct scene_module {
+	char *target;
+	uint8_t outputs;						// The states the scene wants.
+	uint8_t mask;							// The outputs it sets, the rest are left alone.
+	uint8_t before;							// The states read before switching.
+	int commands;							// SET commands needed.
+	int pending;							// Commands still outstanding.
+	int status;
+	uint64_t finished;						// When the last command completed.
+};
+
+
+/*
+ * Loads the modules of a named scene from a scene file. Each line of the file reads
+ *
+ *		<scene> <ip[:port]> <outputs> [password]
+ *
+ * char * path						- The scene file.
+ * char * name						- The scene to load.
+ * int port							- The port for targets without one.
+ * char * password					- The password for lines without one.
+ * struct module_config ** configs	- Set to the modules of the scene.
+ * struct scene_module ** mods		- Set to what the scene wants of each module.
+ * char ** text						- Set to the file text the entries point into.
+ *
+ * returns -1 on failure, otherwise the number of modules.
+ */
+int loadScene(char * path, char * name, int port, char * password, struct module_config ** configs,
+		struct scene_module ** mods, char ** text) {
+
+	*configs = NULL;
+	*mods = NULL;
+	*text = readFile(path);
+	if (*text == NULL) {
+		return -1;
+	}
+
+	int count = 0;
+	int line_no = 0;
+
+	char *save_line;
+	for (char *line = strtok_r(*text, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+
+		line_no++;
+
+		char *save_word;
+		char *scene = strtok_r(line, " \t\r", &save_word);
+		if (scene == NULL || scene[0] == '#' || strcmp(scene, name) != 0) {
+			continue;
+		}
+
+		char *target = strtok_r(NULL, " \t\r", &save_word);
+		char *mask = strtok_r(NULL, " \t\r", &save_word);
+		char *pass = strtok_r(NULL, " \t\r", &save_word);
+		int outputs = mask ? parseMask(mask) : -1;
+		int first = count; // A port range adds a module per port.
+
+		if (target == NULL || outputs < 0 || parseTarget(target, port, pass ? pass : password, configs, &count) < 0) {
+			printf("%s:%d: expected <scene> <ip[:port]> <outputs> [password]\n", path, line_no);
+			free(*text);
+			free(*configs);
+			free(*mods);
+			return -1;
+		}
+
+		*mods = realloc(*mods, count * sizeof(**mods));
+		for (int m = first; m < count; m++) {
+			memset(&(*mods)[m], 0, sizeof(**mods));
+			(*mods)[m].target = target;
+			(*mods)[m].outputs = outputs;
+			(*mods)[m].mask = 0xFF;
+		}
+
+	}
+
+	if (count == 0) {
+		printf("No modules in scene %s\n", name);
+		free(*text);
+		return -1;
+	}
+
+	return count;
+
+}
+
+
+/*
+ * Brings a set of modules to the states wanted of them. Every module is
+ * connected to at once, and once a module's current states are known only
+ * the outputs that differ are switched.
+ *
+ * struct module_config * configs	- The modules.
+ * struct scene_module * mods		- What is wanted of each module.
+ * int count						- The number of modules.
+ * int threads						- The number of engine threads.
+ * char * name						- What to call the states in the report.
+ *
+ * returns the number of modules that failed.
+ */
+int applyScene(struct module_config * configs, struct scene_module * mods, int count, int threads, char * name) {
+
+	// Up to eight SETs per module go out back to back.
+	inventoryApply(&inventory, configs, count);
+	struct engine *e = engineCreate(configs, count, threads, 1);
+	e->depth = 8;
+	engineStart(e);
+
+	struct command_pool pool;
+	struct ring reply;
+	if (commandPoolInit(&pool, count * 9) < 0 || ringInit(&reply, count * 9, NULL) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start = nowNs();
+	int outstanding = 0;
+
+	for (int m = 0; m < count; m++) {
+		struct command *cmd = commandAlloc(&pool);
+		commandPrepare(cmd, m, GET_DIGITAL_OUTPUTS, 0, 0);
+		cmd->reply = &reply;
+		mods[m].pending = 1;
+		while (engineSubmit(e, cmd) < 0) {
+			sched_yield();
+		}
+		outstanding++;
+	}
+
+	while (outstanding > 0) {
+
+		struct command *cmd = ringWait(&reply, -1);
+		struct scene_module *sm = &mods[cmd->module];
+		outstanding--;
+		sm->pending--;
+
+		if (cmd->status != STATUS_OK) {
+			sm->status = cmd->status;
+		} else if (cmd->request[0] == GET_DIGITAL_OUTPUTS) {
+
+			// Switch only the outputs that are not already where the scene wants them.
+			sm->before = cmd->response[0];
+			uint8_t diff = (sm->before ^ sm->outputs) & sm->mask;
+			for (int r = 0; r < 8; r++) {
+				if (diff & (0x01 << r)) {
+					struct command *set = commandAlloc(&pool);
+					commandPrepare(set, cmd->module, (sm->outputs & (0x01 << r)) ? SET_OUTPUT_ACTIVE : SET_OUTPUT_INACTIVE, r + 1, 0);
+					set->reply = &reply;
+					while (engineSubmit(e, set) < 0) {
+						sched_yield();
+					}
+					sm->commands++;
+					sm->pending++;
+					outstanding++;
+				}
+			}
+
+		}
+
+		if (sm->pending == 0) {
+			sm->finished = cmd->completed;
+		}
+		commandRelease(&pool, cmd);
+
+	}
+
+	engineStop(e);
+	if (show_stats) {
+		printEngineStats(e);
+	}
+	engineDestroy(e);
+
+	// Report each module, and the spread between the first and last to switch.
+	uint64_t first = 0, last = 0;
+	int failed = 0;
+
+	printf("%-24s %-8s %-8s %-4s %s\n", "module", "before", "after", "sets", "done (ms)");
+	for (int m = 0; m < count; m++) {
+		struct scene_module *sm = &mods[m];
+		if (sm->status != STATUS_OK) {
+			printf("%-24s failed (%d)\n", sm->target, sm->status);
+			failed++;
+			continue;
+		}
+		printf("%-24s 0x%02X     0x%02X     %-4d %.3f\n", sm->target, sm->before,
+				(sm->before & ~sm->mask) | (sm->outputs & sm->mask), sm->commands, (sm->finished - start) / 1e6);
+		if (sm->commands > 0) {
+			if (first == 0 || sm->finished < first) first = sm->finished;
+			if (sm->finished > last) last = sm->finished;
+		}
+	}
+
+	printf("Scene %s: %d modules, %d failed, total %.3f ms, switching skew %.3f ms\n", name, count, failed,
+			(nowNs() - start) / 1e6, (last - first) / 1e6);
+
+	ringFree(&reply);
+	commandPoolFree(&pool);
+	return failed;
+
+}
+
+
+/*
+ * Logs the states a scene wants of its modules when there is a log, and
+ * waits for them to be durable.
+ *
+ * returns -1 if they could not be logged, otherwise 0.
+ */
+int logScene(struct module_config * configs, struct scene_module * mods, int count) {
+
+	if (wal == NULL) {
+		return 0;
+	}
+
+	uint64_t seq = 0;
+	for (int m = 0; m < count; m++) {
+		uint64_t s = walAppend(wal, configs[m].addr.sin_addr.s_addr, configs[m].addr.sin_port, mods[m].mask,
+				mods[m].outputs);
+		if (s == 0) {
+			return -1;
+		}
+		seq = s;
+	}
+	return walCommit(wal, seq);
+
+}
+
+
+/*
+ * Applies a named scene from a scene file.
+ *
+ * char * path			- The scene file.
+ * char * name			- The scene to apply.
+ * int port				- The port for targets without one.
+ * char * password		- The password for lines without one.
+ * int threads			- The number of engine threads.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int runScene(char * path, char * name, int port, char * password, int threads) {
+
+	struct module_config *configs;
+	struct scene_module *mods;
+	char *text;
+	int count = loadScene(path, name, port, password, &configs, &mods, &text);
+	if (count < 0) {
+		return -1;
+	}
+
+	// Nothing is sent unless the whole scene is on disk.
+	int failed = -1;
+	if (logScene(configs, mods, count) == 0) {
+		failed = applyScene(configs, mods, count, threads, name);
+	}
+
+	free(mods);
+	free(configs);
+	free(text);
+	return failed ? -1 : 0;
+
+}
+
+
+/*
+ * Parses a deadline, either +<ms> from now or an absolute time in seconds,
+ * on the given clock.
+ *
+ * returns 0 if the text is not a time, otherwise the deadline in nanoseconds.
+ */
+uint64_t parseDeadline(char * text, clockid_t clock) {
+
+	char *end;
+	double value = strtod(text[0] == '+' ? text + 1 : text, &end);
+
+	if (*end != '\0' || value < 0) {
+		return 0;
+	}
+
+	if (text[0] == '+') {
+		struct timespec ts;
+		clock_gettime(clock, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec + (uint64_t) (value * 1e6);
+	}
+
+	return (uint64_t) (value * 1e9);
+
+}
+
+
+/*
+ * Switches every module of a scene at the same instant. All modules are
+ * connected, unlocked and read up front and the SET commands each needs are
+ * encoded into one frame per module. A timerfd sleeps until shortly before
+ * the deadline and the final stretch is spun out so the writes go back to
+ * back as close to the deadline as possible.
+ *
+ * char * path			- The scene file.
+ * char * name			- The scene to apply.
+ * int port				- The port for targets without one.
+ * char * password		- The password for lines without one.
+ * char * at			- The deadline, +<ms> from now or absolute seconds.
+ * clockid_t clock		- CLOCK_REALTIME or CLOCK_MONOTONIC.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int runSync(char * path, char * name, int port, char * password, char * at, clockid_t clock) {
+
+	struct module_config *configs;
+	struct scene_module *mods;
+	char *text;
+	int count = loadScene(path, name, port, password, &configs, &mods, &text);
+	if (count < 0) {
+		return -1;
+	}
+
+	// Nothing is sent unless the whole scene is on disk.
+	if (logScene(configs, mods, count) < 0) {
+		free(mods);
+		free(configs);
+		free(text);
+		return -1;
+	}
+
+	int *sockets = calloc(count, sizeof(*sockets));
+	uint8_t (*frames)[8 * CMD_MAX_REQUEST] = calloc(count, sizeof(*frames));
+	int *frame_lens = calloc(count, sizeof(*frame_lens));
+	uint64_t *sent = calloc(count, sizeof(*sent));
+	int *unsent = calloc(count, sizeof(*unsent));
+
+	// Connect, unlock and work out what each module needs before the deadline.
+	inventoryApply(&inventory, configs, count);
+	for (int m = 0; m < count; m++) {
+
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &configs[m].addr.sin_addr, ip, sizeof(ip));
+
+		cliOperation(OP_CONNECT);
+		sockets[m] = openSocket(ip, ntohs(configs[m].addr.sin_port));
+		cliOperation(OP_UNLOCK);
+		if (sockets[m] < 0 || (!configs[m].open && unlockModule(sockets[m], configs[m].password) < 0)) {
+			printf("Unable to prepare %s\n", mods[m].target);
+			exit(EXIT_FAILURE);
+		}
+
+		int one = 1;
+		setsockopt(sockets[m], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		uint8_t buffer[1];
+		cliOperation(OP_OUTPUTS);
+		getDigitalOutputStates(sockets[m], buffer);
+		mods[m].before = buffer[0];
+
+		uint8_t diff = (mods[m].before ^ mods[m].outputs) & mods[m].mask;
+		for (int r = 0; r < 8; r++) {
+			if (diff & (0x01 << r)) {
+				uint8_t args[2] = { r + 1, 0x00 };
+				frame_lens[m] += encodeCommand(frames[m] + frame_lens[m],
+						(mods[m].outputs & (0x01 << r)) ? SET_OUTPUT_ACTIVE : SET_OUTPUT_INACTIVE, args, sizeof(args));
+				mods[m].commands++;
+			}
+		}
+
+	}
+
+	uint64_t deadline = parseDeadline(at, clock);
+	uint64_t now = clockNs(clock);
+	if (deadline == 0 || deadline <= now) {
+		printf("The deadline %s is not in the future.\n", at);
+		exit(EXIT_FAILURE);
+	}
+
+	// Sleep until just before the deadline, then spin for the last stretch.
+	uint64_t spin_ns = 200000;
+	if (deadline - now > spin_ns) {
+		int tfd = timerfd_create(clock, TFD_CLOEXEC);
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = (deadline - spin_ns) / 1000000000ull;
+		its.it_value.tv_nsec = (deadline - spin_ns) % 1000000000ull;
+		uint64_t expirations;
+		if (tfd < 0 || timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0
+				|| read(tfd, &expirations, sizeof(expirations)) < 0) {
+			perror("runSync - ");
+		}
+		close(tfd);
+	}
+	while (clockNs(clock) < deadline) {
+		// Spin
+	}
+
+	for (int m = 0; m < count; m++) {
+		if (mods[m].commands > 0) {
+			ssize_t written = write(sockets[m], frames[m], frame_lens[m]);
+			if (written < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("runSync - ");
+				mods[m].status = STATUS_ERROR;
+			}
+			unsent[m] = frame_lens[m] - (written > 0 ? written : 0);
+			sent[m] = clockNs(clock);
+			// Counted after the fact so the bookkeeping stays off the timed path.
+			cli_stats[OP_TOGGLE].operations++;
+			cli_stats[OP_TOGGLE].writes++;
+			cli_stats[OP_TOGGLE].frames += mods[m].commands;
+			cli_stats[OP_TOGGLE].bytes_written += written > 0 ? written : 0;
+		}
+	}
+
+	// Whatever a full send buffer held back follows once every module has had its first write.
+	for (int m = 0; m < count; m++) {
+		cli_op = OP_TOGGLE;
+		if (mods[m].commands > 0 && mods[m].status == STATUS_OK && unsent[m] > 0
+				&& writeData(sockets[m], frames[m] + frame_lens[m] - unsent[m], unsent[m]) < 0) {
+			mods[m].status = STATUS_ERROR;
+		}
+	}
+
+	// Collect the acknowledgements and report how far apart the writes went out.
+	uint64_t first = 0, last = 0;
+	int failed = 0;
+
+	printf("%-24s %-8s %-8s %-4s %s\n", "module", "before", "after", "sets", "sent (us after deadline)");
+	for (int m = 0; m < count; m++) {
+
+		uint8_t acks[8];
+		cli_op = OP_TOGGLE;
+		if (mods[m].commands > 0 && mods[m].status == STATUS_OK) {
+			if (readData(sockets[m], acks, mods[m].commands) != mods[m].commands) {
+				mods[m].status = STATUS_ERROR;
+			} else {
+				for (int c = 0; c < mods[m].commands; c++) {
+					if (!responseValid(SET_OUTPUT_ACTIVE, &acks[c])) mods[m].status = STATUS_REJECTED;
+				}
+			}
+		}
+
+		cliOperation(OP_LOGOUT);
+		sendLogout(sockets[m]);
+		close(sockets[m]);
+
+		if (mods[m].status != STATUS_OK) {
+			printf("%-24s failed\n", mods[m].target);
+			failed++;
+			continue;
+		}
+
+		if (mods[m].commands == 0) {
+			printf("%-24s 0x%02X     0x%02X     0    -\n", mods[m].target, mods[m].before, mods[m].outputs);
+			continue;
+		}
+
+		printf("%-24s 0x%02X     0x%02X     %-4d %.1f\n", mods[m].target, mods[m].before, mods[m].outputs,
+				mods[m].commands, (sent[m] - deadline) / 1e3);
+		if (first == 0 || sent[m] < first) first = sent[m];
+		if (sent[m] > last) last = sent[m];
+
+	}
+
+	printf("Scene %s: %d modules, %d failed, send skew %.1f us\n", name, count, failed, (last - first) / 1e3);
+	if (show_stats) {
+		printCliStats();
+	}
+
+	free(sent);
+	free(unsent);
+	free(frame_lens);
+	free(frames);
+	free(sockets);
+	free(mods);
+	free(configs);
+	free(text);
+	return failed ? -1 : 0;
+
+}
+
+
+/*
+ * Latency histogram with about 1.5% precision, in the style of HdrHistogram.
+ * Values below 128 have a bucket each, above that every power of two is
+ * split into 64 buckets.
+ */
+#define HIST_SUB_BITS			6
+#define HIST_BUCKETS			(64 * 58)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+
+/*
+ * Returns the bucket a value falls in.
+ */
+int histIndex(uint64_t v) {
+
+	if (v < (2u << HIST_SUB_BITS)) {
+		return (int) v;
+	}
+
+	int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return e * (1 << HIST_SUB_BITS) + (int) (v >> e);
+
+}
+
+
+/*
+ * Returns the lowest value that falls in a bucket.
+ */
+uint64_t histValue(int index) {
+
+	if (index < (2 << HIST_SUB_BITS)) {
+		return index;
+	}
+
+	int e = index / (1 << HIST_SUB_BITS) - 1;
+	return (uint64_t) (index - e * (1 << HIST_SUB_BITS)) << e;
+
+}
+
+
+/*
+ * Records count occurrences of a value.
+ */
+void histRecord(struct histogram * h, uint64_t v, uint64_t count) {
+
+	int i = histIndex(v);
+	if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+	h->counts[i] += count;
+	h->total += count;
+	if (v > h->max) h->max = v;
+
+}
+
+
+/*
+ * Returns the value below which the given fraction of recordings fall.
+ */
+uint64_t histPercentile(struct histogram * h, double fraction) {
+
+	uint64_t want = (uint64_t) (fraction * h->total + 0.5), seen = 0;
+	if (want == 0) want = 1;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= want) {
+			return histValue(i);
+		}
+	}
+	return h->max;
+
+}
+
+
+/*
+ * Copies a histogram adding the samples a closed-loop client failed to take
+ * while it was stalled. Every recording longer than the expected interval
+ * between requests also stands for the requests that would have been sent
+ * during it, each waiting that much less.
+ */
+void histCorrect(struct histogram * src, struct histogram * dst, uint64_t interval) {
+
+	memcpy(dst, src, sizeof(*dst));
+	if (interval == 0) {
+		return;
+	}
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (src->counts[i] == 0) continue;
+		for (uint64_t v = histValue(i); v > interval; ) {
+			v -= interval;
+			histRecord(dst, v, src->counts[i]);
+		}
+	}
+
+}
+
+
+/*
+ * Mean of the recordings in a histogram.
+ */
+double histMean(struct histogram * h) {
+
+	double sum = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		sum += (double) histValue(i) * h->counts[i];
+	}
+	return h->total ? sum / h->total : 0;
+
+}
+
+
+/*
+ * Prints the usual percentiles of a histogram in microseconds.
+ */
+void histPrint(char * label, struct histogram * h) {
+
+	printf("%-10s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", label,
+			histPercentile(h, 0.5) / 1e3, histPercentile(h, 0.9) / 1e3, histPercentile(h, 0.99) / 1e3,
+			histPercentile(h, 0.999) / 1e3, h->max / 1e3);
+
+}
+
+
+/*
+ * One kind of command in a load mix and how often it is sent.
+ */
+struct load_op {
+	uint8_t op;
+	int alternate;							// Alternate between SET_OUTPUT_ACTIVE and INACTIVE.
+	int priority;
+	int weight;
+};
+
+#define LOAD_OPS 16
+struct load_op load_ops[LOAD_OPS];
+int load_op_count;
+
+
+/*
+ * Parses a mix such as get:70,set:20,info:5,unlock:5 into load_ops. Any
+ * command table name can be used, and "set" alternates between on and off.
+ * A name may be followed by a priority class, as in get/bulk:90,set/urgent:1.
+ *
+ * returns -1 if the mix is not valid, otherwise the total weight.
+ */
+int parseMix(char * spec) {
+
+	char copy[256];
+	int total = 0;
+
+	load_op_count = 0;
+
+	strncpy(copy, spec, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = '\0';
+
+	char *save;
+	for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+
+		char *colon = strchr(item, ':');
+		int weight = colon ? atoi(colon + 1) : 1;
+		if (colon) *colon = '\0';
+
+		char *slash = strchr(item, '/');
+		int priority = slash ? priorityByName(slash + 1) : PRIORITY_NORMAL;
+		if (slash) *slash = '\0';
+
+		int alternate = strcmp(item, "set") == 0;
+		int op = alternate ? SET_OUTPUT_ACTIVE : commandByName(item);
+		if (op < 0 || op == SEND_PASSWORD || priority < 0 || weight < 0 || load_op_count == LOAD_OPS) {
+			return -1;
+		}
+
+		load_ops[load_op_count].op = op;
+		load_ops[load_op_count].alternate = alternate;
+		load_ops[load_op_count].priority = priority;
+		load_ops[load_op_count].weight = weight;
+		load_op_count++;
+		total += weight;
+
+	}
+
+	return total;
+
+}
+
+
+/*
+ * xorshift64* random numbers, so runs can be repeated with the same seed.
+ */
+uint64_t nextRandom(uint64_t * state) {
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+
+}
+
+
+/*
+ * What a load run does.
+ */
+struct load_options {
+	int threads;
+	int depth;								// Commands in flight per connection when closed-loop.
+	int seconds;
+	double rate;							// Commands per second when open-loop, 0 for closed-loop.
+	int mix_total;
+	uint64_t seed;
+};
+
+
+/*
+ * Fills in the next command of the mix for a connection.
+ */
+void loadPrepare(struct command * cmd, int module, int mix_total, uint64_t * rng) {
+
+	int pick = (int) (nextRandom(rng) % mix_total);
+	struct load_op *lo = load_ops;
+
+	while (pick >= lo->weight) {
+		pick -= lo->weight;
+		lo++;
+	}
+
+	uint8_t op = lo->op;
+	uint8_t output = (uint8_t) (nextRandom(rng) % 8 + 1);
+	if (lo->alternate && (nextRandom(rng) & 1)) {
+		op = SET_OUTPUT_INACTIVE;
+	}
+
+	commandPrepare(cmd, module, op, output, 0);
+	cmd->priority = lo->priority;
+
+}
+
+
+/*
+ * Drives load against the modules and reports throughput, errors and
+ * latency. Closed-loop keeps depth commands in flight per connection;
+ * open-loop sends at a fixed rate from a schedule, so a stalled module
+ * cannot make the generator quietly send less. Open-loop latency is
+ * measured from when each command should have been sent, closed-loop
+ * latency is corrected for coordinated omission afterwards.
+ *
+ * struct module_config * configs	- The connections to open.
+ * int count						- The number of connections.
+ * struct load_options * opts		- What to do.
+ */
+void runLoad(struct module_config * configs, int count, struct load_options * opts) {
+
+	struct engine *e = engineCreate(configs, count, opts->threads, 1);
+	int slots = opts->rate > 0 ? count * 64 : count * opts->depth;
+	e->depth = opts->rate > 0 ? 64 : opts->depth;
+	engineStart(e);
+
+	struct command_pool pool;
+	struct ring reply;
+	struct histogram *service = calloc(1, sizeof(*service));
+	struct histogram *response = calloc(1, sizeof(*response));
+	struct histogram *classes = calloc(PRIORITY_CLASSES, sizeof(*classes));	// Service time of each priority class.
+	uint64_t *intended = calloc(slots, sizeof(*intended));	// When each pooled command was due.
+	int *refill = calloc(slots, sizeof(*refill));			// Closed-loop, the connections owed a command.
+	if (commandPoolInit(&pool, slots) < 0 || ringInit(&reply, slots, NULL) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	// Bring every connection up before the clock starts.
+	for (int m = 0; m < count; m++) {
+		struct command *cmd = commandAlloc(&pool);
+		commandPrepare(cmd, m, GET_DIGITAL_OUTPUTS, 0, 0);
+		cmd->reply = &reply;
+		while (engineSubmit(e, cmd) < 0) sched_yield();
+	}
+	for (int m = 0; m < count; m++) {
+		commandRelease(&pool, ringWait(&reply, -1));
+	}
+
+	uint64_t rng = opts->seed ? opts->seed : 0x9E3779B97F4A7C15ull;
+	uint64_t sent = 0, ok = 0, rejected = 0, timeouts = 0, errors = 0;
+	uint64_t interval = opts->rate > 0 ? (uint64_t) (1e9 / opts->rate) : 0;
+	uint64_t start = nowNs(), end = start + (uint64_t) opts->seconds * 1000000000ull;
+	uint64_t next_due = start;
+	int next_module = 0, outstanding = 0, refills = 0;
+	if (opts->rate == 0) {
+		for (int i = 0; i < slots; i++) {
+			refill[refills++] = i % count;
+		}
+	}
+
+	for (;;) {
+
+		uint64_t now = nowNs();
+		int sending = now < end;
+
+		// Send whatever is due, on the schedule round robin when open-loop, or to
+		// the connections that completed one to refill their depth when closed-loop.
+		while (sending && (opts->rate > 0 ? next_due <= now : refills > 0)) {
+			struct command *cmd = commandAlloc(&pool);
+			if (cmd == NULL) {
+				break;
+			}
+			loadPrepare(cmd, opts->rate > 0 ? next_module : refill[refills - 1], opts->mix_total, &rng);
+			cmd->reply = &reply;
+			intended[cmd - pool.cmds] = opts->rate > 0 ? next_due : now;
+			if (engineSubmit(e, cmd) < 0) {
+				commandRelease(&pool, cmd);
+				break;
+			}
+			if (opts->rate > 0) {
+				next_module = (next_module + 1) % count;
+			} else {
+				refills--;
+			}
+			sent++;
+			outstanding++;
+			next_due += interval;
+		}
+
+		if (!sending && outstanding == 0) {
+			break;
+		}
+
+		// Wait for completions, or until the next command is due.
+		int timeout = 100;
+		if (sending && opts->rate > 0) {
+			now = nowNs();
+			timeout = next_due > now ? (int) ((next_due - now) / 1000000) : 0;
+		}
+		struct command *cmd = ringWait(&reply, timeout);
+
+		while (cmd) {
+			if (cmd->status == STATUS_OK || cmd->status == STATUS_REJECTED) {
+				histRecord(service, cmd->completed - cmd->submitted, 1);
+				histRecord(response, cmd->completed - intended[cmd - pool.cmds], 1);
+				histRecord(&classes[cmd->priority], cmd->completed - cmd->submitted, 1);
+				ok++;
+				rejected += cmd->status == STATUS_REJECTED;
+			} else if (cmd->status == STATUS_TIMEOUT) {
+				timeouts++;
+			} else {
+				errors++;
+			}
+			outstanding--;
+			if (opts->rate == 0) {
+				refill[refills++] = cmd->module;
+			}
+			commandRelease(&pool, cmd);
+			cmd = ringPop(&reply);
+		}
+
+	}
+
+	double elapsed = (nowNs() - start) / 1e9;
+
+	engineStop(e);
+	if (show_stats) {
+		printEngineStats(e);
+	}
+	engineDestroy(e);
+
+	if (opts->rate > 0) {
+		printf("Open-loop at %.0f commands/s over %d connections for %d s\n", opts->rate, count, opts->seconds);
+	} else {
+		printf("Closed-loop with %d in flight on each of %d connections for %d s\n", opts->depth, count, opts->seconds);
+		// Closed-loop clients stop sending while stalled; put back what they would have sent.
+		struct histogram *raw = response;
+		response = calloc(1, sizeof(*response));
+		histCorrect(raw, response, (uint64_t) histMean(raw));
+		free(raw);
+	}
+
+	printf("sent %llu  completed %llu  rejected %llu  timeouts %llu  errors %llu\n", (unsigned long long) sent,
+			(unsigned long long) ok, (unsigned long long) rejected, (unsigned long long) timeouts, (unsigned long long) errors);
+	printf("throughput %.0f commands/s, error rate %.3f%%\n", ok / elapsed,
+			sent ? 100.0 * (rejected + timeouts + errors) / sent : 0);
+	histPrint("service", service);
+	histPrint("response", response);
+
+	// Break service times down by priority when the mix has more than one class.
+	int used = 0;
+	for (int p = 0; p < PRIORITY_CLASSES; p++) {
+		used += classes[p].total > 0;
+	}
+	for (int p = PRIORITY_CLASSES - 1; p >= 0 && used > 1; p--) {
+		if (classes[p].total > 0) {
+			histPrint(priority_names[p], &classes[p]);
+		}
+	}
+
+	ringFree(&reply);
+	commandPoolFree(&pool);
+	free(intended);
+	free(refill);
+	free(service);
+	free(response);
+	free(classes);
+
+}
+
+
+
+/*
+ * One row of a batch job file.
+ */
+struct batch_row {
+	int line;								// Line number in the job file.
+	char *address;
+	int port;
+	char *operation;
+	int module;								// Index of the module the row runs on.
+	int next;								// The next row for the same module, -1 if none.
+	uint8_t op;
+	uint8_t output;
+	uint8_t pulse;
+	uint8_t toggle;
+	int status;
+	uint8_t response[CMD_MAX_RESPONSE];
+	int response_len;
+	uint64_t submitted;
+	uint64_t completed;
+};
+
+
+/*
+ * The rows of a batch job that run on one module, in file order.
+ */
+struct batch_module {
+	int first;
+	int last;
+	int pending;							// Commands still outstanding, including the logout.
+};
+
+
+/*
+ * Splits a line of comma separated values in place. Fields are trimmed of
+ * spaces, empty fields are kept and quoting is not supported.
+ *
+ * returns the number of fields found, at most max.
+ */
+int splitFields(char * line, char ** fields, int max) {
+
+	int n = 0;
+	char *p = line;
+
+	while (n < max) {
+		char *comma = strchr(p, ',');
+		if (comma) {
+			*comma = '\0';
+		}
+		while (*p == ' ' || *p == '\t') p++;
+		char *end = p + strlen(p);
+		while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) *--end = '\0';
+		fields[n++] = p;
+		if (comma == NULL) {
+			break;
+		}
+		p = comma + 1;
+	}
+	return n;
+
+}
+
+
+/*
+ * Returns a short name for a command status.
+ */
+const char * statusName(int status) {
+
+	switch (status) {
+		case STATUS_OK:			return "ok";
+		case STATUS_TIMEOUT:	return "timeout";
+		case STATUS_LOCKED:		return "locked";
+		case STATUS_REJECTED:	return "rejected";
+		default:				return "error";
+	}
+
+}
+
+
+/*
+ * Loads a batch job file. Each line reads
+ *
+ *		<address>,[port],[password],<operation>[,output[,pulse]]
+ *
+ * where the operation is a command name from the command table or toggle.
+ * Blank lines, lines starting with # and a header line starting with
+ * "address" are skipped. Rows for the same address and port are grouped
+ * onto one module.
+ *
+ * char * text						- The file text, split in place.
+ * int port							- The port for rows without one.
+ * char * password					- The password for rows without one.
+ * struct batch_row ** rows			- Set to the rows of the job.
+ * int * row_count					- Set to the number of rows.
+ * struct module_config ** configs	- Set to the distinct modules.
+ *
+ * returns -1 on failure, otherwise the number of modules.
+ */
+int loadBatch(char * text, int port, char * password, struct batch_row ** rows, int * row_count,
+		struct module_config ** configs) {
+
+	*rows = NULL;
+	*row_count = 0;
+	*configs = NULL;
+
+	int count = 0;
+	int line_no = 0;
+	char *line = text;
+
+	while (line && *line) {
+
+		char *eol = strchr(line, '\n');
+		if (eol) {
+			*eol = '\0';
+		}
+		line_no++;
+
+		char *f[6];
+		int n = splitFields(line, f, 6);
+		line = eol ? eol + 1 : NULL;
+
+		if (f[0][0] == '\0' || f[0][0] == '#' || strcmp(f[0], "address") == 0) {
+			continue;
+		}
+
+		int row_port = n > 1 && f[1][0] ? atoi(f[1]) : port;
+		char *row_password = n > 2 && f[2][0] ? f[2] : password;
+		int op = n > 3 ? commandByName(f[3]) : -1;
+		int toggle = n > 3 && strcmp(f[3], "toggle") == 0;
+		int output = n > 4 ? atoi(f[4]) : 0;
+		int pulse = n > 5 ? atoi(f[5]) : 0;
+		int needs_output = toggle || op == SET_OUTPUT_ACTIVE || op == SET_OUTPUT_INACTIVE;
+
+		struct module_config *parsed = NULL;
+		int parsed_count = 0;
+		if ((op < 0 && !toggle) || op == SEND_PASSWORD || (needs_output && (output < 1 || output > 8))
+				|| pulse < 0 || pulse > 255 || (row_password && strlen(row_password) > MAX_PASSWORD)
+				|| row_port < 1 || row_port > 65535) {
+			parsed_count = -1;
+		} else {
+			char spec[80];
+			snprintf(spec, sizeof(spec), "%s:%d", f[0], row_port);
+			if (parseTarget(spec, row_port, row_password, &parsed, &parsed_count) < 0) {
+				parsed_count = -1;
+			}
+		}
+
+		if (parsed_count != 1) {
+			printf("line %d: expected <address>,[port],[password],<operation>[,output[,pulse]]\n", line_no);
+			free(parsed);
+			free(*rows);
+			free(*configs);
+			return -1;
+		}
+
+		// Rows for a module already seen join its session.
+		int m;
+		for (m = 0; m < count; m++) {
+			if ((*configs)[m].addr.sin_addr.s_addr == parsed->addr.sin_addr.s_addr
+					&& (*configs)[m].addr.sin_port == parsed->addr.sin_port) {
+				break;
+			}
+		}
+		if (m == count) {
+			*configs = realloc(*configs, (count + 1) * sizeof(**configs));
+			(*configs)[count++] = *parsed;
+		}
+		free(parsed);
+
+		*rows = realloc(*rows, (*row_count + 1) * sizeof(**rows));
+		struct batch_row *row = &(*rows)[(*row_count)++];
+		memset(row, 0, sizeof(*row));
+		row->line = line_no;
+		row->address = f[0];
+		row->port = row_port;
+		row->operation = f[3];
+		row->module = m;
+		row->next = -1;
+		row->op = toggle ? GET_DIGITAL_OUTPUTS : op;
+		row->output = output;
+		row->pulse = pulse;
+		row->toggle = toggle;
+		row->status = STATUS_ERROR;
+
+	}
+
+	if (*row_count == 0) {
+		printf("No rows in the batch job\n");
+		return -1;
+	}
+
+	return count;
+
+}
+
+
+/*
+ * Options for a batch job.
+ */
+struct batch_options {
+	int threads;
+	int depth;								// Commands in flight per module.
+	int parallel;							// Modules worked on at once.
+	char *results;							// Where to write the per row results.
+};
+
+
+/*
+ * Queues every row of a module followed by a logout that ends its session.
+ * With a log open the commands wait in held until their changes are logged.
+ */
+void batchStart(struct engine * e, struct command_pool * pool, struct ring * reply, struct wal_batch * held,
+		struct batch_row * rows, struct batch_module * bm, int module) {
+
+	for (int r = bm->first; r >= 0; r = rows[r].next) {
+		struct command *cmd = commandAlloc(pool);
+		if (rows[r].toggle) {
+			commandPrepareToggle(cmd, module, rows[r].output);
+		} else {
+			commandPrepare(cmd, module, rows[r].op, rows[r].output, rows[r].pulse);
+		}
+		cmd->priority = PRIORITY_BULK;
+		cmd->user = &rows[r];
+		cmd->reply = reply;
+		cmd->submitted = nowNs();
+		rows[r].submitted = cmd->submitted;
+		walSubmit(held, e, cmd);
+		bm->pending++;
+	}
+
+	struct command *cmd = commandAlloc(pool);
+	commandPrepare(cmd, module, LOGOUT, 0, 0);
+	cmd->priority = PRIORITY_BULK;
+	cmd->user = NULL;
+	cmd->reply = reply;
+	cmd->close = 1;
+	walSubmit(held, e, cmd);
+	bm->pending++;
+
+}
+
+
+/*
+ * Runs a batch job. Each module gets one session that carries all of its
+ * rows in file order, and at most opts->parallel modules are worked on at
+ * once. The outcome of every row is written to the results file.
+ *
+ * char * path					- The batch job file.
+ * int port						- The port for rows without one.
+ * char * password				- The password for rows without one.
+ * struct batch_options * opts	- How to run the job.
+ *
+ * returns -1 on failure or if any row failed, otherwise 0.
+ */
+int runBatch(char * path, int port, char * password, struct batch_options * opts) {
+
+	char *text = readFile(path);
+	if (text == NULL) {
+		return -1;
+	}
+
+	struct batch_row *rows;
+	struct module_config *configs;
+	int row_count;
+	int count = loadBatch(text, port, password, &rows, &row_count, &configs);
+	if (count < 0) {
+		free(text);
+		return -1;
+	}
+
+	FILE *out = fopen(opts->results, "w");
+	if (out == NULL) {
+		perror("runBatch - ");
+		free(rows);
+		free(configs);
+		free(text);
+		return -1;
+	}
+
+	// Chain the rows of each module together in file order.
+	struct batch_module *mods = calloc(count, sizeof(*mods));
+	for (int m = 0; m < count; m++) {
+		mods[m].first = mods[m].last = -1;
+	}
+	for (int r = 0; r < row_count; r++) {
+		struct batch_module *bm = &mods[rows[r].module];
+		if (bm->last >= 0) {
+			rows[bm->last].next = r;
+		} else {
+			bm->first = r;
+		}
+		bm->last = r;
+	}
+
+	inventoryApply(&inventory, configs, count);
+	struct engine *e = engineCreate(configs, count, opts->threads, 1);
+	e->depth = opts->depth;
+	engineStart(e);
+
+	// Every row and logout may be outstanding at once in the worst case.
+	struct command_pool pool;
+	struct ring reply;
+	if (commandPoolInit(&pool, row_count + count) < 0 || ringInit(&reply, row_count + count, NULL) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start = nowNs();
+	int next = 0, active = 0, failed = 0;
+	struct wal_batch held = { NULL, NULL, 0 };
+
+	while (next < count && active < opts->parallel) {
+		batchStart(e, &pool, &reply, &held, rows, &mods[next], next);
+		next++;
+		active++;
+	}
+
+	while (active > 0) {
+
+		// Modules started since the last wait share one commit.
+		struct command *cmd = ringPop(&reply);
+		if (cmd == NULL) {
+			walRelease(&held, e);
+			cmd = ringWait(&reply, -1);
+		}
+		struct batch_row *row = cmd->user;
+
+		if (row) {
+			row->status = cmd->status;
+			row->completed = cmd->completed;
+			row->response_len = cmd->response_len;
+			memcpy(row->response, cmd->response, cmd->response_len);
+			failed += cmd->status != STATUS_OK;
+		}
+
+		struct batch_module *bm = &mods[cmd->module];
+		commandRelease(&pool, cmd);
+
+		if (--bm->pending == 0) {
+			active--;
+			if (next < count) {
+				batchStart(e, &pool, &reply, &held, rows, &mods[next], next);
+				next++;
+				active++;
+			}
+		}
+
+	}
+
+	double elapsed = (nowNs() - start) / 1e6;
+
+	engineStop(e);
+	if (show_stats) {
+		printEngineStats(e);
+	}
+	engineDestroy(e);
+
+	fprintf(out, "line,address,port,operation,output,pulse,status,response,start_ms,latency_ms\n");
+	for (int r = 0; r < row_count; r++) {
+		struct batch_row *row = &rows[r];
+		fprintf(out, "%d,%s,%d,%s,%d,%d,%s,", row->line, row->address, row->port, row->operation, row->output,
+				row->pulse, statusName(row->status));
+		for (int i = 0; i < row->response_len && row->status == STATUS_OK; i++) {
+			fprintf(out, "%02X", row->response[i]);
+		}
+		if (row->completed) {
+			fprintf(out, ",%.3f,%.3f\n", (row->submitted - start) / 1e6, (row->completed - row->submitted) / 1e6);
+		} else {
+			fprintf(out, ",,\n");
+		}
+	}
+	if (fclose(out) != 0) {
+		perror("runBatch - ");
+		failed++;
+	}
+
+	printf("Batch %s: %d rows on %d modules, %d failed, %.3f ms, results in %s\n", path, row_count, count, failed,
+			elapsed, opts->results);
+
+	ringFree(&reply);
+	commandPoolFree(&pool);
+	free(mods);
+	free(rows);
+	free(configs);
+	free(text);
+	return failed ? -1 : 0;
+
+}
+
+
+/*
+ * The module ID an ETH008 reports in answer to GET_INFO.
+ */
+#define ETH008_MODULE_ID		19
+
+/*
+ * A connection probing one address for a module.
+ */
+struct probe {
+	int fd;									// -1 when the slot is free.
+	uint32_t addr;							// Network byte order.
+	uint16_t port;
+	int connected;
+	int got;								// Bytes of the GET_INFO and GET_UNLOCK responses received.
+	uint8_t info[CMD_MAX_RESPONSE];
+	uint64_t deadline;
+};
+
+/*
+ * Consecutive addresses to probe on one port, in host byte order.
+ */
+struct sweep_range {
+	uint32_t first;
+	uint32_t last;
+	uint16_t port;
+};
+
+/*
+ * Options for a discovery sweep.
+ */
+struct discovery_options {
+	int port;
+	int parallel;							// Connections open at once.
+	double rate;							// New connections per second, 0 for as fast as allowed.
+	char *inventory;						// The inventory file to add what was found to.
+};
+
+
+/*
+ * Parses an address range, a.b.c.d, a.b.c.d/bits or a.b.c.d-e.f.g.h.
+ * The network and broadcast addresses of a prefix are left out.
+ *
+ * uint32_t * first	- Set to the first address in host byte order.
+ * uint32_t * last	- Set to the last address in host byte order.
+ *
+ * returns -1 if the text is not a range, otherwise 0.
+ */
+int parseRange(char * spec, uint32_t * first, uint32_t * last) {
+
+	char text[64];
+	struct in_addr a, b;
+
+	strncpy(text, spec, sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+
+	char *slash = strchr(text, '/');
+	char *dash = strchr(text, '-');
+
+	if (slash) {
+		*slash = '\0';
+		char *end;
+		long bits = strtol(slash + 1, &end, 10);
+		if (*end != '\0' || bits < 0 || bits > 32 || inet_pton(AF_INET, text, &a) != 1) {
+			return -1;
+		}
+		uint32_t mask = bits == 0 ? 0 : 0xFFFFFFFFu << (32 - bits);
+		*first = ntohl(a.s_addr) & mask;
+		*last = *first | ~mask;
+		if (bits <= 30) {
+			(*first)++;
+			(*last)--;
+		}
+	} else if (dash) {
+		*dash = '\0';
+		if (inet_pton(AF_INET, text, &a) != 1 || inet_pton(AF_INET, dash + 1, &b) != 1) {
+			return -1;
+		}
+		*first = ntohl(a.s_addr);
+		*last = ntohl(b.s_addr);
+	} else {
+		if (inet_pton(AF_INET, text, &a) != 1) {
+			return -1;
+		}
+		*first = *last = ntohl(a.s_addr);
+	}
+
+	return *first <= *last ? 0 : -1;
+
+}
+
+
+/*
+ * Closes a probe and frees its slot.
+ */
+void probeClose(struct probe * p, int * active) {
+
+	// Reset rather than linger in TIME_WAIT, a sweep would run out of local ports.
+	struct linger lg = { 1, 0 };
+	setsockopt(p->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(p->fd);
+	p->fd = -1;
+	(*active)--;
+
+}
+
+
+/*
+ * Probes address ranges for modules. Up to opts->parallel non blocking
+ * connects are open at once, started no faster than opts->rate per second.
+ * Anything that accepts is sent GET_INFO and GET_UNLOCK in one write, and it
+ * counts as a module if it answers with exactly four bytes starting with the
+ * ETH008 module ID. Every module found is recorded in the inventory.
+ *
+ * struct sweep_range * ranges		- The addresses to probe.
+ * int range_count					- The number of ranges.
+ * struct discovery_options * opts	- How to sweep.
+ * struct inventory * inv			- The inventory to record modules in.
+ * int * unrecognised				- Set to the number of other things that answered.
+ *
+ * returns the number of modules found.
+ */
+int sweep(struct sweep_range * ranges, int range_count, struct discovery_options * opts, struct inventory * inv,
+		int * unrecognised) {
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct probe *probes = calloc(opts->parallel, sizeof(*probes));
+	int *free_slots = calloc(opts->parallel, sizeof(*free_slots));
+	int free_count = 0;
+	for (int i = opts->parallel - 1; i >= 0; i--) {
+		probes[i].fd = -1;
+		free_slots[free_count++] = i;
+	}
+
+	int found = 0;
+	struct io_stats io;
+	memset(&io, 0, sizeof(io));
+	*unrecognised = 0;
+
+	int range = 0;
+	uint64_t next = range_count > 0 ? ranges[0].first : 0;
+	uint64_t started = 0;
+	int active = 0;
+	uint64_t start = nowNs();
+	uint64_t last_expiry = start;
+	uint8_t frame[2 * CMD_MAX_REQUEST];
+	int frame_len = encodeCommand(frame, GET_INFO, NULL, 0);
+	frame_len += encodeCommand(frame + frame_len, GET_UNLOCK, NULL, 0);
+	int answer_len = command_table[GET_INFO].response_len + command_table[GET_UNLOCK].response_len;
+
+	while (range < range_count || active > 0) {
+
+		uint64_t now = nowNs();
+
+		// Start as many probes as the slots and the rate allow.
+		while (range < range_count && free_count > 0
+				&& (opts->rate <= 0 || started < (uint64_t) (opts->rate * (now - start) / 1e9) + 1)) {
+
+			struct probe *p = &probes[free_slots[--free_count]];
+			p->addr = htonl((uint32_t) next);
+			p->port = ranges[range].port;
+			p->connected = 0;
+			p->got = 0;
+			p->deadline = now + (uint64_t) RTO_INITIAL_MS * 1000000ull;
+			started++;
+			if (next++ == ranges[range].last) {
+				if (++range < range_count) {
+					next = ranges[range].first;
+				}
+			}
+
+			p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+			if (p->fd < 0) {
+				perror("sweep - ");
+				free_slots[free_count++] = p - probes;
+				break;
+			}
+			active++;
+
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = p->addr;
+			addr.sin_port = htons(p->port);
+
+			io.connects++;
+			if (connect(p->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+				probeClose(p, &active);
+				free_slots[free_count++] = p - probes;
+				continue;
+			}
+
+			struct epoll_event ev;
+			ev.events = EPOLLOUT;
+			ev.data.ptr = p;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->fd, &ev);
+
+		}
+
+		struct epoll_event events[EPOLL_BATCH];
+		int n = epoll_wait(epoll_fd, events, EPOLL_BATCH, 10);
+		io.polls++;
+
+		for (int i = 0; i < n; i++) {
+
+			struct probe *p = events[i].data.ptr;
+			if (p->fd < 0) {
+				continue;
+			}
+
+			if (!p->connected) {
+
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+					probeClose(p, &active);
+					free_slots[free_count++] = p - probes;
+					continue;
+				}
+
+				p->connected = 1;
+				io.writes++;
+				if (write(p->fd, frame, frame_len) != frame_len) {
+					probeClose(p, &active);
+					free_slots[free_count++] = p - probes;
+					continue;
+				}
+				io.bytes_written += frame_len;
+				io.frames += 2;
+
+				struct epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = p;
+				epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->fd, &ev);
+				continue;
+
+			}
+
+			// Read one byte more than the answers take to catch anything else that talks.
+			ssize_t rd = read(p->fd, p->info + p->got, answer_len + 1 - p->got);
+			io.reads++;
+			if (rd < 0 && errno == EAGAIN) {
+				io.eagain++;
+				continue;
+			}
+			if (rd > 0) {
+				io.bytes_read += rd;
+				p->got += rd;
+				if (p->got < answer_len) {
+					continue;
+				}
+			}
+
+			if (p->got == answer_len && p->info[0] == ETH008_MODULE_ID) {
+				struct inventory_entry e;
+				memset(&e, 0, sizeof(e));
+				e.addr = p->addr;
+				e.port = p->port;
+				arpLookup(p->addr, e.mac);
+				memcpy(e.info, p->info, sizeof(e.info));
+				e.password = p->info[3] != UNLOCK_NO_PASSWORD;
+				e.seen = time(NULL);
+				inventoryUpdate(inv, &e);
+				found++;
+			} else if (p->got > 0) {
+				(*unrecognised)++;
+			}
+			probeClose(p, &active);
+			free_slots[free_count++] = p - probes;
+
+		}
+
+		// Give up on probes that have not answered in time.
+		now = nowNs();
+		if (now - last_expiry >= 10000000ull) {
+			last_expiry = now;
+			for (int i = 0; i < opts->parallel; i++) {
+				if (probes[i].fd >= 0 && probes[i].deadline <= now) {
+					io.timeouts++;
+					probeClose(&probes[i], &active);
+					free_slots[free_count++] = i;
+				}
+			}
+		}
+
+	}
+
+	io.operations = started;
+	if (show_stats) {
+		printIoStatsHeader("discovery");
+		printIoStats("total", &io);
+	}
+
+	close(epoll_fd);
+	free(free_slots);
+	free(probes);
+	return found;
+
+}
+
+
+/*
+ * Sweeps address ranges for modules and adds what was found to the inventory.
+ *
+ * char ** specs					- The address ranges to sweep.
+ * int spec_count					- The number of ranges.
+ * struct discovery_options * opts	- How to sweep.
+ *
+ * returns -1 on failure, otherwise the number of modules found.
+ */
+int runDiscovery(char ** specs, int spec_count, struct discovery_options * opts) {
+
+	struct sweep_range *ranges = calloc(spec_count, sizeof(*ranges));
+	uint64_t total = 0;
+
+	for (int r = 0; r < spec_count; r++) {
+		if (parseRange(specs[r], &ranges[r].first, &ranges[r].last) < 0) {
+			printf("Invalid address range %s\n", specs[r]);
+			free(ranges);
+			return -1;
+		}
+		ranges[r].port = opts->port;
+		total += (uint64_t) ranges[r].last - ranges[r].first + 1;
+	}
+
+	uint64_t start = nowNs();
+	int unrecognised;
+	int found = sweep(ranges, spec_count, opts, &inventory, &unrecognised);
+	double elapsed = (nowNs() - start) / 1e9;
+
+	int saved = inventorySave(opts->inventory, &inventory);
+	printf("Swept %llu addresses in %.2f s (%.0f/s): %d modules, %d unrecognised, inventory of %d in %s\n",
+			(unsigned long long) total, elapsed, elapsed > 0 ? total / elapsed : 0, found, unrecognised,
+			inventory.count, opts->inventory);
+
+	free(ranges);
+	return saved < 0 ? -1 : found;
+
+}
+
+
+/*
+ * Probes again every inventory entry older than the TTL, so a periodic run
+ * keeps the inventory fresh without sweeping whole ranges.
+ *
+ * struct discovery_options * opts	- How to probe.
+ *
+ * returns -1 on failure, otherwise the number of entries that answered.
+ */
+int runRefresh(struct discovery_options * opts) {
+
+	struct sweep_range *ranges = calloc(inventory.count + 1, sizeof(*ranges));
+	int count = 0;
+	time_t now = time(NULL);
+
+	for (int i = 0; i < inventory.count; i++) {
+		if (now - inventory.entries[i].seen > inventory.ttl) {
+			ranges[count].first = ranges[count].last = ntohl(inventory.entries[i].addr);
+			ranges[count].port = inventory.entries[i].port;
+			count++;
+		}
+	}
+
+	int unrecognised;
+	int found = sweep(ranges, count, opts, &inventory, &unrecognised);
+	int saved = inventorySave(opts->inventory, &inventory);
+
+	printf("Refreshed %d of %d entries older than %d s: %d answered, inventory in %s\n", count, inventory.count,
+			inventory.ttl, found, opts->inventory);
+
+	free(ranges);
+	return saved < 0 ? -1 : found;
+
+}
+
+
+/*
+ * Gateway limits.
+ */
+#define HTTP_BUFFER				4096	// Bytes of requests and responses buffered per client.
+#define HTTP_MAX_CLIENTS		16384	// Clients connected at once.
+
+/*
+ * One HTTP client connection of the gateway.
+ */
+struct http_client {
+	int fd;
+	char in[HTTP_BUFFER];
+	int in_len;
+	char out[HTTP_BUFFER];
+	int out_len;
+	int out_sent;
+	int waiting;							// A module command is outstanding for the current request.
+	int closing;							// Close once the response has been written.
+	int gone;								// The peer went away while a command was outstanding.
+	int relay;								// The relay a GET of one relay asked for, 0 for all.
+	int keep_alive;							// The current request allows the connection to stay open.
+};
+
+/*
+ * An HTTP/1.1 gateway onto the modules of an engine. One thread runs every
+ * client on one epoll loop, and module commands complete through a reply
+ * ring whose eventfd is part of the same loop.
+ */
+struct gateway {
+	struct engine *engine;
+	struct module_config *configs;
+	int count;
+	int listen_fd;
+	int epoll_fd;
+	struct command_pool pool;
+	struct ring reply;
+	struct wal_batch held;					// Commands waiting on the log.
+	int clients;
+	uint64_t requests;
+	int stop;
+};
+
+
+/*
+ * Queues a complete response on a client.
+ *
+ * int status			- The HTTP status code.
+ * const char * reason	- The reason phrase.
+ * const char * body	- The JSON body.
+ */
+void httpRespond(struct http_client * c, int status, const char * reason, const char * body) {
+
+	int len = strlen(body);
+	int n = snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+			"HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n%s\r\n%s",
+			status, reason, len, c->keep_alive ? "" : "Connection: close\r\n", body);
+
+	if (n < 0 || n >= (int) sizeof(c->out) - c->out_len) {
+		c->closing = 1; // The client is not reading its responses.
+		return;
+	}
+	c->out_len += n;
+	if (!c->keep_alive) {
+		c->closing = 1;
+	}
+
+}
+
+
+/*
+ * Writes what a client has waiting, watching for writability if the socket is full.
+ *
+ * returns -1 if the client should be closed, otherwise 0.
+ */
+int httpFlush(struct gateway * g, struct http_client * c) {
+
+	while (c->out_sent < c->out_len) {
+		ssize_t written = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+		if (written < 0) {
+			if (errno == EAGAIN) {
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.ptr = c;
+				epoll_ctl(g->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+				return 0;
+			}
+			return errno == EINTR ? 0 : -1;
+		}
+		c->out_sent += written;
+	}
+
+	if (c->out_len > 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(g->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	c->out_len = c->out_sent = 0;
+	return c->closing ? -1 : 0;
+
+}
+
+
+/*
+ * Closes a client. One with a command outstanding is only forgotten once
+ * the command comes back.
+ */
+void httpClose(struct gateway * g, struct http_client * c) {
+
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+		g->clients--;
+	}
+
+	if (c->waiting) {
+		c->gone = 1;
+	} else {
+		free(c);
+	}
+
+}
+
+
+/*
+ * Sends a module command for the current request of a client, or answers
+ * 503 if every command is in use.
+ */
+void httpSubmit(struct gateway * g, struct http_client * c, int module, uint8_t op, uint8_t output, uint8_t pulse,
+		int toggle, int priority) {
+
+	// Closed clients can still have commands out, so the pool may run dry.
+	struct command *cmd = commandAlloc(&g->pool);
+	if (cmd == NULL) {
+		httpRespond(c, 503, "Service Unavailable", "{\"error\":\"too many commands outstanding\"}\n");
+		return;
+	}
+	if (toggle) {
+		commandPrepareToggle(cmd, module, output);
+	} else {
+		commandPrepare(cmd, module, op, output, pulse);
+	}
+	cmd->priority = priority;
+	cmd->user = c;
+	cmd->reply = &g->reply;
+	c->waiting = 1;
+
+	walSubmit(&g->held, g->engine, cmd);
+
+}
+
+
+/*
+ * Routes one request. Requests that need a module are sent on as commands
+ * and answered when they complete, the rest are answered at once.
+ *
+ *		GET /modules						The modules behind the gateway.
+ *		GET /modules/<n>/info				Module ID, hardware and firmware version.
+ *		GET /modules/<n>/outputs			The states of all eight relays.
+ *		GET /modules/<n>/relays/<r>			The state of one relay.
+ *		PUT /modules/<n>/relays/<r>[?pulse=<t>]	Body on, off or toggle.
+ *
+ * Any request to a module may add priority=bulk, normal or urgent to its
+ * query.
+ */
+void httpRoute(struct gateway * g, struct http_client * c, char * method, char * path, char * body) {
+
+	int module = -1, relay = 0, pulse = 0, consumed = 0, priority = PRIORITY_NORMAL;
+	char what[16] = "";
+
+	char *query = strchr(path, '?');
+	if (query) {
+		*query++ = '\0';
+		char *save;
+		for (char *item = strtok_r(query, "&", &save); item; item = strtok_r(NULL, "&", &save)) {
+			if (strncmp(item, "priority=", 9) == 0) {
+				priority = priorityByName(item + 9);
+			} else {
+				sscanf(item, "pulse=%d", &pulse);
+			}
+		}
+	}
+
+	if (priority < 0) {
+		httpRespond(c, 400, "Bad Request", "{\"error\":\"expected priority bulk, normal or urgent\"}\n");
+		return;
+	}
+
+	if (strcmp(path, "/modules") == 0 || strcmp(path, "/modules/") == 0) {
+
+		if (strcmp(method, "GET") != 0) {
+			httpRespond(c, 405, "Method Not Allowed", "{\"error\":\"method not allowed\"}\n");
+			return;
+		}
+
+		char list[HTTP_BUFFER - 256];
+		int len = snprintf(list, sizeof(list), "[");
+		for (int m = 0; m < g->count && len < (int) sizeof(list) - 64; m++) {
+			len += snprintf(list + len, sizeof(list) - len, "%s{\"module\":%d,\"address\":\"%s\",\"port\":%d}",
+					m ? "," : "", m, inet_ntoa(g->configs[m].addr.sin_addr), ntohs(g->configs[m].addr.sin_port));
+		}
+		snprintf(list + len, sizeof(list) - len, "]\n");
+		httpRespond(c, 200, "OK", list);
+		return;
+
+	}
+
+	if (sscanf(path, "/modules/%d/%15[a-z]%n", &module, what, &consumed) < 2 || module < 0 || module >= g->count) {
+		httpRespond(c, 404, "Not Found", "{\"error\":\"not found\"}\n");
+		return;
+	}
+
+	if (strcmp(what, "relays") == 0 && (sscanf(path + consumed, "/%d", &relay) != 1 || relay < 1 || relay > 8)) {
+		httpRespond(c, 404, "Not Found", "{\"error\":\"no such relay\"}\n");
+		return;
+	}
+
+	if (strcmp(method, "GET") == 0 && strcmp(what, "info") == 0 && path[consumed] == '\0') {
+		httpSubmit(g, c, module, GET_INFO, 0, 0, 0, priority);
+	} else if (strcmp(method, "GET") == 0 && strcmp(what, "outputs") == 0 && path[consumed] == '\0') {
+		c->relay = 0;
+		httpSubmit(g, c, module, GET_DIGITAL_OUTPUTS, 0, 0, 0, priority);
+	} else if (strcmp(method, "GET") == 0 && strcmp(what, "relays") == 0) {
+		c->relay = relay;
+		httpSubmit(g, c, module, GET_DIGITAL_OUTPUTS, 0, 0, 0, priority);
+	} else if (strcmp(method, "PUT") == 0 && strcmp(what, "relays") == 0) {
+		while (*body == ' ' || *body == '"') body++;
+		if (strncmp(body, "on", 2) == 0 && pulse >= 0 && pulse <= 255) {
+			httpSubmit(g, c, module, SET_OUTPUT_ACTIVE, relay, pulse, 0, priority);
+		} else if (strncmp(body, "off", 3) == 0) {
+			httpSubmit(g, c, module, SET_OUTPUT_INACTIVE, relay, 0, 0, priority);
+		} else if (strncmp(body, "toggle", 6) == 0) {
+			httpSubmit(g, c, module, 0, relay, 0, 1, priority);
+		} else {
+			httpRespond(c, 400, "Bad Request", "{\"error\":\"expected on, off or toggle\"}\n");
+		}
+	} else if (strcmp(what, "info") == 0 || strcmp(what, "outputs") == 0 || strcmp(what, "relays") == 0) {
+		httpRespond(c, 405, "Method Not Allowed", "{\"error\":\"method not allowed\"}\n");
+	} else {
+		httpRespond(c, 404, "Not Found", "{\"error\":\"not found\"}\n");
+	}
+
+}
+
+
+/*
+ * Parses and routes every complete request a client has sent, stopping at
+ * one that waits on a module so responses go back in order.
+ */
+void httpProcess(struct gateway * g, struct http_client * c) {
+
+	while (!c->waiting && !c->closing) {
+
+		c->in[c->in_len] = '\0';
+		char *end = strstr(c->in, "\r\n\r\n");
+		if (end == NULL) {
+			if (c->in_len >= (int) sizeof(c->in) - 1) {
+				c->keep_alive = 0;
+				httpRespond(c, 431, "Request Header Fields Too Large", "{\"error\":\"request too large\"}\n");
+			}
+			return;
+		}
+
+		char method[8], path[256], version[16];
+		if (sscanf(c->in, "%7s %255s %15s", method, path, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0) {
+			c->keep_alive = 0;
+			httpRespond(c, 400, "Bad Request", "{\"error\":\"bad request\"}\n");
+			return;
+		}
+
+		// HTTP/1.1 keeps the connection open unless asked not to, HTTP/1.0 only if asked to.
+		int content_length = 0;
+		c->keep_alive = strcmp(version, "HTTP/1.1") == 0;
+		for (char *h = strstr(c->in, "\r\n") + 2; h < end; h = strstr(h, "\r\n") + 2) {
+			if (strncasecmp(h, "Content-Length:", 15) == 0) {
+				content_length = atoi(h + 15);
+			} else if (strncasecmp(h, "Connection:", 11) == 0) {
+				char *v = h + 11;
+				while (*v == ' ') v++;
+				if (strncasecmp(v, "close", 5) == 0) c->keep_alive = 0;
+				if (strncasecmp(v, "keep-alive", 10) == 0) c->keep_alive = 1;
+			}
+		}
+
+		int header_len = end + 4 - c->in;
+		if (content_length < 0 || header_len + content_length >= (int) sizeof(c->in)) {
+			c->keep_alive = 0;
+			httpRespond(c, 413, "Payload Too Large", "{\"error\":\"request too large\"}\n");
+			return;
+		}
+		if (c->in_len < header_len + content_length) {
+			return; // The body is still coming.
+		}
+
+		// Take the body out as a string, then the request out of the buffer.
+		char body[HTTP_BUFFER];
+		memcpy(body, c->in + header_len, content_length);
+		body[content_length] = '\0';
+		int request_len = header_len + content_length;
+		memmove(c->in, c->in + request_len, c->in_len - request_len);
+		c->in_len -= request_len;
+
+		g->requests++;
+		httpRoute(g, c, method, path, body);
+
+	}
+
+}
+
+
+/*
+ * Answers the request a completed module command was sent for.
+ */
+void httpComplete(struct gateway * g, struct command * cmd) {
+
+	struct http_client *c = cmd->user;
+	c->waiting = 0;
+
+	if (c->gone) {
+		free(c);
+		return;
+	}
+
+	char body[256];
+	uint8_t op = cmd->request[0];
+
+	if (cmd->status == STATUS_TIMEOUT) {
+		httpRespond(c, 504, "Gateway Timeout", "{\"error\":\"module timed out\"}\n");
+	} else if (cmd->status == STATUS_REJECTED) {
+		httpRespond(c, 502, "Bad Gateway", "{\"error\":\"module rejected the command\"}\n");
+	} else if (cmd->status != STATUS_OK) {
+		httpRespond(c, 502, "Bad Gateway", cmd->status == STATUS_LOCKED ? "{\"error\":\"module is locked\"}\n"
+				: "{\"error\":\"module unreachable\"}\n");
+	} else if (op == GET_INFO) {
+		snprintf(body, sizeof(body), "{\"id\":%d,\"hardware\":%d,\"firmware\":%d}\n", cmd->response[0],
+				cmd->response[1], cmd->response[2]);
+		httpRespond(c, 200, "OK", body);
+	} else if (op == GET_DIGITAL_OUTPUTS && c->relay) {
+		snprintf(body, sizeof(body), "{\"relay\":%d,\"state\":\"%s\"}\n", c->relay,
+				(cmd->response[0] & (0x01 << (c->relay - 1))) ? "on" : "off");
+		httpRespond(c, 200, "OK", body);
+	} else if (op == GET_DIGITAL_OUTPUTS) {
+		int len = snprintf(body, sizeof(body), "{\"outputs\":%d,\"relays\":[", cmd->response[0]);
+		for (int r = 0; r < 8; r++) {
+			len += snprintf(body + len, sizeof(body) - len, "%s\"%s\"", r ? "," : "",
+					(cmd->response[0] & (0x01 << r)) ? "on" : "off");
+		}
+		snprintf(body + len, sizeof(body) - len, "]}\n");
+		httpRespond(c, 200, "OK", body);
+	} else {
+		snprintf(body, sizeof(body), "{\"relay\":%d,\"state\":\"%s\"}\n", cmd->request[1],
+				op == SET_OUTPUT_ACTIVE ? (cmd->request[2] ? "pulsed" : "on") : "off");
+		httpRespond(c, 200, "OK", body);
+	}
+
+	// Requests pipelined behind this one can go now.
+	httpProcess(g, c);
+	if (httpFlush(g, c) < 0) {
+		httpClose(g, c);
+	}
+
+}
+
+
+/*
+ * Runs the gateway event loop until g->stop is set.
+ */
+void * gatewayRun(void * arg) {
+
+	struct gateway *g = arg;
+	struct epoll_event events[EPOLL_BATCH];
+
+	while (!__atomic_load_n(&g->stop, __ATOMIC_RELAXED)) {
+
+		struct command *cmd;
+		while ((cmd = ringPop(&g->reply)) != NULL) {
+			httpComplete(g, cmd);
+			commandRelease(&g->pool, cmd);
+		}
+
+		// Everything the last pass changed is logged with one commit.
+		walRelease(&g->held, g->engine);
+
+		int n = epoll_wait(g->epoll_fd, events, EPOLL_BATCH, ringArm(&g->reply) ? 0 : 100);
+
+		for (int i = 0; i < n; i++) {
+
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &g->reply) {
+				ringAck(&g->reply);
+				continue;
+			}
+
+			if (ptr == g) {
+				// Accept everyone waiting.
+				int fd;
+				while ((fd = accept4(g->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					if (g->clients >= HTTP_MAX_CLIENTS) {
+						close(fd);
+						continue;
+					}
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					struct http_client *c = calloc(1, sizeof(*c));
+					c->fd = fd;
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = c;
+					epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+					g->clients++;
+				}
+				continue;
+			}
+
+			struct http_client *c = ptr;
+
+			if (events[i].events & EPOLLOUT) {
+				if (httpFlush(g, c) < 0) {
+					httpClose(g, c);
+					continue;
+				}
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				// Requests pipelined behind one waiting on a module can fill the buffer.
+				// Stop reading until the answer makes room, rather than taking the
+				// empty read for the end of the connection.
+				if (c->in_len == (int) sizeof(c->in) - 1) {
+					if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+						httpClose(g, c);
+						continue;
+					}
+					struct epoll_event ev;
+					ev.events = c->out_sent < c->out_len ? EPOLLOUT : 0;
+					ev.data.ptr = c;
+					epoll_ctl(g->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+					continue;
+				}
+				ssize_t rd = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+				if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR)) {
+					httpClose(g, c);
+					continue;
+				}
+				if (rd > 0) {
+					c->in_len += rd;
+				}
+				httpProcess(g, c);
+				if (httpFlush(g, c) < 0) {
+					httpClose(g, c);
+				}
+			}
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+
+/*
+ * Sets up a gateway listening on the given port in front of a running engine.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int gatewayInit(struct gateway * g, struct engine * e, struct module_config * configs, int count, int http_port) {
+
+	memset(g, 0, sizeof(*g));
+	g->engine = e;
+	g->configs = configs;
+	g->count = count;
+
+	g->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	int one = 1;
+	setsockopt(g->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(http_port);
+
+	if (g->listen_fd < 0 || bind(g->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(g->listen_fd, 4096) < 0) {
+		perror("gatewayInit - ");
+		return -1;
+	}
+
+	// Each client has at most one command outstanding.
+	if (commandPoolInit(&g->pool, HTTP_MAX_CLIENTS) < 0 || ringInit(&g->reply, HTTP_MAX_CLIENTS, NULL) < 0) {
+		return -1;
+	}
+
+	g->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = g;
+	epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, g->listen_fd, &ev);
+	ev.data.ptr = &g->reply;
+	epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, g->reply.fd, &ev);
+
+	return 0;
+
+}
+
+
+/*
+ * One keep-alive connection of the gateway benchmark.
+ */
+struct http_bench_conn {
+	int fd;
+	char in[HTTP_BUFFER];
+	int in_len;
+	int module;								// The module the next request asks about.
+};
+
+
+/*
+ * Drives a gateway with keep-alive clients, each sending GET requests
+ * for module outputs back to back, and reports the requests per second.
+ *
+ * int http_port	- The port the gateway listens on.
+ * int clients		- The number of client connections.
+ * int modules		- The number of modules to spread requests over.
+ * int seconds		- How long to run for.
+ */
+void httpBench(int http_port, int clients, int modules, int seconds) {
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct http_bench_conn *conns = calloc(clients, sizeof(*conns));
+	uint64_t responses = 0, errors = 0;
+	char request[128];
+
+	for (int i = 0; i < clients; i++) {
+		conns[i].fd = openSocket("127.0.0.1", http_port);
+		if (conns[i].fd < 0) {
+			exit(EXIT_FAILURE);
+		}
+		int one = 1;
+		setsockopt(conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conns[i];
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+		conns[i].module = i % modules;
+		int len = snprintf(request, sizeof(request), "GET /modules/%d/outputs HTTP/1.1\r\nHost: bench\r\n\r\n",
+				conns[i].module);
+		if (write(conns[i].fd, request, len) != len) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint64_t start = nowNs();
+	uint64_t end = start + (uint64_t) seconds * 1000000000ull;
+	struct epoll_event events[EPOLL_BATCH];
+
+	while (nowNs() < end) {
+
+		int n = epoll_wait(epoll_fd, events, EPOLL_BATCH, 100);
+
+		for (int i = 0; i < n; i++) {
+
+			struct http_bench_conn *c = events[i].data.ptr;
+			ssize_t rd = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+			if (rd <= 0) {
+				printf("httpBench - the gateway closed a connection\n");
+				exit(EXIT_FAILURE);
+			}
+			c->in_len += rd;
+			c->in[c->in_len] = '\0';
+
+			// Every complete response is answered with the next request.
+			char *head_end;
+			while ((head_end = strstr(c->in, "\r\n\r\n")) != NULL) {
+				char *cl = strstr(c->in, "Content-Length:");
+				int body = cl && cl < head_end ? atoi(cl + 15) : 0;
+				int total = head_end + 4 - c->in + body;
+				if (c->in_len < total) {
+					break;
+				}
+				if (strncmp(c->in, "HTTP/1.1 200", 12) == 0) {
+					responses++;
+				} else {
+					errors++;
+				}
+				memmove(c->in, c->in + total, c->in_len - total);
+				c->in_len -= total;
+				c->in[c->in_len] = '\0';
+
+				c->module = (c->module + 1) % modules;
+				int len = snprintf(request, sizeof(request), "GET /modules/%d/outputs HTTP/1.1\r\nHost: bench\r\n\r\n",
+						c->module);
+				if (write(c->fd, request, len) != len) {
+					exit(EXIT_FAILURE);
+				}
+			}
+
+		}
+
+	}
+
+	double elapsed = (nowNs() - start) / 1e9;
+	printf("%d keep-alive clients over %d modules for %d s: %.0f requests/s, %llu errors\n", clients, modules, seconds,
+			responses / elapsed, (unsigned long long) errors);
+
+	for (int i = 0; i < clients; i++) {
+		close(conns[i].fd);
+	}
+	free(conns);
+	close(epoll_fd);
+
+}
+
+
+/*
+ * Serves the HTTP gateway on the given port in front of the modules, or
+ * benchmarks it with the given number of clients.
+ *
+ * struct module_config * configs	- The modules.
+ * int count						- The number of modules.
+ * int http_port					- The port to listen on.
+ * int threads						- The number of engine threads.
+ * int bench_clients				- Benchmark with this many clients for seconds, 0 to serve.
+ * int seconds						- How long to benchmark for.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int runGateway(struct module_config * configs, int count, int http_port, int threads, int bench_clients, int seconds) {
+
+	struct engine *e = engineCreate(configs, count, threads, 1);
+	e->depth = 8;
+	engineStart(e);
+
+	struct gateway g;
+	if (gatewayInit(&g, e, configs, count, http_port) < 0) {
+		engineStop(e);
+		engineDestroy(e);
+		return -1;
+	}
+
+	if (bench_clients == 0) {
+		printf("Serving %d modules on http://0.0.0.0:%d/modules\n", count, http_port);
+		fflush(stdout);
+		gatewayRun(&g);
+	} else {
+		pthread_t thread;
+		pthread_create(&thread, NULL, gatewayRun, &g);
+		httpBench(http_port, bench_clients, count, seconds);
+		__atomic_store_n(&g.stop, 1, __ATOMIC_RELAXED);
+		pthread_join(thread, NULL);
+	}
+
+	engineStop(e);
+	if (show_stats) {
+		printEngineStats(e);
+	}
+	engineDestroy(e);
+	close(g.epoll_fd);
+	close(g.listen_fd);
+	return 0;
+
+}
+
+
+/*
+ * MQTT 3.1.1 packet types, already shifted into the top of the first byte.
+ */
+#define MQTT_CONNECT			0x10
+#define MQTT_CONNACK			0x20
+#define MQTT_PUBLISH			0x30
+#define MQTT_SUBSCRIBE			0x82	// Carries the reserved flag bits the specification requires.
+#define MQTT_SUBACK				0x90
+#define MQTT_PINGREQ			0xC0
+#define MQTT_PINGRESP			0xD0
+#define MQTT_RETAIN				0x01
+
+#define MQTT_KEEP_ALIVE_S		60
+#define MQTT_BUFFER				65536	// Bytes of incoming packets buffered.
+
+/*
+ * A growable buffer of outgoing bytes.
+ */
+struct byte_buffer {
+	uint8_t *data;
+	size_t len;
+	size_t sent;
+	size_t cap;
+};
+
+/*
+ * Options for the MQTT bridge.
+ */
+struct mqtt_options {
+	char *broker;							// Address of the broker.
+	int broker_port;
+	char *prefix;							// First level of every topic.
+	int interval_ms;						// Time between polls of every module.
+};
+
+/*
+ * What the bridge last published for a module.
+ */
+struct bridge_module {
+	uint8_t outputs;
+	int known;								// outputs has been published since the broker connected.
+	int polling;							// A poll is outstanding.
+};
+
+/*
+ * The bridge between the modules of an engine and an MQTT broker.
+ */
+struct bridge {
+	struct engine *engine;
+	struct module_config *configs;
+	struct bridge_module *mods;
+	int count;
+	struct mqtt_options *opts;
+	struct command_pool pool;
+	struct ring reply;
+	struct wal_batch held;					// Commands waiting on the log.
+	int fd;									// Connection to the broker, -1 while there is none.
+	int connected;							// The connect on fd has finished.
+	int epoll_fd;
+	uint8_t in[MQTT_BUFFER];
+	size_t in_len;
+	struct byte_buffer out;
+	uint64_t published;
+	uint64_t commands;
+	uint64_t last_packet;					// When anything was last sent to the broker.
+};
+
+
+/*
+ * Appends bytes to a buffer.
+ */
+void bufferAppend(struct byte_buffer * b, const void * data, size_t len) {
+
+	if (b->len + len > b->cap) {
+		while (b->len + len > b->cap) {
+			b->cap = b->cap ? b->cap * 2 : 4096;
+		}
+		b->data = realloc(b->data, b->cap);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+}
+
+
+/*
+ * Appends an MQTT fixed header with its variable length remaining length.
+ */
+void mqttHeader(struct byte_buffer * b, uint8_t type, size_t remaining) {
+
+	uint8_t header[5];
+	int n = 0;
+
+	header[n++] = type;
+	do {
+		uint8_t digit = remaining % 128;
+		remaining /= 128;
+		header[n++] = digit | (remaining > 0 ? 0x80 : 0x00);
+	} while (remaining > 0);
+
+	bufferAppend(b, header, n);
+
+}
+
+
+/*
+ * Appends an MQTT length prefixed string.
+ */
+void mqttString(struct byte_buffer * b, const char * s) {
+
+	size_t len = strlen(s);
+	uint8_t prefix[2] = { len >> 8, len & 0xFF };
+	bufferAppend(b, prefix, 2);
+	bufferAppend(b, s, len);
+
+}
+
+
+/*
+ * Appends a QoS 0 PUBLISH to the outgoing buffer.
+ */
+void mqttPublish(struct bridge * br, const char * topic, const char * payload, int retain) {
+
+	mqttHeader(&br->out, MQTT_PUBLISH | (retain ? MQTT_RETAIN : 0), 2 + strlen(topic) + strlen(payload));
+	mqttString(&br->out, topic);
+	bufferAppend(&br->out, payload, strlen(payload));
+	br->published++;
+
+}
+
+
+/*
+ * Writes as much of the outgoing buffer as the broker socket takes.
+ *
+ * returns -1 if the connection failed, otherwise 0.
+ */
+int bridgeFlush(struct bridge * br) {
+
+	while (br->out.sent < br->out.len) {
+		ssize_t written = write(br->fd, br->out.data + br->out.sent, br->out.len - br->out.sent);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				return -1;
+			}
+			break;
+		}
+		br->out.sent += written;
+		br->last_packet = nowNs();
+	}
+
+	// Watch for room only while something is left over.
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (br->out.sent < br->out.len ? EPOLLOUT : 0);
+	ev.data.ptr = br;
+	epoll_ctl(br->epoll_fd, EPOLL_CTL_MOD, br->fd, &ev);
+
+	if (br->out.sent == br->out.len) {
+		br->out.len = br->out.sent = 0;
+	}
+	return 0;
+
+}
+
+
+/*
+ * Publishes the relays of a module that differ from what was last
+ * published, as retained messages on <prefix>/<address>:<port>/relay/<r>.
+ */
+void bridgePublish(struct bridge * br, int m, uint8_t outputs) {
+
+	struct bridge_module *bm = &br->mods[m];
+	uint8_t changed = bm->known ? bm->outputs ^ outputs : 0xFF;
+
+	if (changed == 0 || br->fd < 0) {
+		return;
+	}
+
+	char topic[128];
+	for (int r = 0; r < 8; r++) {
+		if (changed & (0x01 << r)) {
+			snprintf(topic, sizeof(topic), "%s/%s:%d/relay/%d", br->opts->prefix,
+					inet_ntoa(br->configs[m].addr.sin_addr), ntohs(br->configs[m].addr.sin_port), r + 1);
+			mqttPublish(br, topic, (outputs & (0x01 << r)) ? "on" : "off", 1);
+		}
+	}
+
+	bm->outputs = outputs;
+	bm->known = 1;
+
+}
+
+
+/*
+ * Starts connecting to the broker and queues the subscription to the
+ * command topics <prefix>/+/relay/+/set, which goes out once the connect
+ * finishes. Every module is published in full again once it has been
+ * polled, as a new session may have lost retained states.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int bridgeConnect(struct bridge * br) {
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd < 0) {
+		perror("bridgeConnect - ");
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(br->opts->broker);
+	addr.sin_port = htons(br->opts->broker_port);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	// Writable once the connect has finished, one way or the other.
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = br;
+	epoll_ctl(br->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	br->fd = fd;
+	br->connected = 0;
+
+	br->in_len = 0;
+	br->out.len = br->out.sent = 0;
+	for (int m = 0; m < br->count; m++) {
+		br->mods[m].known = 0;
+	}
+
+	char client_id[32];
+	snprintf(client_id, sizeof(client_id), "eth008-%d", (int) getpid());
+
+	// CONNECT with a clean session and no credentials.
+	uint8_t variable[10] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, MQTT_KEEP_ALIVE_S >> 8, MQTT_KEEP_ALIVE_S & 0xFF };
+	mqttHeader(&br->out, MQTT_CONNECT, sizeof(variable) + 2 + strlen(client_id));
+	bufferAppend(&br->out, variable, sizeof(variable));
+	mqttString(&br->out, client_id);
+
+	char filter[128];
+	snprintf(filter, sizeof(filter), "%s/+/relay/+/set", br->opts->prefix);
+	uint8_t packet_id[2] = { 0, 1 };
+	uint8_t qos = 0;
+	mqttHeader(&br->out, MQTT_SUBSCRIBE, 2 + 2 + strlen(filter) + 1);
+	bufferAppend(&br->out, packet_id, 2);
+	mqttString(&br->out, filter);
+	bufferAppend(&br->out, &qos, 1);
+
+	return 0;
+
+}
+
+
+/*
+ * Drops the connection to the broker.
+ */
+void bridgeDisconnect(struct bridge * br) {
+
+	if (br->fd >= 0) {
+		printf(br->connected ? "Lost the connection to the broker, reconnecting\n"
+				: "Unable to connect to the broker, retrying\n");
+		close(br->fd);
+		br->fd = -1;
+		br->connected = 0;
+	}
+
+}
+
+
+/*
+ * Turns a message on a command topic into a SET command. The payload is
+ * on, off or toggle.
+ */
+void bridgeCommand(struct bridge * br, const char * topic, size_t topic_len, const char * payload, size_t payload_len) {
+
+	char name[256], address[64], command[16];
+	int port, relay, consumed = 0;
+	size_t prefix_len = strlen(br->opts->prefix);
+
+	if (topic_len >= sizeof(name) || topic_len <= prefix_len + 1 || strncmp(topic, br->opts->prefix, prefix_len) != 0) {
+		return;
+	}
+	memcpy(name, topic + prefix_len, topic_len - prefix_len);
+	name[topic_len - prefix_len] = '\0';
+
+	if (sscanf(name, "/%63[^:/]:%d/relay/%d/set%n", address, &port, &relay, &consumed) != 3 || name[consumed] != '\0'
+			|| relay < 1 || relay > 8) {
+		return;
+	}
+
+	struct in_addr a;
+	if (inet_pton(AF_INET, address, &a) != 1) {
+		return;
+	}
+
+	int m;
+	for (m = 0; m < br->count; m++) {
+		if (br->configs[m].addr.sin_addr.s_addr == a.s_addr && ntohs(br->configs[m].addr.sin_port) == port) {
+			break;
+		}
+	}
+
+	snprintf(command, sizeof(command), "%.*s", (int) (payload_len < sizeof(command) ? payload_len : sizeof(command) - 1), payload);
+	struct command *cmd = m < br->count ? commandAlloc(&br->pool) : NULL;
+	if (cmd == NULL) {
+		return; // Not one of ours, or too many commands outstanding.
+	}
+
+	if (strcmp(command, "on") == 0) {
+		commandPrepare(cmd, m, SET_OUTPUT_ACTIVE, relay, 0);
+	} else if (strcmp(command, "off") == 0) {
+		commandPrepare(cmd, m, SET_OUTPUT_INACTIVE, relay, 0);
+	} else if (strcmp(command, "toggle") == 0) {
+		commandPrepareToggle(cmd, m, relay);
+	} else {
+		commandRelease(&br->pool, cmd);
+		return;
+	}
+
+	cmd->reply = &br->reply;
+	br->commands++;
+	walSubmit(&br->held, br->engine, cmd);
+
+}
+
+
+/*
+ * Handles every complete packet from the broker.
+ *
+ * returns -1 if the broker refused the connection, otherwise 0.
+ */
+int bridgeRead(struct bridge * br) {
+
+	size_t pos = 0;
+
+	while (br->in_len - pos >= 2) {
+
+		// Decode the remaining length, which may not have fully arrived.
+		size_t remaining = 0, header = 1;
+		int multiplier = 1, complete = 0;
+		while (header < 5 && pos + header < br->in_len) {
+			uint8_t digit = br->in[pos + header++];
+			remaining += (digit & 0x7F) * multiplier;
+			multiplier *= 128;
+			if ((digit & 0x80) == 0) {
+				complete = 1;
+				break;
+			}
+		}
+		if (!complete || br->in_len - pos < header + remaining) {
+			break;
+		}
+
+		uint8_t type = br->in[pos] & 0xF0;
+		uint8_t *body = br->in + pos + header;
+
+		if (type == MQTT_CONNACK && remaining >= 2 && body[1] != 0) {
+			printf("The broker refused the connection (%d)\n", body[1]);
+			return -1;
+		} else if (type == MQTT_PUBLISH && remaining >= 2) {
+			size_t topic_len = (body[0] << 8) | body[1];
+			size_t skip = 2 + topic_len + ((br->in[pos] & 0x06) ? 2 : 0); // A packet id follows with QoS > 0.
+			if (skip <= remaining) {
+				bridgeCommand(br, (char *) body + 2, topic_len, (char *) body + skip, remaining - skip);
+			}
+		}
+
+		pos += header + remaining;
+
+	}
+
+	memmove(br->in, br->in + pos, br->in_len - pos);
+	br->in_len -= pos;
+	return 0;
+
+}
+
+
+/*
+ * Bridges the modules to an MQTT broker. Every interval each module's
+ * outputs are read, and only the relays that changed are published, all
+ * in one write per poll cycle. SET commands arrive on command topics.
+ *
+ * struct module_config * configs	- The modules.
+ * int count						- The number of modules.
+ * int threads						- The number of engine threads.
+ * struct mqtt_options * opts		- The broker and topics.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int runBridge(struct module_config * configs, int count, int threads, struct mqtt_options * opts) {
+
+	struct bridge br;
+	memset(&br, 0, sizeof(br));
+	br.configs = configs;
+	br.count = count;
+	br.opts = opts;
+	br.fd = -1;
+	br.mods = calloc(count, sizeof(*br.mods));
+
+	// A poll per module and room for commands on top.
+	if (commandPoolInit(&br.pool, 2 * count + 1024) < 0 || ringInit(&br.reply, 2 * count + 1024, NULL) < 0) {
+		return -1;
+	}
+
+	br.engine = engineCreate(configs, count, threads, 1);
+	br.engine->depth = 8;
+	engineStart(br.engine);
+
+	br.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &br.reply;
+	epoll_ctl(br.epoll_fd, EPOLL_CTL_ADD, br.reply.fd, &ev);
+
+	uint64_t next_poll = nowNs();
+	uint64_t next_connect = next_poll;
+	uint64_t next_report = next_poll + 10000000000ull;
+	uint64_t published = 0, cycles = 0;
+
+	printf("Bridging %d modules to %s:%d under %s/\n", count, opts->broker, opts->broker_port, opts->prefix);
+	fflush(stdout);
+
+	for (;;) {
+
+		uint64_t now = nowNs();
+
+		if (br.fd < 0 && now >= next_connect) {
+			if (bridgeConnect(&br) < 0) {
+				bridgeDisconnect(&br);
+				next_connect = now + (uint64_t) RECONNECT_MS * 1000000ull;
+			}
+		}
+
+		// Poll every module that is not still answering the last poll.
+		if (now >= next_poll) {
+			for (int m = 0; m < count; m++) {
+				if (!br.mods[m].polling) {
+					struct command *cmd = commandAlloc(&br.pool);
+					commandPrepare(cmd, m, GET_DIGITAL_OUTPUTS, 0, 0);
+					cmd->priority = PRIORITY_BULK;
+					cmd->reply = &br.reply;
+					br.mods[m].polling = 1;
+					while (engineSubmit(br.engine, cmd) < 0) {
+						sched_yield();
+					}
+				}
+			}
+			next_poll += (uint64_t) opts->interval_ms * 1000000ull;
+			if (next_poll < now) {
+				next_poll = now;
+			}
+			cycles++;
+		}
+
+		// Collect answers, publishing what changed in one go.
+		struct command *cmd;
+		while ((cmd = ringPop(&br.reply)) != NULL) {
+			uint8_t op = cmd->request[0];
+			if (op == GET_DIGITAL_OUTPUTS && cmd->toggle == 0) {
+				br.mods[cmd->module].polling = 0;
+			}
+			if (cmd->status == STATUS_OK) {
+				if (op == GET_DIGITAL_OUTPUTS) {
+					bridgePublish(&br, cmd->module, cmd->response[0]);
+				} else if (br.mods[cmd->module].known) {
+					uint8_t bit = 0x01 << (cmd->request[1] - 1);
+					uint8_t outputs = br.mods[cmd->module].outputs;
+					bridgePublish(&br, cmd->module, op == SET_OUTPUT_ACTIVE ? outputs | bit : outputs & ~bit);
+				}
+			}
+			commandRelease(&br.pool, cmd);
+		}
+
+		if (br.connected) {
+			// Keep the session alive when nothing else has been sent for a while.
+			if (now - br.last_packet > (uint64_t) MQTT_KEEP_ALIVE_S * 500000000ull) {
+				mqttHeader(&br.out, MQTT_PINGREQ, 0);
+			}
+			if (br.out.len > br.out.sent && bridgeFlush(&br) < 0) {
+				bridgeDisconnect(&br);
+				next_connect = now + (uint64_t) RECONNECT_MS * 1000000ull;
+			}
+		}
+
+		if (now >= next_report) {
+			printf("%llu poll cycles, %llu relay changes published, %llu commands\n", (unsigned long long) cycles,
+					(unsigned long long) (br.published - published), (unsigned long long) br.commands);
+			fflush(stdout);
+			published = br.published;
+			next_report = now + 10000000000ull;
+		}
+
+		// Sleep until the next poll unless answers are already waiting.
+		now = nowNs();
+		int timeout = next_poll > now ? (int) ((next_poll - now) / 1000000) + 1 : 0;
+		if (ringArm(&br.reply)) {
+			timeout = 0;
+		}
+
+		struct epoll_event events[4];
+		walRelease(&br.held, br.engine);
+		int n = epoll_wait(br.epoll_fd, events, 4, timeout);
+
+		for (int i = 0; i < n; i++) {
+
+			if (events[i].data.ptr == &br.reply) {
+				ringAck(&br.reply);
+				continue;
+			}
+
+			if (br.fd < 0) {
+				continue;
+			}
+
+			// The connect has finished, the queued CONNECT goes out below.
+			if (!br.connected) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(br.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+					bridgeDisconnect(&br);
+					next_connect = nowNs() + (uint64_t) RECONNECT_MS * 1000000ull;
+					continue;
+				}
+				br.connected = 1;
+			}
+
+			if (events[i].events & EPOLLOUT && bridgeFlush(&br) < 0) {
+				bridgeDisconnect(&br);
+				next_connect = nowNs() + (uint64_t) RECONNECT_MS * 1000000ull;
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				ssize_t rd = read(br.fd, br.in + br.in_len, sizeof(br.in) - br.in_len);
+				if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR)) {
+					bridgeDisconnect(&br);
+					next_connect = nowNs() + (uint64_t) RECONNECT_MS * 1000000ull;
+					continue;
+				}
+				if (rd > 0) {
+					br.in_len += rd;
+					if (bridgeRead(&br) < 0) {
+						return -1;
+					}
+					if (br.in_len == sizeof(br.in)) {
+						bridgeDisconnect(&br); // A packet larger than the buffer.
+						next_connect = nowNs() + (uint64_t) RECONNECT_MS * 1000000ull;
+					}
+				}
+			}
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Modbus function and exception codes.
+ */
+#define MODBUS_READ_COILS		0x01
+#define MODBUS_WRITE_COIL		0x05
+#define MODBUS_WRITE_COILS		0x0F
+#define MODBUS_ILLEGAL_FUNCTION	0x01
+#define MODBUS_ILLEGAL_ADDRESS	0x02
+#define MODBUS_ILLEGAL_VALUE	0x03
+#define MODBUS_DEVICE_FAILURE	0x04
+#define MODBUS_TARGET_FAILED	0x0B	// Gateway target device failed to respond.
+
+#define MODBUS_BUFFER			4096	// Bytes of requests and responses buffered per client.
+#define MODBUS_MAX_CLIENTS		1024
+
+/*
+ * One Modbus TCP client connection.
+ */
+struct modbus_client {
+	int fd;
+	uint8_t in[MODBUS_BUFFER];
+	int in_len;
+	uint8_t out[MODBUS_BUFFER];
+	int out_len;
+	int out_sent;
+	int pending;							// SET commands outstanding for the current write.
+	int exception;							// Exception to answer the current write with, 0 for none.
+	uint8_t response[12];					// The answer to the current write once its SETs complete.
+	int response_len;
+	int gone;								// The peer went away while SETs were outstanding.
+};
+
+/*
+ * The cached outputs of one module.
+ */
+struct modbus_module {
+	uint8_t outputs;
+	uint64_t updated;						// When outputs was last known to be right, 0 if never.
+	int polling;							// A poll is outstanding.
+};
+
+/*
+ * A Modbus TCP server onto the modules of an engine. Coil n is relay
+ * n % 8 + 1 of module n / 8. Reads are answered from a cache kept by polling
+ * every module each interval, so clients may poll as often as they like
+ * without adding to the load on the modules.
+ */
+struct modbus_server {
+	struct engine *engine;
+	struct module_config *configs;
+	struct modbus_module *mods;
+	int count;
+	int interval_ms;
+	int listen_fd;
+	int epoll_fd;
+	struct command_pool pool;
+	struct ring reply;
+	struct wal_batch held;					// Commands waiting on the log.
+	int clients;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t sets;							// SET commands sent for writes.
+	uint64_t polls;
+};
+
+
+/*
+ * Queues a response PDU on a client behind an MBAP header copied from the request.
+ *
+ * const uint8_t * request	- The request MBAP header.
+ * const uint8_t * pdu		- The response function code and data.
+ * int len					- The length of the PDU.
+ */
+void modbusRespond(struct modbus_client * c, const uint8_t * request, const uint8_t * pdu, int len) {
+
+	if (c->out_len + 7 + len > (int) sizeof(c->out)) {
+		return; // Only happens if the client stops reading, and it is then closed.
+	}
+
+	uint8_t *p = c->out + c->out_len;
+	p[0] = request[0];
+	p[1] = request[1];
+	p[2] = 0;
+	p[3] = 0;
+	p[4] = (len + 1) >> 8;
+	p[5] = (len + 1) & 0xFF;
+	p[6] = request[6];
+	memcpy(p + 7, pdu, len);
+	c->out_len += 7 + len;
+
+}
+
+
+/*
+ * Queues an exception response.
+ */
+void modbusException(struct modbus_client * c, const uint8_t * request, uint8_t function, uint8_t code) {
+
+	uint8_t pdu[2] = { function | 0x80, code };
+	modbusRespond(c, request, pdu, sizeof(pdu));
+
+}
+
+
+/*
+ * Writes what a client has waiting, watching for writability if the socket is full.
+ *
+ * returns -1 if the client should be closed, otherwise 0.
+ */
+int modbusFlush(struct modbus_server * srv, struct modbus_client * c) {
+
+	while (c->out_sent < c->out_len) {
+		ssize_t written = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+		if (written < 0) {
+			if (errno == EAGAIN) {
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.ptr = c;
+				epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+				return 0;
+			}
+			return errno == EINTR ? 0 : -1;
+		}
+		c->out_sent += written;
+	}
+
+	if (c->out_len > 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	c->out_len = c->out_sent = 0;
+	return 0;
+
+}
+
+
+/*
+ * Closes a client. One with SETs outstanding is only forgotten once they come back.
+ */
+void modbusClose(struct modbus_server * srv, struct modbus_client * c) {
+
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+		srv->clients--;
+	}
+
+	if (c->pending > 0) {
+		c->gone = 1;
+	} else {
+		free(c);
+	}
+
+}
+
+
+/*
+ * Returns non zero if the cached outputs of a module are recent enough to
+ * answer from, allowing a couple of missed polls.
+ */
+int modbusFresh(struct modbus_server * srv, int module) {
+
+	uint64_t updated = srv->mods[module].updated;
+	return updated != 0 && nowNs() - updated <= (uint64_t) srv->interval_ms * 3000000ull;
+
+}
+
+
+/*
+ * Sends the SET that puts one coil in the wanted state, unless the cache
+ * shows it is there already.
+ */
+void modbusSet(struct modbus_server * srv, struct modbus_client * c, int coil, int on) {
+
+	int module = coil / 8;
+	uint8_t bit = 0x01 << (coil % 8);
+
+	if (modbusFresh(srv, module) && ((srv->mods[module].outputs & bit) != 0) == (on != 0)) {
+		return;
+	}
+
+	struct command *cmd = commandAlloc(&srv->pool);
+	if (cmd == NULL) {
+		c->exception = MODBUS_DEVICE_FAILURE;
+		return;
+	}
+	commandPrepare(cmd, module, on ? SET_OUTPUT_ACTIVE : SET_OUTPUT_INACTIVE, coil % 8 + 1, 0);
+	cmd->user = c;
+	cmd->reply = &srv->reply;
+	c->pending++;
+	srv->sets++;
+
+	walSubmit(&srv->held, srv->engine, cmd);
+
+}
+
+
+/*
+ * Handles every complete request a client has sent, stopping at a write
+ * that waits on modules so responses go back in order.
+ *
+ * returns -1 if the client sent something that is not Modbus TCP, otherwise 0.
+ */
+int modbusProcess(struct modbus_server * srv, struct modbus_client * c) {
+
+	int coils = srv->count * 8;
+
+	while (c->pending == 0 && c->in_len >= 8 && c->out_len + 7 + 256 <= (int) sizeof(c->out)) {
+
+		uint8_t *req = c->in;
+		int length = (req[4] << 8) | req[5];
+		if (req[2] != 0 || req[3] != 0 || length < 2 || length > 254) {
+			return -1;
+		}
+		int total = 6 + length;
+		if (c->in_len < total) {
+			return 0;
+		}
+
+		uint8_t function = req[7];
+		uint8_t *data = req + 8;
+		int data_len = length - 2;
+		int start = data_len >= 4 ? (data[0] << 8) | data[1] : 0;
+		int value = data_len >= 4 ? (data[2] << 8) | data[3] : 0;
+
+		if (function == MODBUS_READ_COILS) {
+
+			srv->reads++;
+			if (data_len != 4 || value < 1 || value > 2000) {
+				modbusException(c, req, function, MODBUS_ILLEGAL_VALUE);
+			} else if (start + value > coils) {
+				modbusException(c, req, function, MODBUS_ILLEGAL_ADDRESS);
+			} else {
+				uint8_t pdu[2 + 250];
+				int fresh = 1;
+				memset(pdu, 0, sizeof(pdu));
+				pdu[0] = function;
+				pdu[1] = (value + 7) / 8;
+				for (int i = 0; i < value; i++) {
+					int coil = start + i;
+					fresh &= modbusFresh(srv, coil / 8);
+					if (srv->mods[coil / 8].outputs & (0x01 << (coil % 8))) {
+						pdu[2 + i / 8] |= 0x01 << (i % 8);
+					}
+				}
+				if (fresh) {
+					modbusRespond(c, req, pdu, 2 + pdu[1]);
+				} else {
+					modbusException(c, req, function, MODBUS_TARGET_FAILED);
+				}
+			}
+
+		} else if (function == MODBUS_WRITE_COIL || function == MODBUS_WRITE_COILS) {
+
+			srv->writes++;
+			int count = function == MODBUS_WRITE_COIL ? 1 : value;
+			c->exception = 0;
+			memcpy(c->response, req, 7);
+			c->response[7] = function;
+			memcpy(c->response + 8, data, 4);
+			c->response_len = 12;
+
+			if (data_len < 4 || (function == MODBUS_WRITE_COIL && value != 0xFF00 && value != 0x0000)
+					|| (function == MODBUS_WRITE_COILS && (count < 1 || count > 1968 || data_len < 5
+					|| data[4] != (count + 7) / 8 || data_len != 5 + data[4]))) {
+				modbusException(c, req, function, MODBUS_ILLEGAL_VALUE);
+			} else if (start + count > coils) {
+				modbusException(c, req, function, MODBUS_ILLEGAL_ADDRESS);
+			} else {
+				for (int i = 0; i < count; i++) {
+					int on = function == MODBUS_WRITE_COIL ? value == 0xFF00 : (data[5 + i / 8] >> (i % 8)) & 0x01;
+					modbusSet(srv, c, start + i, on);
+				}
+				// Nothing needed changing, so the write is done already.
+				if (c->pending == 0) {
+					if (c->exception) {
+						modbusException(c, req, function, c->exception);
+					} else {
+						modbusRespond(c, req, c->response + 7, 5);
+					}
+				}
+			}
+
+		} else {
+			modbusException(c, req, function, MODBUS_ILLEGAL_FUNCTION);
+		}
+
+		memmove(c->in, c->in + total, c->in_len - total);
+		c->in_len -= total;
+
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Brings a completed command into the cache, and answers the write it was
+ * part of once all of its SETs are back.
+ */
+void modbusComplete(struct modbus_server * srv, struct command * cmd) {
+
+	struct modbus_module *mm = &srv->mods[cmd->module];
+	uint8_t op = cmd->request[0];
+
+	if (op == GET_DIGITAL_OUTPUTS) {
+		mm->polling = 0;
+		if (cmd->status == STATUS_OK) {
+			mm->outputs = cmd->response[0];
+			mm->updated = cmd->completed;
+		}
+		return;
+	}
+
+	struct modbus_client *c = cmd->user;
+	uint8_t bit = 0x01 << (cmd->request[1] - 1);
+
+	if (cmd->status == STATUS_OK) {
+		mm->outputs = op == SET_OUTPUT_ACTIVE ? mm->outputs | bit : mm->outputs & ~bit;
+	} else {
+		c->exception = cmd->status == STATUS_REJECTED ? MODBUS_DEVICE_FAILURE : MODBUS_TARGET_FAILED;
+	}
+
+	if (--c->pending > 0) {
+		return;
+	}
+	if (c->gone) {
+		free(c);
+		return;
+	}
+
+	if (c->exception) {
+		modbusException(c, c->response, c->response[7], c->exception);
+	} else {
+		modbusRespond(c, c->response, c->response + 7, 5);
+	}
+
+	// Requests pipelined behind the write can go now.
+	if (modbusProcess(srv, c) < 0 || modbusFlush(srv, c) < 0) {
+		modbusClose(srv, c);
+	}
+
+}
+
+
+/*
+ * Serves Modbus TCP on the given port in front of the modules.
+ *
+ * struct module_config * configs	- The modules.
+ * int count						- The number of modules.
+ * int modbus_port					- The port to listen on.
+ * int threads						- The number of engine threads.
+ * int interval_ms					- Time between polls of every module.
+ *
+ * returns -1 on failure, otherwise does not return.
+ */
+int runModbus(struct module_config * configs, int count, int modbus_port, int threads, int interval_ms) {
+
+	struct modbus_server srv;
+	memset(&srv, 0, sizeof(srv));
+	srv.configs = configs;
+	srv.count = count;
+	srv.interval_ms = interval_ms;
+	srv.mods = calloc(count, sizeof(*srv.mods));
+
+	if (count * 8 > 65536) {
+		printf("At most %d modules fit in the coil address space.\n", 65536 / 8);
+		return -1;
+	}
+
+	srv.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	int one = 1;
+	setsockopt(srv.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(modbus_port);
+
+	if (srv.listen_fd < 0 || bind(srv.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(srv.listen_fd, 1024) < 0) {
+		perror("runModbus - ");
+		return -1;
+	}
+
+	// A poll per module and room for the SETs of writes on top.
+	if (commandPoolInit(&srv.pool, count + 16384) < 0 || ringInit(&srv.reply, count + 16384, NULL) < 0) {
+		return -1;
+	}
+
+	srv.engine = engineCreate(configs, count, threads, 1);
+	srv.engine->depth = 8;
+	engineStart(srv.engine);
+
+	srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &srv;
+	epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev);
+	ev.data.ptr = &srv.reply;
+	epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.reply.fd, &ev);
+
+	printf("Serving %d coils of %d modules on Modbus TCP port %d, polling every %d ms\n", count * 8, count, modbus_port,
+			interval_ms);
+	fflush(stdout);
+
+	uint64_t next_poll = nowNs();
+	uint64_t next_report = next_poll + 10000000000ull;
+	struct epoll_event events[EPOLL_BATCH];
+
+	for (;;) {
+
+		uint64_t now = nowNs();
+
+		// Refresh the cache, skipping modules still answering the last poll.
+		if (now >= next_poll) {
+			for (int m = 0; m < count; m++) {
+				if (!srv.mods[m].polling) {
+					struct command *cmd = commandAlloc(&srv.pool);
+					if (cmd == NULL) {
+						break;
+					}
+					commandPrepare(cmd, m, GET_DIGITAL_OUTPUTS, 0, 0);
+					cmd->priority = PRIORITY_BULK;
+					cmd->reply = &srv.reply;
+					srv.mods[m].polling = 1;
+					srv.polls++;
+					while (engineSubmit(srv.engine, cmd) < 0) {
+						sched_yield();
+					}
+				}
+			}
+			next_poll += (uint64_t) interval_ms * 1000000ull;
+			if (next_poll < now) {
+				next_poll = now;
+			}
+		}
+
+		struct command *cmd;
+		while ((cmd = ringPop(&srv.reply)) != NULL) {
+			modbusComplete(&srv, cmd);
+			commandRelease(&srv.pool, cmd);
+		}
+
+		if (now >= next_report) {
+			printf("%llu coil reads, %llu writes needing %llu SETs, %llu module polls, %d clients\n",
+					(unsigned long long) srv.reads, (unsigned long long) srv.writes, (unsigned long long) srv.sets,
+					(unsigned long long) srv.polls, srv.clients);
+			fflush(stdout);
+			next_report = now + 10000000000ull;
+		}
+
+		now = nowNs();
+		int timeout = next_poll > now ? (int) ((next_poll - now) / 1000000) + 1 : 0;
+		if (ringArm(&srv.reply)) {
+			timeout = 0;
+		}
+
+		walRelease(&srv.held, srv.engine);
+		int n = epoll_wait(srv.epoll_fd, events, EPOLL_BATCH, timeout);
+
+		for (int i = 0; i < n; i++) {
+
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &srv.reply) {
+				ringAck(&srv.reply);
+				continue;
+			}
+
+			if (ptr == &srv) {
+				int fd;
+				while ((fd = accept4(srv.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					if (srv.clients >= MODBUS_MAX_CLIENTS) {
+						close(fd);
+						continue;
+					}
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					struct modbus_client *c = calloc(1, sizeof(*c));
+					c->fd = fd;
+					ev.events = EPOLLIN;
+					ev.data.ptr = c;
+					epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+					srv.clients++;
+				}
+				continue;
+			}
+
+			struct modbus_client *c = ptr;
+
+			if ((events[i].events & EPOLLOUT) && modbusFlush(&srv, c) < 0) {
+				modbusClose(&srv, c);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				// A full buffer reads as end of file, so a client that runs that far ahead is dropped.
+				ssize_t rd = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+				if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR)) {
+					modbusClose(&srv, c);
+					continue;
+				}
+				if (rd > 0) {
+					c->in_len += rd;
+				}
+				if (modbusProcess(&srv, c) < 0 || modbusFlush(&srv, c) < 0) {
+					modbusClose(&srv, c);
+				}
+			}
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Faults a proxy injects into the connections it forwards.
+ */
+struct proxy_faults {
+	int latency_ms;							// Added to everything forwarded, both ways.
+	int jitter_ms;							// Up to this much more, at random.
+	int split;								// Forward one byte per write.
+	int delay_ms;							// Extra delay for some responses,
+	double delay_p;							// with this probability per read.
+	double reset_p;							// Probability per read of resetting the connection.
+	double blackhole_p;						// Probability per read of dropping everything from then on.
+	uint64_t seed;
+};
+
+#define PROXY_BUFFER			65536	// Bytes held back per direction, a power of two.
+#define PROXY_SEGMENTS			4096	// Writes held back per direction, a power of two.
+
+/*
+ * Bytes held back in one direction of a proxied connection, as writes each
+ * due at a given time.
+ */
+struct proxy_pipe {
+	uint8_t data[PROXY_BUFFER];
+	uint32_t head;
+	uint32_t tail;
+	struct {
+		uint64_t due;
+		int len;
+	} seg[PROXY_SEGMENTS];
+	uint32_t seg_head;
+	uint32_t seg_tail;
+	uint64_t last_due;						// Writes keep their order whatever their jitter.
+	uint64_t bytes;
+	int eof;								// The sender has finished.
+	int blocked;							// The receiver's socket is full.
+};
+
+/*
+ * One end of a proxied connection, as registered with epoll.
+ */
+struct proxy_end {
+	struct proxy_conn *conn;
+	int side;								// 0 for the client, 1 for the module.
+};
+
+/*
+ * A client connection and the module connection it is forwarded to. Pipe
+ * n carries what end n sends.
+ */
+struct proxy_conn {
+	struct proxy_conn *next;
+	int id;
+	int fd[2];
+	struct proxy_end ends[2];
+	struct proxy_pipe pipe[2];
+	int connecting;
+	int blackholed;
+	int dead;
+	const char *ending;						// Why it ended.
+	uint64_t rng;
+	uint64_t delays;
+};
+
+
+/*
+ * Parses a fault spec such as latency=5,jitter=5,split,delay=200:0.05,reset:0.01
+ * Each item is a name, an optional =milliseconds and an optional :probability
+ * per read, which defaults to 1.
+ *
+ * returns -1 if the spec is not valid, otherwise 0.
+ */
+int parseFaults(char * spec, struct proxy_faults * f) {
+
+	char copy[256];
+	strncpy(copy, spec, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = '\0';
+
+	char *save;
+	for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+
+		double p = 1;
+		int ms = 0;
+		char *colon = strchr(item, ':');
+		if (colon) {
+			*colon = '\0';
+			p = atof(colon + 1);
+		}
+		char *equals = strchr(item, '=');
+		if (equals) {
+			*equals = '\0';
+			ms = atoi(equals + 1);
+		}
+		if (p < 0 || p > 1 || ms < 0) {
+			return -1;
+		}
+
+		if (strcmp(item, "latency") == 0) {
+			f->latency_ms = ms;
+		} else if (strcmp(item, "jitter") == 0) {
+			f->jitter_ms = ms;
+		} else if (strcmp(item, "split") == 0) {
+			f->split = 1;
+		} else if (strcmp(item, "delay") == 0) {
+			f->delay_ms = ms;
+			f->delay_p = p;
+		} else if (strcmp(item, "reset") == 0) {
+			f->reset_p = p;
+		} else if (strcmp(item, "blackhole") == 0) {
+			f->blackhole_p = p;
+		} else {
+			return -1;
+		}
+
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Returns a uniformly distributed double in [0, 1).
+ */
+double proxyRandom(struct proxy_conn * c) {
+
+	return (nextRandom(&c->rng) >> 11) * (1.0 / 9007199254740992.0);
+
+}
+
+
+/*
+ * Sets what epoll reports for one end: reads while its pipe has room,
+ * and writes while connecting or while the other pipe is waiting for it.
+ */
+void proxyInterest(int epoll_fd, struct proxy_conn * c, int side) {
+
+	struct proxy_pipe *in = &c->pipe[side], *out = &c->pipe[!side];
+	struct epoll_event ev;
+	ev.events = 0;
+	if (!in->eof && in->tail - in->head < PROXY_BUFFER && in->seg_tail - in->seg_head < PROXY_SEGMENTS) {
+		ev.events |= EPOLLIN;
+	}
+	if ((side == 1 && c->connecting) || out->blocked) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.ptr = &c->ends[side];
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd[side], &ev);
+
+}
+
+
+/*
+ * Ends a proxied connection, with a reset if asked to.
+ */
+void proxyEnd(struct proxy_conn * c, const char * why, int reset) {
+
+	if (c->dead) {
+		return;
+	}
+	for (int side = 0; side < 2; side++) {
+		if (reset) {
+			struct linger lg = { 1, 0 };
+			setsockopt(c->fd[side], SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		}
+		close(c->fd[side]);
+	}
+	c->dead = 1;
+	c->ending = why;
+
+}
+
+
+/*
+ * Holds back what one end sent, deciding the faults it meets on the way.
+ */
+void proxyHold(struct proxy_conn * c, struct proxy_faults * f, int side, uint32_t len, uint64_t now) {
+
+	struct proxy_pipe *p = &c->pipe[side];
+
+	if (f->reset_p > 0 && proxyRandom(c) < f->reset_p) {
+		proxyEnd(c, "reset", 1);
+		return;
+	}
+	if (f->blackhole_p > 0 && proxyRandom(c) < f->blackhole_p) {
+		c->blackholed = 1;
+		for (int s = 0; s < 2; s++) {
+			c->pipe[s].head = c->pipe[s].tail;
+			c->pipe[s].seg_head = c->pipe[s].seg_tail;
+		}
+	}
+	if (c->blackholed) {
+		p->head = p->tail;
+		return;
+	}
+
+	uint64_t extra = 0;
+	if (side == 1 && f->delay_ms > 0 && proxyRandom(c) < f->delay_p) {
+		extra = (uint64_t) f->delay_ms * 1000000ull;
+		c->delays++;
+	}
+
+	// Each byte is its own write when splitting, each with its own jitter.
+	uint32_t pieces = f->split ? len : 1;
+	for (uint32_t i = 0; i < pieces; i++) {
+		uint64_t due = now + (uint64_t) f->latency_ms * 1000000ull + extra;
+		if (f->jitter_ms > 0) {
+			due += nextRandom(&c->rng) % ((uint64_t) f->jitter_ms * 1000000ull + 1);
+		}
+		if (due < p->last_due) {
+			due = p->last_due;
+		}
+		p->last_due = due;
+		p->seg[p->seg_tail & (PROXY_SEGMENTS - 1)].due = due;
+		p->seg[p->seg_tail & (PROXY_SEGMENTS - 1)].len = f->split ? 1 : (int) len;
+		p->seg_tail++;
+	}
+
+}
+
+
+/*
+ * Reads what one end sent, as much as its pipe has room for.
+ */
+void proxyRead(struct proxy_conn * c, struct proxy_faults * f, int side, uint64_t now) {
+
+	struct proxy_pipe *p = &c->pipe[side];
+	uint32_t room = PROXY_BUFFER - (p->tail - p->head);
+	uint32_t offset = p->tail & (PROXY_BUFFER - 1);
+	uint32_t writes = PROXY_SEGMENTS - (p->seg_tail - p->seg_head);
+	if (room > PROXY_BUFFER - offset) {
+		room = PROXY_BUFFER - offset;
+	}
+	// Split, every byte read becomes a write of its own.
+	if (f->split && room > writes) {
+		room = writes;
+	}
+	if (p->eof || room == 0 || writes == 0) {
+		return;
+	}
+
+	ssize_t n;
+	do {
+		n = read(c->fd[side], p->data + offset, room);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		if (errno != EAGAIN) {
+			proxyEnd(c, side ? "module error" : "client error", 0);
+		}
+		return;
+	}
+	if (n == 0) {
+		p->eof = 1;
+		return;
+	}
+
+	p->tail += n;
+	p->bytes += n;
+	proxyHold(c, f, side, (uint32_t) n, now);
+
+}
+
+
+/*
+ * Writes what has come due in one pipe to the other end.
+ */
+void proxyPump(struct proxy_conn * c, int side, uint64_t now) {
+
+	struct proxy_pipe *p = &c->pipe[side];
+	int to = c->fd[!side];
+
+	if (side == 0 && c->connecting) {
+		return;
+	}
+
+	p->blocked = 0;
+	while (p->seg_head != p->seg_tail && p->seg[p->seg_head & (PROXY_SEGMENTS - 1)].due <= now) {
+
+		int *len = &p->seg[p->seg_head & (PROXY_SEGMENTS - 1)].len;
+		uint32_t offset = p->head & (PROXY_BUFFER - 1);
+		uint32_t chunk = *len;
+		if (chunk > PROXY_BUFFER - offset) {
+			chunk = PROXY_BUFFER - offset;
+		}
+
+		ssize_t n = write(to, p->data + offset, chunk);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			p->blocked = 1;
+			return;
+		}
+		if (n <= 0) {
+			proxyEnd(c, side ? "client error" : "module error", 0);
+			return;
+		}
+
+		p->head += n;
+		*len -= n;
+		if (*len == 0) {
+			p->seg_head++;
+		}
+
+	}
+
+	// Pass an end of stream on once everything before it is through.
+	if (p->eof == 1 && p->seg_head == p->seg_tail) {
+		shutdown(to, SHUT_WR);
+		p->eof = 2;
+	}
+
+}
+
+
+/*
+ * Opens the connection to the module for a new client.
+ *
+ * returns NULL on failure.
+ */
+struct proxy_conn * proxyOpen(int epoll_fd, int client, struct sockaddr_in * target, struct proxy_faults * f, int id) {
+
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd < 0) {
+		perror("proxyOpen - ");
+		return NULL;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *) target, sizeof(*target)) < 0 && errno != EINPROGRESS) {
+		perror("proxyOpen - ");
+		close(fd);
+		return NULL;
+	}
+
+	struct proxy_conn *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		close(fd);
+		return NULL;
+	}
+	c->id = id;
+	c->fd[0] = client;
+	c->fd[1] = fd;
+	c->connecting = 1;
+	// Every connection has its own stream of faults, so a run repeats whatever order they are served in.
+	c->rng = (f->seed ? f->seed : 0x9E3779B97F4A7C15ull) + (uint64_t) id * 0xBF58476D1CE4E5B9ull;
+	if (c->rng == 0) {
+		c->rng = 1;
+	}
+
+	for (int side = 0; side < 2; side++) {
+		c->ends[side].conn = c;
+		c->ends[side].side = side;
+		struct epoll_event ev;
+		ev.events = 0;
+		ev.data.ptr = &c->ends[side];
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd[side], &ev);
+		proxyInterest(epoll_fd, c, side);
+	}
+	return c;
+
+}
+
+
+/*
+ * Forwards connections on the given port to a module, injecting faults on
+ * the way. Everything runs on one event loop; the connections are few, so
+ * each pass simply looks over all of them for writes that have come due.
+ *
+ * int listen_port				- The port to accept clients on.
+ * struct sockaddr_in * target	- The module or simulator to forward to.
+ * struct proxy_faults * f		- What to inject.
+ *
+ * returns -1 on failure, otherwise does not return.
+ */
+int runProxy(int listen_port, struct sockaddr_in * target, struct proxy_faults * f) {
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(listen_port);
+
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 1024) < 0) {
+		perror("runProxy - ");
+		return -1;
+	}
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	printf("Proxying port %d to %s:%d with latency %d ms, jitter %d ms%s, delay %d ms at %.3f, reset at %.3f, "
+			"blackhole at %.3f, seed %llu\n", listen_port, inet_ntoa(target->sin_addr), ntohs(target->sin_port),
+			f->latency_ms, f->jitter_ms, f->split ? ", split" : "", f->delay_ms, f->delay_p, f->reset_p,
+			f->blackhole_p, (unsigned long long) f->seed);
+	fflush(stdout);
+
+	struct proxy_conn *conns = NULL;
+	struct epoll_event events[EPOLL_BATCH];
+	int next_id = 0;
+
+	for (;;) {
+
+		// Sleep until the next held back write is due.
+		uint64_t now = nowNs(), due = UINT64_MAX;
+		for (struct proxy_conn *c = conns; c; c = c->next) {
+			for (int side = 0; side < 2; side++) {
+				struct proxy_pipe *p = &c->pipe[side];
+				if (p->seg_head != p->seg_tail && !p->blocked && p->seg[p->seg_head & (PROXY_SEGMENTS - 1)].due < due) {
+					due = p->seg[p->seg_head & (PROXY_SEGMENTS - 1)].due;
+				}
+			}
+		}
+		int timeout = due == UINT64_MAX ? -1 : due > now ? (int) ((due - now + 999999) / 1000000) : 0;
+
+		int n = epoll_wait(epoll_fd, events, EPOLL_BATCH, timeout);
+		now = nowNs();
+
+		for (int i = 0; i < n; i++) {
+
+			if (events[i].data.ptr == NULL) {
+				int fd;
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					struct proxy_conn *c = proxyOpen(epoll_fd, fd, target, f, next_id++);
+					if (c == NULL) {
+						close(fd);
+						continue;
+					}
+					c->next = conns;
+					conns = c;
+				}
+				continue;
+			}
+
+			struct proxy_end *end = events[i].data.ptr;
+			struct proxy_conn *c = end->conn;
+			if (c->dead) {
+				continue;
+			}
+
+			if (end->side == 1 && c->connecting) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0) {
+					proxyEnd(c, "module refused", 1);
+					continue;
+				}
+				if (events[i].events & EPOLLOUT) {
+					c->connecting = 0;
+				}
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				proxyRead(c, f, end->side, now);
+			}
+
+		}
+
+		// Write what has come due and retire finished connections.
+		struct proxy_conn **link = &conns;
+		while (*link) {
+			struct proxy_conn *c = *link;
+			for (int side = 0; side < 2 && !c->dead; side++) {
+				proxyPump(c, side, now);
+			}
+			if (!c->dead && c->pipe[0].eof == 2 && c->pipe[1].eof == 2) {
+				proxyEnd(c, "closed", 0);
+			}
+			if (c->dead) {
+				if (show_stats) {
+					printf("connection %d: %llu bytes to the module, %llu back, %llu responses delayed, %s%s\n", c->id,
+							(unsigned long long) c->pipe[0].bytes, (unsigned long long) c->pipe[1].bytes,
+							(unsigned long long) c->delays, c->blackholed ? "blackholed, " : "", c->ending);
+					fflush(stdout);
+				}
+				*link = c->next;
+				free(c);
+				continue;
+			}
+			for (int side = 0; side < 2; side++) {
+				proxyInterest(epoll_fd, c, side);
+			}
+			link = &c->next;
+		}
+
+	}
+
+}
+
+
+/*
+ * Brings every module in the log to the states it last had logged for it,
+ * as after a crash. Outputs the log has never had a state for are left alone.
+ *
+ * char * password		- The password for the modules.
+ * int threads			- The number of engine threads.
+ *
+ * returns -1 on failure, otherwise 0.
+ */
+int runReconcile(char * password, int threads) {
+
+	printf("Replayed %llu changes to %d modules from %s", (unsigned long long) wal->replayed, wal->state_count,
+			wal->path);
+	if (wal->discarded) {
+		printf(", cleared %zu bytes after the last good record", wal->discarded);
+	}
+	printf("\n");
+
+	int count = wal->state_count;
+	if (count == 0) {
+		return 0;
+	}
+
+	struct module_config *configs = calloc(count, sizeof(*configs));
+	struct scene_module *mods = calloc(count, sizeof(*mods));
+	char (*targets)[INET_ADDRSTRLEN + 6] = calloc(count, sizeof(*targets));
+
+	int m = 0;
+	for (int i = 0; i < wal->state_cap; i++) {
+		struct wal_state *s = &wal->states[i];
+		if (s->mask == 0) continue;
+		configs[m].addr.sin_family = AF_INET;
+		configs[m].addr.sin_addr.s_addr = s->addr;
+		configs[m].addr.sin_port = s->port;
+		configs[m].password = password;
+		struct in_addr a = { s->addr };
+		snprintf(targets[m], sizeof(targets[m]), "%s:%d", inet_ntoa(a), ntohs(s->port));
+		mods[m].target = targets[m];
+		mods[m].outputs = s->outputs;
+		mods[m].mask = s->mask;
+		m++;
+	}
+
+	int failed = applyScene(configs, mods, count, threads, "reconcile");
+
+	free(targets);
+	free(mods);
+	free(configs);
+	return failed ? -1 : 0;
+
+}
+
+
+/*
+ * One thread of the log benchmark.
+ */
+struct wal_bench_thread {
+	pthread_t thread;
+	uint64_t rng;
+	int *stop;
+	uint64_t appends;
+	struct histogram *hist;					// Append to durable latency.
+};
+
+
+/*
+ * Appends random changes to 65536 modules, waiting for each to be durable
+ * before the next, until told to stop.
+ */
+void * walBenchRun(void * arg) {
+
+	struct wal_bench_thread *t = arg;
+
+	while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+		uint64_t r = nextRandom(&t->rng);
+		uint8_t bit = 0x01 << (r >> 16 & 7);
+		uint64_t start = nowNs();
+		uint64_t seq = walAppend(wal, htonl(0x0A000000 | (r & 0xFFFF)), htons(17494), bit, r >> 19 & 1 ? bit : 0);
+		if (seq == 0 || walCommit(wal, seq) < 0) {
+			break;
+		}
+		histRecord(t->hist, nowNs() - start, 1);
+		t->appends++;
+	}
+
+	return NULL;
+
+}
+
+
+/*
+ * Measures how fast the log takes durable changes. Each thread appends and
+ * commits one change at a time, so the rate shows how well commits are
+ * shared, and the latencies include the compactions the log makes as it
+ * fills.
+ *
+ * int threads			- The number of threads appending.
+ * int seconds			- How long to run for.
+ */
+void runWalBench(int threads, int seconds) {
+
+	struct wal_bench_thread *t = calloc(threads, sizeof(*t));
+	int stop = 0;
+	uint64_t syncs = wal->syncs, compactions = wal->compactions;
+	uint64_t start = nowNs();
+
+	for (int i = 0; i < threads; i++) {
+		t[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+		t[i].stop = &stop;
+		t[i].hist = calloc(1, sizeof(*t[i].hist));
+		pthread_create(&t[i].thread, NULL, walBenchRun, &t[i]);
+	}
+
+	sleep(seconds);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	struct histogram *total = calloc(1, sizeof(*total));
+	uint64_t appends = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		for (int b = 0; b < HIST_BUCKETS; b++) {
+			total->counts[b] += t[i].hist->counts[b];
+		}
+		total->total += t[i].hist->total;
+		if (t[i].hist->max > total->max) total->max = t[i].hist->max;
+		appends += t[i].appends;
+		free(t[i].hist);
+	}
+
+	double elapsed = (nowNs() - start) / 1e9;
+	syncs = wal->syncs - syncs;
+	compactions = wal->compactions - compactions;
+
+	printf("Log %s: %d threads, %llu durable appends in %.2f s, %.0f appends/s\n", wal->path, threads,
+			(unsigned long long) appends, elapsed, appends / elapsed);
+	printf("%llu commits, %.1f appends per commit, %llu compactions, %d modules\n", (unsigned long long) syncs,
+			syncs ? (double) appends / syncs : 0, (unsigned long long) compactions, wal->state_count);
+	histPrint("append", total);
+
+	free(total);
+	free(t);
+
+}
+
+
+int main(int argc, char ** argv) {
+
+	int info = 0; // Used to indicate if we should print the module information.
+	int outputs = 0; // Used to indicate if we should show the digital output states.
+	uint8_t toggles[16]; // The digital outputs to toggle, in order.
+	int toggle_count = 0;
+	struct output_cache cache = { 0, 0, STATE_MAX_AGE_MS }; // Output states known on this session.
+	int port = 17494; // The port that the module is on.
+	char *password = NULL; // The password used to unlock the module
+	int simulate = 0; // Used to indicate we should act as a module simulator.
+	int sim_count = 1; // The number of ports to simulate modules on.
+	int bench = 0; // Used to indicate we should benchmark the engine.
+	int modules = 0; // The number of modules to benchmark, 0 for one per target.
+	int threads = 1; // The number of worker threads.
+	int depth = 1; // The number of commands in flight per module.
+	int duration = 5; // Seconds per benchmark pass.
+	int submitters = 0; // Threads submitting benchmark commands through reply rings.
+	int bench_toggle = 0; // Used to indicate the benchmark should toggle outputs instead of reading them.
+	char *scene_file = NULL; // The scene file to apply a scene from.
+	int load = 0; // Used to indicate we should generate load.
+	double rate = 0; // Open-loop commands per second, 0 for closed-loop.
+	char *mix = "get"; // The load mix.
+	uint64_t seed = 0; // Seed for the load mix.
+	char *sync_at = NULL; // When to switch a synchronised scene.
+	clockid_t sync_clock = CLOCK_REALTIME; // The clock sync_at is on.
+	char *batch_file = NULL; // The batch job file to run.
+	int parallel = 0; // Modules a batch job or connections a discovery works on at once, 0 for the default.
+	char *results = NULL; // Where batch results are written.
+	int discover = 0; // Used to indicate we should sweep for modules.
+	char *inventory_file = "eth008.inventory"; // The inventory of known modules.
+	int inventory_given = 0; // Used to indicate --inventory was given.
+	int refresh = 0; // Used to indicate we should refresh stale inventory entries.
+	int ttl = INVENTORY_TTL_S; // Seconds an inventory entry is trusted for.
+	int http_port = 0; // The port to serve the HTTP gateway on, 0 for none.
+	struct mqtt_options mqtt = { NULL, 1883, "eth008", 1000 }; // The broker to bridge to, if any.
+	int modbus_port = 0; // The port to serve Modbus TCP on, 0 for none.
+	char *wal_file = NULL; // The log of desired states.
+	int reconcile = 0; // Used to indicate we should bring modules to their logged states.
+	int proxy_port = 0; // The port to run a fault injecting proxy on, 0 for none.
+	char *faults = ""; // The faults the proxy injects.
+
+	static struct option long_options[] = {
+		{ "simulate",	no_argument,		NULL, 'S' },
+		{ "sim-count",	required_argument,	NULL, 'C' },
+		{ "bench",		no_argument,		NULL, 'B' },
+		{ "modules",	required_argument,	NULL, 'M' },
+		{ "threads",	required_argument,	NULL, 'T' },
+		{ "depth",		required_argument,	NULL, 'D' },
+		{ "duration",	required_argument,	NULL, 'U' },
+		{ "submitters",	required_argument,	NULL, 'N' },
+		{ "max-age",	required_argument,	NULL, 'A' },
+		{ "toggle",		no_argument,		NULL, 'G' },
+		{ "scene",		required_argument,	NULL, 'E' },
+		{ "load",		no_argument,		NULL, 'L' },
+		{ "rate",		required_argument,	NULL, 'R' },
+		{ "mix",		required_argument,	NULL, 'X' },
+		{ "seed",		required_argument,	NULL, 'Z' },
+		{ "sync-at",	required_argument,	NULL, 'Y' },
+		{ "clock",		required_argument,	NULL, 'K' },
+		{ "stats",		no_argument,		NULL, 'I' },
+		{ "batch",		required_argument,	NULL, 'J' },
+		{ "parallel",	required_argument,	NULL, 'Q' },
+		{ "results",	required_argument,	NULL, 'O' },
+		{ "discover",	no_argument,		NULL, 'V' },
+		{ "inventory",	required_argument,	NULL, 'W' },
+		{ "refresh",	no_argument,		NULL, 'F' },
+		{ "ttl",		required_argument,	NULL, 'H' },
+		{ "http",		required_argument,	NULL, 'q' },
+		{ "mqtt",		required_argument,	NULL, 'j' },
+		{ "topic",		required_argument,	NULL, 'k' },
+		{ "interval",	required_argument,	NULL, 'l' },
+		{ "modbus",		required_argument,	NULL, 'n' },
+		{ "wal",		required_argument,	NULL, 'w' },
+		{ "reconcile",	no_argument,		NULL, 'r' },
+		{ "adaptive",	no_argument,		NULL, 'd' },
+		{ "rto-min",	required_argument,	NULL, 'e' },
+		{ "rto-max",	required_argument,	NULL, 'f' },
+		{ "hedge",		no_argument,		NULL, 'g' },
+		{ "proxy",		required_argument,	NULL, 'b' },
+		{ "faults",		required_argument,	NULL, 'c' },
+		{ "sndbuf",		required_argument,	NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "omiaP:p:t:h", long_options, NULL)) != -1) {
+
+		switch (opt) {
+
+			case 'S':
+				simulate = 1;
+				break;
+
+			case 'C':
+				sim_count = atoi(optarg);
+				break;
+
+			case 'B':
+				bench = 1;
+				break;
+
+			case 'M':
+				modules = atoi(optarg);
+				break;
+
+			case 'T':
+				threads = atoi(optarg);
+				break;
+
+			case 'D':
+				depth = atoi(optarg);
+				break;
+
+			case 'U':
+				duration = atoi(optarg);
+				break;
+
+			case 'N':
+				submitters = atoi(optarg);
+				break;
+
+			case 'A':
+				cache.max_age_ms = atoi(optarg);
+				break;
+
+			case 'G':
+				bench_toggle = 1;
+				break;
+
+			case 'E':
+				scene_file = optarg;
+				break;
+
+			case 'L':
+				load = 1;
+				break;
+
+			case 'R':
+				rate = atof(optarg);
+				break;
+
+			case 'X':
+				mix = optarg;
+				break;
+
+			case 'Z':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+
+			case 'Y':
+				sync_at = optarg;
+				break;
+
+			case 'K':
+				sync_clock = strcmp(optarg, "monotonic") == 0 ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+				break;
+
+			case 'I':
+				show_stats = 1;
+				break;
+
+			case 'J':
+				batch_file = optarg;
+				break;
+
+			case 'Q':
+				parallel = atoi(optarg);
+				break;
+
+			case 'O':
+				results = optarg;
+				break;
+
+			case 'V':
+				discover = 1;
+				break;
+
+			case 'W':
+				inventory_file = optarg;
+				inventory_given = 1;
+				break;
+
+			case 'F':
+				refresh = 1;
+				break;
+
+			case 'H':
+				ttl = atoi(optarg);
+				break;
+
+			case 'q':
+				http_port = atoi(optarg);
+				break;
+
+			case 'j':
+				mqtt.broker = optarg;
+				if (strchr(optarg, ':')) {
+					*strchr(optarg, ':') = '\0';
+					mqtt.broker_port = atoi(optarg + strlen(optarg) + 1);
+				}
+				break;
+
+			case 'k':
+				mqtt.prefix = optarg;
+				break;
+
+			case 'l':
+				mqtt.interval_ms = atoi(optarg);
+				break;
+
+			case 'n':
+				modbus_port = atoi(optarg);
+				break;
+
+			case 'w':
+				wal_file = optarg;
+				break;
+
+			case 'r':
+				reconcile = 1;
+				break;
+
+			case 'd':
+				adaptive_depth = 1;
+				break;
+
+			case 'e':
+				rto_min_ms = atoi(optarg);
+				break;
+
+			case 'f':
+				rto_max_ms = atoi(optarg);
+				break;
+
+			case 'g':
+				hedge_reads = 1;
+				break;
+
+			case 's':
+				send_buffer = atoi(optarg);
+				break;
+
+			case 'b':
+				proxy_port = atoi(optarg);
+				break;
+
+			case 'c':
+				faults = optarg;
+				break;
+
+			case 'h':
+				printHelp();
+				break;
+
+			/*
+			 * The m option displays the module information
+			 */
+			case 'm':
+				info = 1;
+				break;
+			
+			/*
+			 * The p option allows us to set the port. it defaulte to 17494.
+			 */
+			case 'p':
+				port = atoi(optarg);
 				break;
 			
 			/*
 			 * The P option allows the user to supply a password to unlock the module.
 			 */
 			case 'P':
-				password = strdup(optarg);
+				password = optarg;
 				break;
 
 			/*
@@ -410,65 +8964,279 @@ int main(int argc, char ** argv) {
 			 * The t command is used to toggle adigital output.
 			 */
 			case 't':
-				toggle = atoi(optarg);
+				if (toggle_count < (int) sizeof(toggles)) {
+					toggles[toggle_count++] = atoi(optarg);
+				}
 
 			case '?':
 				break;
 		}
 	}
 
+	if (rto_min_ms < 1 || rto_max_ms < rto_min_ms) {
+		printf("--rto-min must be at least 1 and no more than --rto-max.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (password != NULL && strlen(password) > MAX_PASSWORD) {
+		printf("The password can be at most %d characters.\n", MAX_PASSWORD);
+		exit(EXIT_FAILURE);
+	}
+
+	if (simulate) {
+		signal(SIGPIPE, SIG_IGN);
+		runSimulator(port, sim_count, threads, password);
+		return 0;
+	}
+
+	if (inventoryLoad(inventory_file, &inventory) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	inventory.ttl = ttl;
+
+	if (wal_file) {
+		wal = walOpen(wal_file);
+		if (wal == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	} else if (reconcile) {
+		printf("--reconcile needs the log given with --wal.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct discovery_options dopts;
+	dopts.port = port;
+	dopts.parallel = parallel < 1 ? 1024 : parallel;
+	dopts.rate = rate;
+	dopts.inventory = inventory_file;
+
+	if (refresh) {
+		signal(SIGPIPE, SIG_IGN);
+		return runRefresh(&dopts) < 0 ? EXIT_FAILURE : 0;
+	}
+
+	if (scene_file) {
+		if (optind >= argc) {
+			printf("No scene name was supplied.\n");
+			exit(EXIT_FAILURE);
+		}
+		signal(SIGPIPE, SIG_IGN);
+		if (sync_at) {
+			return runSync(scene_file, argv[optind], port, password, sync_at, sync_clock) < 0 ? EXIT_FAILURE : 0;
+		}
+		return runScene(scene_file, argv[optind], port, password, threads) < 0 ? EXIT_FAILURE : 0;
+	}
+
+	if (batch_file) {
+		struct batch_options bopts;
+		char default_results[PATH_MAX];
+		snprintf(default_results, sizeof(default_results), "%s.results", batch_file);
+		bopts.threads = threads < 1 ? 1 : threads;
+		bopts.depth = depth < 1 ? 1 : depth;
+		bopts.parallel = parallel < 1 ? 64 : parallel;
+		bopts.results = results ? results : default_results;
+		signal(SIGPIPE, SIG_IGN);
+		return runBatch(batch_file, port, password, &bopts) < 0 ? EXIT_FAILURE : 0;
+	}
+
+	if (reconcile) {
+		signal(SIGPIPE, SIG_IGN);
+		return runReconcile(password, threads < 1 ? 1 : threads) < 0 ? EXIT_FAILURE : 0;
+	}
+
+	if (wal && bench && optind >= argc) {
+		runWalBench(threads < 1 ? 1 : threads, duration);
+		return 0;
+	}
+
 	if (optind >= argc) {
 		printf("No IP address was supplied.\n");
 		printHelp();
 		exit(EXIT_FAILURE);
 	}
 
-	// The ip address is the non argument input given.
-	char buffer[1024] = {0};
-	int socket = openSocket(argv[optind], port);
+	if (discover) {
+		signal(SIGPIPE, SIG_IGN);
+		return runDiscovery(&argv[optind], argc - optind, &dopts) < 0 ? EXIT_FAILURE : 0;
+	}
 
-	if (socket == -1) {
-		exit(EXIT_FAILURE);
+	if (proxy_port) {
+		struct module_config *configs = NULL;
+		int count = 0;
+		struct proxy_faults pf;
+		memset(&pf, 0, sizeof(pf));
+		pf.seed = seed;
+		if (parseFaults(faults, &pf) < 0) {
+			printf("Invalid faults %s\n", faults);
+			exit(EXIT_FAILURE);
+		}
+		if (parseTarget(argv[optind], port, password, &configs, &count) < 0) {
+			printf("Invalid target %s\n", argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+		signal(SIGPIPE, SIG_IGN);
+		runProxy(proxy_port, &configs[0].addr, &pf);
+		free(configs);
+		return EXIT_FAILURE;
 	}
 
-	// check unlock time to see if we need to send a password.
-	if (getUnlockTime(socket) == 0) {
+	if (bench || load || http_port || mqtt.broker || modbus_port) {
 
-		// We need to send a password before we can control this module
-		if (password == NULL) {
-			printf("A password is needed.\n");
-			close(socket);
+		struct module_config *configs = NULL;
+		int count = 0;
+
+		for (int a = optind; a < argc; a++) {
+			if (parseTarget(argv[a], port, password, &configs, &count) < 0) {
+				printf("Invalid target %s\n", argv[a]);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		// Spread the requested number of modules over the targets round robin.
+		if (modules > count) {
+			configs = realloc(configs, modules * sizeof(*configs));
+			for (int m = count; m < modules; m++) {
+				configs[m] = configs[m % count];
+			}
+			count = modules;
+		}
+		inventoryApply(&inventory, configs, count);
+
+		signal(SIGPIPE, SIG_IGN);
+
+		if (modbus_port) {
+			runModbus(configs, count, modbus_port, threads < 1 ? 1 : threads, mqtt.interval_ms < 1 ? 1 : mqtt.interval_ms);
+			free(configs);
+			return EXIT_FAILURE;
+		}
+
+		if (mqtt.broker) {
+			int status = runBridge(configs, count, threads < 1 ? 1 : threads, &mqtt);
+			free(configs);
+			return status < 0 ? EXIT_FAILURE : 0;
+		}
+
+		if (http_port) {
+			int status = runGateway(configs, count, http_port, threads < 1 ? 1 : threads,
+					bench ? (parallel < 1 ? 256 : parallel) : 0, duration);
+			free(configs);
+			return status < 0 ? EXIT_FAILURE : 0;
+		}
+
+		if (load) {
+			struct load_options lopts;
+			lopts.threads = threads < 1 ? 1 : threads;
+			lopts.depth = depth < 1 ? 1 : depth;
+			lopts.seconds = duration;
+			lopts.rate = rate;
+			lopts.seed = seed;
+			lopts.mix_total = parseMix(mix);
+			if (lopts.mix_total <= 0) {
+				printf("Invalid mix %s\n", mix);
+				exit(EXIT_FAILURE);
+			}
+			runLoad(configs, count, &lopts);
+			free(configs);
 			return 0;
 		}
 
-		sendPassword(socket, password); // send the password
-										//
-		if (getUnlockTime(socket) == 0) { // Check to see if the password has unlocked the module
-			printf("Unable to unlock module,\n");
+		struct bench_options opts;
+		opts.threads = threads < 1 ? 1 : threads;
+		opts.depth = depth < 1 ? 1 : depth;
+		opts.submitters = submitters;
+		opts.seconds = duration;
+		opts.toggle = bench_toggle;
+		opts.max_age_ms = cache.max_age_ms;
+		runBenchmark(configs, count, &opts);
+		free(configs);
+		return 0;
+
+	}
+
+	// What the inventory knows of the module, trusted if it is recent enough.
+	struct inventory_entry seen;
+	struct in_addr module_addr;
+	int known = 0, fresh = 0;
+	memset(&seen, 0, sizeof(seen));
+	seen.password = -1;
+
+	// Only a dotted quad, so the module connected to is the one the inventory knows.
+	if (inet_pton(AF_INET, argv[optind], &module_addr) != 1) {
+		printf("Invalid address %s\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	struct inventory_entry *entry = inventoryFind(&inventory, module_addr.s_addr, port);
+	if (entry) {
+		seen = *entry;
+		known = 1;
+		fresh = inventoryFresh(&inventory, module_addr.s_addr, port) != NULL;
+	}
+
+	// Module information alone can be answered from the inventory without connecting.
+	if (info && fresh && toggle_count == 0 && !outputs) {
+		printModuleInfo(-1, seen.info);
+		return 0;
+	}
+
+	// The ip address is the non argument input given.
+	cliOperation(OP_CONNECT);
+	int socket = openSocket(argv[optind], port);
+
+	if (socket == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	// A module known to have no password needs no GET_UNLOCK.
+	if (seen.password != 0 || !fresh) {
+		cliOperation(OP_UNLOCK);
+		int unlock_time = unlockModule(socket, password);
+		if (unlock_time < 0) {
 			close(socket);
-			free(password);
 			return 0;
 		}
-
+		seen.password = unlock_time != UNLOCK_NO_PASSWORD;
 	}
 
 	// If the i argument was passed then print the module information.
 	if (info) {	
-		printModuleInfo(socket);
+		if (fresh) {
+			printModuleInfo(-1, seen.info);
+		} else {
+			cliOperation(OP_INFO);
+			printModuleInfo(socket, seen.info);
+			known = 1;
+		}
 	}
 
 	// If the t argument was passed then toggel the output.
-	if (toggle) {
-		toggleDigitalOutput(socket, toggle);
+	for (int t = 0; t < toggle_count; t++) {
+		cliOperation(OP_TOGGLE);
+		toggleDigitalOutput(socket, toggles[t], &cache);
 	}
 
 	// if the o argument was passed then show the states of the outputs.
 	if (outputs) {
+		cliOperation(OP_OUTPUTS);
 		printOutputStates(socket);
 	}
 
+	cliOperation(OP_LOGOUT);
 	sendLogout(socket);
 	close(socket);
+
+	// Keep an inventory that is in use up to date with what this session learnt.
+	if (known && (inventory_given || access(inventory_file, F_OK) == 0)) {
+		seen.addr = module_addr.s_addr;
+		seen.port = port;
+		arpLookup(seen.addr, seen.mac);
+		seen.seen = time(NULL);
+		inventoryUpdate(&inventory, &seen);
+		inventorySave(inventory_file, &inventory);
+	}
+
+	if (show_stats) {
+		printCliStats();
+	}
 	return 0;
 
 }
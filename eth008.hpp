@@ -0,0 +1,956 @@
+/*
+ * C++20 coroutine interface to the ETH008.
+ *
+ * Every opcode of the module is an awaitable operation on a Module, and an
+ * Executor runs any number of module coroutines on one thread with a
+ * single epoll loop:
+ *
+ *		eth008::Task<> flip(eth008::Executor & exec) {
+ *			eth008::Module mod(exec, "192.168.0.10");
+ *			auto outputs = co_await mod.state();
+ *			if (outputs) {
+ *				co_await mod.set(3, !(outputs.value & 0x04));
+ *			}
+ *		}
+ *
+ *		eth008::Executor exec;
+ *		exec.spawn(flip(exec));
+ *		exec.run();
+ *
+ * Operations live in the frame of the coroutine that awaits them and are
+ * linked into their module's queue in place, so once a coroutine is running
+ * no operation touches the heap.
+ *
+ * compile with:
+ *		g++ -std=c++20 program.cpp
+ */
+
+#ifndef ETH008_HPP
+#define ETH008_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace eth008 {
+
+constexpr uint8_t GET_INFO = 0x10;
+constexpr uint8_t GET_UNLOCK = 0x7A;
+constexpr uint8_t SEND_PASSWORD = 0x79;
+constexpr uint8_t LOGOUT = 0x7B;
+constexpr uint8_t GET_DIGITAL_OUTPUTS = 0x24;
+constexpr uint8_t SET_OUTPUT_ACTIVE = 0x20;
+constexpr uint8_t SET_OUTPUT_INACTIVE = 0x21;
+
+constexpr int CMD_MAX_REQUEST = 32;				// Longest command frame.
+constexpr int CMD_MAX_RESPONSE = 8;				// Longest response frame.
+constexpr int MAX_DEPTH = 64;					// Most operations in flight on one module.
+constexpr int DEFAULT_TIMEOUT_MS = 500;
+constexpr uint16_t DEFAULT_PORT = 17494;
+
+/*
+ * Completion status of an operation, the same values as the STATUS_ codes
+ * of eth008.c.
+ */
+enum class Status : int {
+	ok = 0,
+	error = -1,									// Could not connect, or the connection failed.
+	timeout = -2,
+	rejected = -4,								// The module answered but refused the command.
+};
+
+/*
+ * How each opcode is framed on the wire and what a good response looks
+ * like, as in the command table of eth008.c.
+ */
+struct CommandDesc {
+	uint8_t request_len;						// Bytes sent including the opcode, 0 if the payload sets the length.
+	uint8_t response_len;						// Bytes the module answers with, 0 if the opcode is not supported.
+	uint8_t ok_mask;
+	uint8_t ok_value;
+};
+
+constexpr CommandDesc commandDesc(uint8_t op) {
+
+	switch (op) {
+	case GET_INFO:				return { 1, 3, 0x00, 0x00 };
+	case GET_UNLOCK:			return { 1, 1, 0x00, 0x00 };
+	case SEND_PASSWORD:			return { 0, 1, 0xFF, 0x01 };
+	case LOGOUT:				return { 1, 1, 0x00, 0x00 };
+	case GET_DIGITAL_OUTPUTS:	return { 1, 1, 0x00, 0x00 };
+	case SET_OUTPUT_ACTIVE:		return { 3, 1, 0xFF, 0x00 };
+	case SET_OUTPUT_INACTIVE:	return { 3, 1, 0xFF, 0x00 };
+	default:					return { 0, 0, 0x00, 0x00 };
+	}
+
+}
+
+/*
+ * The result of an operation that reads something back.
+ */
+template <class T>
+struct Value {
+	Status status;
+	T value;
+
+	explicit operator bool() const noexcept { return status == Status::ok; }
+};
+
+/*
+ * What GET_INFO answers with.
+ */
+struct Info {
+	uint8_t id;
+	uint8_t hardware;
+	uint8_t firmware;
+};
+
+inline uint64_t nowMs() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+class Executor;
+class Module;
+
+namespace detail {
+
+/*
+ * One request to a module and, once complete, its response. It is the
+ * common part of every awaitable and sits in the awaiting coroutine's frame.
+ */
+struct Operation {
+	Operation *next = nullptr;
+	std::coroutine_handle<> waiter;
+	uint64_t sent = 0;							// nowMs() when written.
+	Status status = Status::ok;
+	uint8_t op = 0;
+	uint8_t request_len = 0;					// 0 if the operation could not be encoded.
+	uint8_t response_len = 0;
+	uint8_t request[CMD_MAX_REQUEST];
+	uint8_t response[CMD_MAX_RESPONSE];
+
+	Operation(uint8_t opcode, const uint8_t * args, int len) : op(opcode) {
+
+		CommandDesc d = commandDesc(opcode);
+		int frame_len = d.request_len ? d.request_len : len + 1;
+		if (d.response_len == 0 || frame_len > CMD_MAX_REQUEST) {
+			return;
+		}
+
+		std::memset(request, 0, frame_len);
+		request[0] = opcode;
+		if (len > 0) {
+			std::memcpy(request + 1, args, len < frame_len - 1 ? len : frame_len - 1);
+		}
+		request_len = (uint8_t) frame_len;
+		response_len = d.response_len;
+
+	}
+
+	Operation(const Operation &) = delete;
+	Operation & operator=(const Operation &) = delete;
+};
+
+/*
+ * A singly linked FIFO of operations.
+ */
+struct OperationList {
+	Operation *head = nullptr;
+	Operation *tail = nullptr;
+
+	void push(Operation * op) noexcept {
+
+		op->next = nullptr;
+		if (tail) {
+			tail->next = op;
+		} else {
+			head = op;
+		}
+		tail = op;
+
+	}
+
+	Operation * pop() noexcept {
+
+		Operation *op = head;
+		if (op) {
+			head = op->next;
+			if (head == nullptr) {
+				tail = nullptr;
+			}
+			op->next = nullptr;
+		}
+		return op;
+
+	}
+};
+
+template <class T>
+struct Promise;
+
+/*
+ * Resumes whatever awaited a finished task. A task spawned on the executor
+ * has nothing awaiting it and frees itself.
+ */
+struct FinalAwaiter {
+	bool await_ready() noexcept { return false; }
+	template <class P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+	void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	Executor *executor = nullptr;				// Set for a spawned task.
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+} // namespace detail
+
+/*
+ * A coroutine that can be spawned on an executor or awaited by another
+ * task. It starts when spawned or awaited, not when called.
+ */
+template <class T = void>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+	Task(Task && other) noexcept : handle(std::exchange(other.handle, {})) {}
+	Task(const Task &) = delete;
+	Task & operator=(const Task &) = delete;
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+
+		handle.promise().continuation = awaiting;
+		return handle;
+
+	}
+
+	T await_resume() {
+
+		if (handle.promise().exception) {
+			std::rethrow_exception(handle.promise().exception);
+		}
+		if constexpr (!std::is_void_v<T>) {
+			return std::move(handle.promise().value);
+		}
+
+	}
+
+private:
+	friend class Executor;
+	std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template <class T>
+struct Promise : PromiseBase {
+	T value{};
+
+	Task<T> get_return_object() noexcept { return Task<T>(std::coroutine_handle<Promise>::from_promise(*this)); }
+	void return_value(T v) noexcept(std::is_nothrow_move_assignable_v<T>) { value = std::move(v); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object() noexcept { return Task<void>(std::coroutine_handle<Promise>::from_promise(*this)); }
+	void return_void() noexcept {}
+};
+
+} // namespace detail
+
+/*
+ * Runs module coroutines on the calling thread. Modules register their
+ * sockets with its epoll instance, and their operations are written out
+ * together once every coroutine that is ready has run.
+ */
+class Executor {
+public:
+	Executor() {
+
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			throw std::runtime_error("epoll_create1 failed");
+		}
+
+	}
+
+	~Executor() {
+
+		for (std::coroutine_handle<> h : starting) {
+			h.destroy();
+		}
+		close(epfd);
+
+	}
+
+	Executor(const Executor &) = delete;
+	Executor & operator=(const Executor &) = delete;
+
+	/*
+	 * Hands a task to the executor. It starts on the next pass of run().
+	 */
+	void spawn(Task<> task) {
+
+		auto h = std::exchange(task.handle, {});
+		h.promise().executor = this;
+		starting.push_back(h);
+		live++;
+
+	}
+
+	/*
+	 * Runs until every spawned task has finished. An exception that escapes
+	 * a spawned task is thrown from here.
+	 */
+	void run();
+
+	/*
+	 * Reserves room for n modules, so that opening them does not allocate
+	 * while tasks are running.
+	 */
+	void reserve(size_t n) {
+
+		dirty.reserve(n);
+		timers.reserve(n);
+
+	}
+
+private:
+	friend class Module;
+	friend struct detail::FinalAwaiter;
+
+	int epfd;
+	int live = 0;								// Spawned tasks not yet finished.
+	std::vector<std::coroutine_handle<>> starting;
+	detail::OperationList ready;				// Completed operations whose coroutines are to be resumed.
+	std::vector<Module *> dirty;				// Modules with operations to write.
+	std::vector<Module *> timers;				// Min-heap of modules by deadline.
+	std::exception_ptr failure;
+
+	void complete(detail::Operation * op, Status status) noexcept {
+
+		op->status = status;
+		ready.push(op);
+
+	}
+
+	void markDirty(Module * mod);
+	void timerSet(Module * mod, uint64_t deadline);
+	void timerSwap(size_t a, size_t b) noexcept;
+	void timerUp(size_t i) noexcept;
+	void timerDown(size_t i) noexcept;
+};
+
+/*
+ * A connection to one module. It connects when the first operation is
+ * awaited, and again after a failure. Operations on one module are
+ * pipelined up to its depth and answered in the order they were awaited.
+ *
+ * A module may be moved while nothing is queued or in flight on it.
+ * Operations still waiting when it is destroyed complete with an error.
+ */
+class Module {
+public:
+	template <class R>
+	class Awaitable;
+
+	Module(Executor & exec, const char * address, uint16_t port = DEFAULT_PORT) : executor(&exec) {
+
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+			throw std::invalid_argument("not an IPv4 address");
+		}
+
+	}
+
+	Module(Module && other) : executor(other.executor), addr(other.addr) {
+
+		take(other);
+
+	}
+
+	Module & operator=(Module && other) {
+
+		if (this != &other) {
+			shutdown(Status::error);
+			executor = other.executor;
+			addr = other.addr;
+			take(other);
+		}
+		return *this;
+
+	}
+
+	Module(const Module &) = delete;
+	Module & operator=(const Module &) = delete;
+
+	~Module() {
+
+		shutdown(Status::error);
+
+	}
+
+	/*
+	 * Sets how long an answer may take before the operations on the module
+	 * complete with Status::timeout and the connection is closed.
+	 */
+	void setTimeout(int ms) noexcept { timeout_ms = ms > 0 ? ms : 1; }
+
+	/*
+	 * Sets how many operations may be in flight at once (1 - MAX_DEPTH).
+	 */
+	void setDepth(int n) noexcept { depth = n < 1 ? 1 : n > MAX_DEPTH ? MAX_DEPTH : n; }
+
+	/*
+	 * The operations, one for each opcode.
+	 */
+	Awaitable<Value<Info>> info();
+	Awaitable<Value<uint8_t>> unlockTime();	// Seconds until the module locks, 0 if locked, 255 if it has no password.
+	Awaitable<Status> sendPassword(const char * password);
+	Awaitable<Status> logout();
+	Awaitable<Value<uint8_t>> state();		// One bit per output.
+	Awaitable<Status> set(int output, bool on, uint8_t pulse = 0);
+
+private:
+	friend class Executor;
+
+	Executor *executor;
+	struct sockaddr_in addr;
+	int fd = -1;
+	bool connecting = false;
+	bool is_dirty = false;
+	int depth = 1;
+	int timeout_ms = DEFAULT_TIMEOUT_MS;
+	detail::OperationList queue;				// Awaited but not yet written.
+	detail::OperationList inflight;				// Written, waiting for their answers in order.
+	int inflight_count = 0;
+	uint8_t out[MAX_DEPTH * CMD_MAX_REQUEST];	// Frames not yet taken by the kernel.
+	int out_head = 0;
+	int out_tail = 0;
+	uint8_t rx[MAX_DEPTH * CMD_MAX_RESPONSE];	// Responses read but not yet matched.
+	int rx_len = 0;
+	uint64_t deadline = 0;						// When the head operation times out, 0 if none.
+	size_t timer_index = 0;						// Position in the executor's heap while deadline is set.
+
+	/*
+	 * Takes over an idle module, including its open connection.
+	 */
+	void take(Module & other) {
+
+		if (other.queue.head || other.inflight.head || other.connecting) {
+			throw std::logic_error("eth008::Module moved while busy");
+		}
+		fd = std::exchange(other.fd, -1);
+		depth = other.depth;
+		timeout_ms = other.timeout_ms;
+		if (fd >= 0) {
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.ptr = this;
+			epoll_ctl(executor->epfd, EPOLL_CTL_MOD, fd, &ev);
+		}
+
+	}
+
+	bool submit(detail::Operation * op) {
+
+		queue.push(op);
+		executor->markDirty(this);
+		return true;
+
+	}
+
+	/*
+	 * Closes the connection and completes every operation it holds with
+	 * the given status.
+	 */
+	void fail(Status status) {
+
+		if (fd >= 0) {
+			close(fd); // Also takes it out of the epoll set.
+			fd = -1;
+		}
+		connecting = false;
+		out_head = out_tail = 0;
+		rx_len = 0;
+		inflight_count = 0;
+		executor->timerSet(this, 0);
+
+		while (detail::Operation *op = inflight.pop()) {
+			executor->complete(op, status);
+		}
+		while (detail::Operation *op = queue.pop()) {
+			executor->complete(op, status);
+		}
+
+	}
+
+	void shutdown(Status status) {
+
+		fail(status);
+		if (is_dirty) {
+			for (Module *&m : executor->dirty) {
+				if (m == this) {
+					m = nullptr;
+				}
+			}
+			is_dirty = false;
+		}
+
+	}
+
+	/*
+	 * Starts a non-blocking connect.
+	 */
+	void open() {
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			fail(Status::error);
+			return;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = this;
+		if (epoll_ctl(executor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			fail(Status::error);
+			return;
+		}
+
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+			fail(Status::error);
+			return;
+		}
+		connecting = true;
+		executor->timerSet(this, nowMs() + timeout_ms);
+
+	}
+
+	/*
+	 * Waits for the socket to take more (or not).
+	 */
+	void wantWrite(bool on) {
+
+		struct epoll_event ev = {};
+		ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		ev.data.ptr = this;
+		epoll_ctl(executor->epfd, EPOLL_CTL_MOD, fd, &ev);
+
+	}
+
+	/*
+	 * Writes out whatever the kernel will take of the pending frames. A
+	 * module that has gone away fails rather than raising SIGPIPE.
+	 */
+	void writeOut() {
+
+		while (out_head < out_tail) {
+			ssize_t n = send(fd, out + out_head, out_tail - out_head, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0 && errno == EAGAIN) {
+				wantWrite(true);
+				return;
+			}
+			if (n <= 0) {
+				fail(Status::error);
+				return;
+			}
+			out_head += (int) n;
+		}
+		if (out_head == out_tail) {
+			out_head = out_tail = 0;
+		}
+
+	}
+
+	/*
+	 * Moves as many queued operations onto the wire as the depth allows.
+	 */
+	void flush() {
+
+		if (queue.head == nullptr) {
+			return;
+		}
+		if (fd < 0) {
+			open();
+		}
+		if (fd < 0 || connecting) {
+			return;
+		}
+
+		// What the kernel has not taken yet moves to the front, so that
+		// new frames always land inside the buffer.
+		if (out_head > 0) {
+			std::memmove(out, out + out_head, out_tail - out_head);
+			out_tail -= out_head;
+			out_head = 0;
+		}
+
+		bool started = inflight.head == nullptr;
+		uint64_t now = nowMs();
+		while (queue.head && inflight_count < depth
+				&& out_tail + queue.head->request_len <= (int) sizeof(out)) {
+			detail::Operation *op = queue.pop();
+			std::memcpy(out + out_tail, op->request, op->request_len);
+			out_tail += op->request_len;
+			op->sent = now;
+			inflight.push(op);
+			inflight_count++;
+		}
+
+		if (started && inflight.head) {
+			executor->timerSet(this, now + timeout_ms);
+		}
+		writeOut();
+
+	}
+
+	/*
+	 * Matches the answers read so far to the operations in flight.
+	 */
+	void parse() {
+
+		int used = 0;
+		while (inflight.head && rx_len - used >= inflight.head->response_len) {
+			detail::Operation *op = inflight.pop();
+			inflight_count--;
+			std::memcpy(op->response, rx + used, op->response_len);
+			used += op->response_len;
+			CommandDesc d = commandDesc(op->op);
+			executor->complete(op, (op->response[0] & d.ok_mask) == d.ok_value ? Status::ok : Status::rejected);
+		}
+		if (used < rx_len && inflight.head == nullptr) {
+			fail(Status::error); // An answer nothing asked for, the stream is out of step.
+			return;
+		}
+		std::memmove(rx, rx + used, rx_len - used);
+		rx_len -= used;
+
+		executor->timerSet(this, inflight.head ? inflight.head->sent + timeout_ms : 0);
+		if (queue.head) {
+			executor->markDirty(this);
+		}
+
+	}
+
+	void onEvent(uint32_t events) {
+
+		if (fd < 0) {
+			return; // Failed earlier in the same batch of events.
+		}
+		if (connecting) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+				fail(Status::error);
+				return;
+			}
+			if (!(events & EPOLLOUT)) {
+				return;
+			}
+			connecting = false;
+			executor->timerSet(this, 0);
+			wantWrite(false);
+			flush();
+			return;
+		}
+
+		if (events & EPOLLOUT) {
+			writeOut();
+			if (fd >= 0 && out_head == out_tail) {
+				wantWrite(false);
+				if (queue.head) {
+					executor->markDirty(this); // Frames that did not fit go now.
+				}
+			}
+		}
+
+		if (fd >= 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+			ssize_t n;
+			do {
+				n = read(fd, rx + rx_len, sizeof(rx) - rx_len);
+			} while (n < 0 && errno == EINTR);
+			if (n < 0 && errno == EAGAIN) {
+				return;
+			}
+			if (n <= 0) {
+				fail(Status::error);
+				return;
+			}
+			rx_len += (int) n;
+			parse();
+		}
+
+	}
+};
+
+/*
+ * An operation awaited on a module. It is created by one of the module's
+ * operation functions and awaited at once; it cannot be copied or moved.
+ */
+template <class R>
+class Module::Awaitable : detail::Operation {
+public:
+	Awaitable(Module * m, uint8_t opcode, const uint8_t * args, int len) : Operation(opcode, args, len), mod(m) {}
+
+	bool await_ready() noexcept {
+
+		if (request_len == 0) {
+			status = Status::error;
+			return true;
+		}
+		return false;
+
+	}
+
+	bool await_suspend(std::coroutine_handle<> h) {
+
+		waiter = h;
+		return mod->submit(this);
+
+	}
+
+	R await_resume() noexcept {
+
+		if constexpr (std::is_same_v<R, Status>) {
+			return status;
+		} else if constexpr (std::is_same_v<R, Value<Info>>) {
+			return { status, { response[0], response[1], response[2] } };
+		} else {
+			return { status, response[0] };
+		}
+
+	}
+
+private:
+	Module *mod;
+};
+
+inline Module::Awaitable<Value<Info>> Module::info() {
+
+	return { this, GET_INFO, nullptr, 0 };
+
+}
+
+inline Module::Awaitable<Value<uint8_t>> Module::unlockTime() {
+
+	return { this, GET_UNLOCK, nullptr, 0 };
+
+}
+
+inline Module::Awaitable<Status> Module::sendPassword(const char * password) {
+
+	return { this, SEND_PASSWORD, (const uint8_t *) password, (int) std::strlen(password) };
+
+}
+
+inline Module::Awaitable<Status> Module::logout() {
+
+	return { this, LOGOUT, nullptr, 0 };
+
+}
+
+inline Module::Awaitable<Value<uint8_t>> Module::state() {
+
+	return { this, GET_DIGITAL_OUTPUTS, nullptr, 0 };
+
+}
+
+inline Module::Awaitable<Status> Module::set(int output, bool on, uint8_t pulse) {
+
+	uint8_t args[2] = { (uint8_t) output, pulse };
+	return { this, (output < 1 || output > 8) ? (uint8_t) 0 : on ? SET_OUTPUT_ACTIVE : SET_OUTPUT_INACTIVE, args, 2 };
+
+}
+
+template <class P>
+std::coroutine_handle<> detail::FinalAwaiter::await_suspend(std::coroutine_handle<P> h) noexcept {
+
+	PromiseBase &p = h.promise();
+	if (p.continuation) {
+		return p.continuation;
+	}
+
+	Executor *exec = p.executor;
+	if (p.exception && !exec->failure) {
+		exec->failure = p.exception;
+	}
+	exec->live--;
+	h.destroy();
+	return std::noop_coroutine();
+
+}
+
+inline void Executor::markDirty(Module * mod) {
+
+	if (!mod->is_dirty) {
+		mod->is_dirty = true;
+		dirty.push_back(mod);
+	}
+
+}
+
+inline void Executor::timerSwap(size_t a, size_t b) noexcept {
+
+	std::swap(timers[a], timers[b]);
+	timers[a]->timer_index = a;
+	timers[b]->timer_index = b;
+
+}
+
+inline void Executor::timerUp(size_t i) noexcept {
+
+	while (i > 0 && timers[(i - 1) / 2]->deadline > timers[i]->deadline) {
+		timerSwap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+}
+
+inline void Executor::timerDown(size_t i) noexcept {
+
+	for (;;) {
+		size_t smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < timers.size() && timers[l]->deadline < timers[smallest]->deadline) smallest = l;
+		if (r < timers.size() && timers[r]->deadline < timers[smallest]->deadline) smallest = r;
+		if (smallest == i) {
+			return;
+		}
+		timerSwap(i, smallest);
+		i = smallest;
+	}
+
+}
+
+/*
+ * Sets the deadline of a module, 0 to take it out of the heap.
+ */
+inline void Executor::timerSet(Module * mod, uint64_t deadline) {
+
+	bool queued = mod->deadline != 0;
+	mod->deadline = deadline;
+
+	if (deadline == 0) {
+		if (queued) {
+			size_t i = mod->timer_index;
+			timerSwap(i, timers.size() - 1);
+			timers.pop_back();
+			if (i < timers.size()) {
+				timerUp(i);
+				timerDown(i);
+			}
+		}
+		return;
+	}
+
+	if (!queued) {
+		mod->timer_index = timers.size();
+		timers.push_back(mod);
+	}
+	timerUp(mod->timer_index);
+	timerDown(mod->timer_index);
+
+}
+
+inline void Executor::run() {
+
+	struct epoll_event events[256];
+
+	while (live > 0) {
+
+		// Start what was spawned, then resume everything whose operation completed.
+		for (size_t i = 0; i < starting.size(); i++) {
+			starting[i].resume();
+		}
+		starting.clear();
+		while (detail::Operation *op = ready.pop()) {
+			op->waiter.resume();
+		}
+		if (failure) {
+			std::rethrow_exception(std::exchange(failure, nullptr));
+		}
+
+		// Write out what the coroutines asked for, several frames per write.
+		for (size_t i = 0; i < dirty.size(); i++) {
+			if (Module *mod = dirty[i]) {
+				mod->is_dirty = false;
+				mod->flush();
+			}
+		}
+		dirty.clear();
+
+		if (live == 0) {
+			break;
+		}
+
+		int timeout = -1;
+		if (ready.head || !starting.empty()) {
+			timeout = 0;
+		} else if (!timers.empty()) {
+			uint64_t now = nowMs();
+			timeout = timers[0]->deadline > now ? (int) (timers[0]->deadline - now) : 0;
+		}
+
+		int n = epoll_wait(epfd, events, 256, timeout);
+		if (n < 0 && errno != EINTR) {
+			throw std::runtime_error("epoll_wait failed");
+		}
+		for (int i = 0; i < n; i++) {
+			static_cast<Module *>(events[i].data.ptr)->onEvent(events[i].events);
+		}
+
+		uint64_t now = nowMs();
+		while (!timers.empty() && timers[0]->deadline <= now) {
+			timers[0]->fail(Status::timeout);
+		}
+
+	}
+
+}
+
+} // namespace eth008
+
+#endif